@@ -4,21 +4,33 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <random>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include "fnv.h"
 #include "murmur.h"
+#include "path_match.h"
 #include "path_rep.h"
 #include "util.h"
 
+#include <mio/mio.hpp>
+
 #ifdef _WIN32
 #include <Windows.h>
 #define DECOMPRESS_API WINAPI
@@ -29,18 +41,71 @@
 #define DECOMPRESS_API
 #endif
 
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define BUN_PREFETCH(p) _mm_prefetch((char const *)(p), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define BUN_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define BUN_PREFETCH(p)
+#endif
+
 size_t const SAFE_SPACE = 64;
 
+// Precedes the data of every BunMem.
+struct BunMemHeader {
+    std::atomic<int64_t> refs_;
+    int64_t size_;
+};
+
+static BunMemHeader *mem_header(BunMem mem) { return reinterpret_cast<BunMemHeader *>(mem - sizeof(BunMemHeader)); }
+
+void BunMemShrink(BunMem mem, int64_t new_size);
+
 using decompress_fun = int(DECOMPRESS_API *)(uint8_t const *src_buf, int src_len, uint8_t *dst, size_t dst_size, int,
                                              int, int, uint8_t *, size_t, void *, void *, void *, size_t, int);
 
+#ifdef BUN_LINK_OOZ
+extern "C" int Ooz_Decompress(uint8_t const *src_buf, int src_len, uint8_t *dst, size_t dst_size, int, int, int,
+                              uint8_t *, size_t, void *, void *, void *, size_t, int);
+#endif
+
+// Threads kept for the life of a Bun so that decoding a bundle doesn't start and join threads each time. A caller
+// queues its work for some helpers, runs it as well and then waits for the helpers that picked it up. Work hands out
+// blocks from a shared counter, so queue entries no helper took before the caller finished are simply dropped.
+struct worker_pool {
+    struct task {
+        std::function<void()> const *work_;
+        int running_;
+    };
+
+    explicit worker_pool(int thread_count);
+    ~worker_pool();
+    void run(std::function<void()> const &work, int helper_count);
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::deque<task *> queue_;
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+};
+
 struct Bun {
     std::shared_ptr<void> decompress_mod_;
     decompress_fun decompress_fun_;
+    int worker_count_ = 1;
+    // worker_count_ - 1 threads, the thread decoding a bundle is the remaining worker.
+    std::unique_ptr<worker_pool> pool_;
+    // Decode with the linked in-tree decoder, straight from the caller's buffer. External decompressors get a
+    // private copy of each block with a guard page behind it instead.
+    bool builtin_ = false;
 };
 
 struct bundle_info {
-    std::string name_;
+    // Null-terminated name in the string pool of the index image.
+    uint32_t name_offset_;
+    uint32_t name_size_;
     uint32_t uncompressed_size_;
 };
 
@@ -58,25 +123,117 @@ struct path_rep_info {
     uint32_t recursive_size;
 };
 
+// Open-addressing table from path hash to file id. A bucket fills a cache line with ten file ids and a 16-bit tag
+// from the top of each file's path hash; the full hash is only in file_infos_, where a tag match is confirmed. The
+// lower half of the hash picks the home bucket. Slots fill in order and probing moves on to the next bucket while
+// the current one is full. The hashes are uniform, so at 3/4 load most lookups touch a single bucket, and a miss
+// rarely has to read a file_info.
+struct path_bucket {
+    enum { SLOTS = 10 };
+    uint32_t file_ids_[SLOTS];
+    uint16_t tags_[SLOTS];
+    uint32_t pad_;
+};
+
+inline uint16_t path_tag(uint64_t hash) { return (uint16_t)(hash >> 48); }
+
+uint32_t const EMPTY_SLOT = 0xFFFFFFFF;
+
+inline size_t home_bucket(uint64_t hash, size_t bucket_count) {
+    return (size_t)(((hash & 0xFFFFFFFF) * bucket_count) >> 32);
+}
+
 enum class HashAlgorithm {
     Unknown,
     FNV1A_3_11_2,
     MurmurHash2A_3_21_2,
 };
 
+// The tables of an opened index live in one flat image: this header followed by 8-byte aligned arrays of
+// bundle_info, file_info, path_bucket and path_rep_info, and the bundle name pool. A cold open
+// builds the image from _.index.bin, and BunIndexOpenCached saves it with the path rep contents appended so that
+// a warm open only has to map the file. The path rep contents are preceded by a BunMemHeader so that they can be
+// handed out as a BunMem straight from the mapping.
+struct index_image_header {
+    uint64_t magic_;
+    uint32_t version_;
+    uint32_t hash_algorithm_;
+    // Stamp of the _.index.bin the image was built from, see BunIndex::file_stamp, or the FNV-1a of its contents if
+    // it has no stamp.
+    uint64_t key_;
+    uint64_t hash_seed_;
+    uint64_t bundles_offset_, bundle_count_;
+    uint64_t files_offset_, file_count_;
+    uint64_t path_buckets_offset_, path_bucket_count_;
+    uint64_t path_reps_offset_, path_rep_count_;
+    uint64_t names_offset_, names_size_;
+    uint64_t inner_offset_, inner_size_;
+};
+
+uint64_t const INDEX_IMAGE_MAGIC = 0x31584449'4E55425FULL; // "_BUNIDX1"
+uint32_t const INDEX_IMAGE_VERSION = 4;
+
+template <typename T> struct table {
+    T const *data_ = nullptr;
+    size_t size_ = 0;
+
+    size_t size() const { return size_; }
+    T const &operator[](size_t i) const { return data_[i]; }
+    T const *begin() const { return data_; }
+    T const *end() const { return data_ + size_; }
+};
+
+// Decompressed bundles, most recently used first. Each entry holds a reference to its BunMem so handles given out
+// stay valid after eviction.
+struct bundle_cache {
+    struct entry {
+        int32_t bundle_id_;
+        BunMem mem_;
+    };
+
+    // A lookup that isn't followed by decoding the whole bundle passes count_miss = false, so that misses only
+    // count bundles the cache could have saved.
+    BunMem find(int32_t bundle_id, bool count_miss = true);
+    void insert(int32_t bundle_id, BunMem mem);
+    void evict(uint64_t budget);
+    void evict_locked(uint64_t budget);
+
+    std::mutex mutex_;
+    std::list<entry> entries_;
+    std::unordered_map<int32_t, std::list<entry>::iterator> by_id_;
+    std::atomic<uint64_t> budget_{256ull << 20};
+    uint64_t size_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
 struct BunIndex {
     bool read_file(char const *path, std::vector<uint8_t> &out);
+    BunMem read_file(char const *path);
+    template <typename Alloc> bool read_file_into(char const *path, Alloc alloc);
+    uint64_t file_stamp(char const *path);
+    BunMem extract_bundle(int32_t bundle_id);
+    bool bind_image(uint8_t const *data, size_t size);
+    bool hash_paths(char const *const *paths, size_t count, uint64_t *path_hashes) const;
+    int32_t find_file(uint64_t path_hash) const;
+    void find_files(uint64_t const *path_hashes, size_t count, int32_t *file_ids) const;
+    char const *bundle_name(bundle_info const &bi) const { return names_ + bi.name_offset_; }
     Bun *bun_;
     Vfs *vfs_;
     std::string bundle_root_;
-    BunMem index_mem_;
-    std::vector<bundle_info> bundle_infos_;
-    std::vector<file_info> file_infos_;
-    std::vector<path_rep_info> path_rep_infos_;
-    std::unordered_map<uint64_t, uint32_t> path_hash_to_file_info_;
+    // Backing store of the tables, either built in memory or a mapped cache file.
+    std::vector<uint8_t> image_;
+    mio::mmap_source image_mapping_;
+    table<bundle_info> bundle_infos_;
+    table<file_info> file_infos_;
+    table<path_bucket> path_buckets_;
+    table<path_rep_info> path_rep_infos_;
+    char const *names_;
+    // Path rep contents, pointing into image_mapping_ when that is mapped and owned otherwise.
     BunMem inner_mem_;
     HashAlgorithm hash_algorithm_;
     uint64_t hash_seed_;
+    bundle_cache cache_;
 };
 
 inline uint64_t hash_path_3_21_2(std::string path, uint64_t seed) {
@@ -105,7 +262,123 @@ inline uint64_t hash_file_3_11_2(std::string path) {
     return fnv1a_64(path.data(), path.size());
 }
 
-bool BunIndex::read_file(char const *path, std::vector<uint8_t> &out) {
+// Batched forms of hash_path_3_21_2 and hash_file_3_11_2 for lookups. They lowercase while hashing instead of
+// copying the path, and hash four paths in lockstep over their common length so that the multiply chains of
+// independent paths overlap.
+
+// Lowercases the ASCII letters of eight bytes, which is all std::tolower does in the C locale.
+inline uint64_t lower8(uint64_t v) {
+    uint64_t low7 = v & 0x7F7F7F7F7F7F7F7FULL;
+    uint64_t above_z = low7 + 0x2525252525252525ULL;
+    uint64_t from_a = low7 + 0x3F3F3F3F3F3F3F3FULL;
+    uint64_t upper = (from_a ^ above_z) & ~v & 0x8080808080808080ULL;
+    return v | (upper >> 2);
+}
+
+inline uint64_t load_lower(char const *p, size_t n) {
+    uint64_t v = 0;
+    memcpy(&v, p, n);
+    return lower8(v);
+}
+
+inline uint8_t lower1(char c) {
+    uint8_t b = (uint8_t)c;
+    return (uint8_t)(b - 'A') < 26 ? b + 32 : b;
+}
+
+uint64_t const MURMUR_M = 0xc6a4a7935bd1e995ULL;
+uint64_t const FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+uint64_t const FNV_PRIME = 0x100000001b3ULL;
+size_t const HASH_LANES = 4;
+
+inline uint64_t murmur_block(uint64_t h, uint64_t k) {
+    k *= MURMUR_M;
+    k ^= k >> 47;
+    k *= MURMUR_M;
+    h ^= k;
+    return h * MURMUR_M;
+}
+
+inline uint64_t murmur_finish(uint64_t h, char const *p, size_t len, size_t pos) {
+    for (; pos + 8 <= len; pos += 8) {
+        h = murmur_block(h, load_lower(p + pos, 8));
+    }
+    if (len & 7) {
+        h ^= load_lower(p + pos, len & 7);
+        h *= MURMUR_M;
+    }
+    h ^= h >> 47;
+    h *= MURMUR_M;
+    h ^= h >> 47;
+    return h;
+}
+
+inline uint64_t fnv_finish(uint64_t h, char const *p, size_t len, size_t pos) {
+    for (; pos < len; ++pos) {
+        h = (h ^ lower1(p[pos])) * FNV_PRIME;
+    }
+    h = (h ^ '+') * FNV_PRIME;
+    return (h ^ '+') * FNV_PRIME;
+}
+
+static void hash_paths_3_21_2(char const *const *paths, size_t count, uint64_t seed, uint64_t *hashes) {
+    size_t lens[HASH_LANES];
+    uint64_t h[HASH_LANES];
+    for (size_t i = 0; i < count; i += HASH_LANES) {
+        size_t const lanes = (std::min)(HASH_LANES, count - i);
+        size_t common = SIZE_MAX;
+        for (size_t j = 0; j < lanes; ++j) {
+            size_t len = strlen(paths[i + j]);
+            while (len && paths[i + j][len - 1] == '/') {
+                --len;
+            }
+            lens[j] = len;
+            h[j] = seed ^ (len * MURMUR_M);
+            common = (std::min)(common, len & ~size_t(7));
+        }
+        if (lanes == HASH_LANES) {
+            for (size_t pos = 0; pos < common; pos += 8) {
+                for (size_t j = 0; j < HASH_LANES; ++j) {
+                    h[j] = murmur_block(h[j], load_lower(paths[i + j] + pos, 8));
+                }
+            }
+        } else {
+            common = 0;
+        }
+        for (size_t j = 0; j < lanes; ++j) {
+            hashes[i + j] = murmur_finish(h[j], paths[i + j], lens[j], common);
+        }
+    }
+}
+
+static void hash_files_3_11_2(char const *const *paths, size_t count, uint64_t *hashes) {
+    size_t lens[HASH_LANES];
+    uint64_t h[HASH_LANES];
+    for (size_t i = 0; i < count; i += HASH_LANES) {
+        size_t const lanes = (std::min)(HASH_LANES, count - i);
+        size_t common = SIZE_MAX;
+        for (size_t j = 0; j < lanes; ++j) {
+            lens[j] = strlen(paths[i + j]);
+            h[j] = FNV_OFFSET_BASIS;
+            common = (std::min)(common, lens[j]);
+        }
+        if (lanes == HASH_LANES) {
+            for (size_t pos = 0; pos < common; ++pos) {
+                for (size_t j = 0; j < HASH_LANES; ++j) {
+                    h[j] = (h[j] ^ lower1(paths[i + j][pos])) * FNV_PRIME;
+                }
+            }
+        } else {
+            common = 0;
+        }
+        for (size_t j = 0; j < lanes; ++j) {
+            hashes[i + j] = fnv_finish(h[j], paths[i + j], lens[j], common);
+        }
+    }
+}
+
+// Reads a file below the bundle root into the storage alloc(size) returns.
+template <typename Alloc> bool BunIndex::read_file_into(char const *path, Alloc alloc) {
     std::string full_path = bundle_root_ + '/' + path;
     if (vfs_) {
         auto fh = vfs_->open(vfs_, full_path.c_str());
@@ -113,8 +386,7 @@ bool BunIndex::read_file(char const *path, std::vector<uint8_t> &out) {
             return false;
         }
         auto size = vfs_->size(vfs_, fh);
-        out.resize(size);
-        bool success = vfs_->read(vfs_, fh, out.data(), 0, size) == size;
+        bool success = size >= 0 && vfs_->read(vfs_, fh, alloc((size_t)size), 0, size) == size;
 
         vfs_->close(vfs_, fh);
         return success;
@@ -126,9 +398,105 @@ bool BunIndex::read_file(char const *path, std::vector<uint8_t> &out) {
         is.seekg(0, std::ios::end);
         auto size = is.tellg();
         is.seekg(0, std::ios::beg);
+        return !!is.read(reinterpret_cast<char *>(alloc((size_t)size)), size);
+    }
+}
+
+// A value that changes whenever the file does, without reading it: the Vfs stamp, or the size and modification time
+// of a file on disk. 0 if there is none.
+uint64_t BunIndex::file_stamp(char const *path) {
+    std::string full_path = bundle_root_ + '/' + path;
+    uint64_t stamp = 0;
+    if (vfs_) {
+        if (vfs_->stamp) {
+            if (auto fh = vfs_->open(vfs_, full_path.c_str())) {
+                stamp = vfs_->stamp(vfs_, fh);
+                vfs_->close(vfs_, fh);
+            }
+        }
+    } else {
+        std::error_code ec;
+        uint64_t size_and_time[2] = {std::filesystem::file_size(full_path, ec), 0};
+        if (!ec) {
+            size_and_time[1] = (uint64_t)std::filesystem::last_write_time(full_path, ec).time_since_epoch().count();
+        }
+        if (!ec) {
+            stamp = fnv1a_64(size_and_time, sizeof(size_and_time));
+        }
+    }
+    return stamp;
+}
+
+bool BunIndex::read_file(char const *path, std::vector<uint8_t> &out) {
+    return read_file_into(path, [&](size_t size) {
         out.resize(size);
-        return !!is.read(reinterpret_cast<char *>(out.data()), out.size());
+        return out.data();
+    });
+}
+
+BunMem BunIndex::read_file(char const *path) {
+    BunMem mem = nullptr;
+    if (!read_file_into(path, [&](size_t size) { return mem = BunMemAlloc(size); })) {
+        BunMemFree(mem);
+        return nullptr;
+    }
+    return mem;
+}
+
+BunMem bundle_cache::find(int32_t bundle_id, bool count_miss) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto I = by_id_.find(bundle_id);
+    if (I == by_id_.end()) {
+        misses_ += count_miss;
+        return nullptr;
+    }
+    ++hits_;
+    entries_.splice(entries_.begin(), entries_, I->second);
+    return BunMemRetain(I->second->mem_);
+}
+
+void bundle_cache::insert(int32_t bundle_id, BunMem mem) {
+    uint64_t size = BunMemSize(mem);
+    uint64_t budget = budget_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size > budget || by_id_.count(bundle_id)) {
+        return;
+    }
+    entries_.push_front(entry{bundle_id, BunMemRetain(mem)});
+    by_id_[bundle_id] = entries_.begin();
+    size_ += size;
+    evict_locked(budget);
+}
+
+void bundle_cache::evict(uint64_t budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    evict_locked(budget);
+}
+
+void bundle_cache::evict_locked(uint64_t budget) {
+    while (size_ > budget) {
+        auto &e = entries_.back();
+        size_ -= BunMemSize(e.mem_);
+        by_id_.erase(e.bundle_id_);
+        BunMemFree(e.mem_);
+        entries_.pop_back();
+    }
+}
+
+BunMem BunIndex::extract_bundle(int32_t bundle_id) {
+    if (BunMem mem = cache_.find(bundle_id)) {
+        return mem;
+    }
+    std::string bundle_path = bundle_name(bundle_infos_[bundle_id]) + std::string(".bundle.bin");
+    std::vector<uint8_t> bundle_data;
+    if (!read_file(bundle_path.c_str(), bundle_data)) {
+        return nullptr;
+    }
+    BunMem mem = BunDecompressBundleAlloc(bun_, bundle_data.data(), bundle_data.size());
+    if (mem) {
+        cache_.insert(bundle_id, mem);
     }
+    return mem;
 }
 
 BUN_DLL_PUBLIC Bun *BunNew(char const *decompressor_path, char const *decompressor_export) {
@@ -166,8 +534,86 @@ BUN_DLL_PUBLIC Bun *BunNew(char const *decompressor_path, char const *decompress
     return bun.release();
 }
 
+BUN_DLL_PUBLIC Bun *BunNewBuiltin() {
+#ifdef BUN_LINK_OOZ
+    auto bun = std::make_unique<Bun>();
+    bun->decompress_fun_ = nullptr;
+    bun->builtin_ = true;
+    return bun.release();
+#else
+    return nullptr;
+#endif
+}
+
 BUN_DLL_PUBLIC void BunDelete(Bun *bun) { delete bun; }
 
+BUN_DLL_PUBLIC void BunSetWorkerCount(Bun *bun, int worker_count) {
+    if (bun) {
+        if (worker_count <= 0) {
+            worker_count = (std::max)(1, (int)std::thread::hardware_concurrency());
+        }
+        if (worker_count == bun->worker_count_) {
+            return;
+        }
+        bun->pool_.reset();
+        bun->worker_count_ = worker_count;
+        if (worker_count > 1) {
+            bun->pool_ = std::make_unique<worker_pool>(worker_count - 1);
+        }
+    }
+}
+
+worker_pool::worker_pool(int thread_count) {
+    for (int t = 0; t < thread_count; ++t) {
+        threads_.emplace_back([this] {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (stop_) {
+                    return;
+                }
+                task *next = queue_.front();
+                queue_.pop_front();
+                ++next->running_;
+                lock.unlock();
+                (*next->work_)();
+                lock.lock();
+                if (--next->running_ == 0) {
+                    done_.notify_all();
+                }
+            }
+        });
+    }
+}
+
+worker_pool::~worker_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &t : threads_) {
+        t.join();
+    }
+}
+
+void worker_pool::run(std::function<void()> const &work, int helper_count) {
+    task t{&work, 0};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.insert(queue_.end(), helper_count, &t);
+    }
+    if (helper_count == 1) {
+        wake_.notify_one();
+    } else {
+        wake_.notify_all();
+    }
+    work();
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_.erase(std::remove(queue_.begin(), queue_.end(), &t), queue_.end());
+    done_.wait(lock, [&] { return t.running_ == 0; });
+}
+
 std::string printable_string(uint32_t x) {
     std::string s;
     for (size_t i = 0; i < 4; ++i) {
@@ -212,30 +658,238 @@ std::string hex_dump(size_t width, uint8_t const *p, size_t n) {
     return s;
 }
 
-BUN_DLL_PUBLIC BunIndex *BunIndexOpen(Bun *bun, Vfs *vfs, char const *root_dir) {
-    auto idx = std::make_unique<BunIndex>();
-    idx->bun_ = bun;
-    idx->vfs_ = vfs;
-    idx->bundle_root_ = vfs ? "Bundles2" : (root_dir + std::string("/Bundles2"));
+template <typename T> static bool bind_table(table<T> &t, uint8_t const *data, size_t size, uint64_t offset,
+                                             uint64_t count) {
+    if (offset % 8 || offset > size || count > (size - offset) / sizeof(T)) {
+        return false;
+    }
+    t.data_ = reinterpret_cast<T const *>(data + offset);
+    t.size_ = count;
+    return true;
+}
 
-    std::vector<uint8_t> index_bin_src;
-    if (!idx->read_file("_.index.bin", index_bin_src)) {
-        fprintf(stderr, "Could not read _.index.bin\n");
-        return nullptr;
+bool BunIndex::bind_image(uint8_t const *data, size_t size) {
+    index_image_header h;
+    if (size < sizeof(h)) {
+        return false;
     }
-    auto index_bin_mem = BunDecompressBundleAlloc(bun, index_bin_src.data(), index_bin_src.size());
-    if (!index_bin_mem) {
-        fprintf(stderr, "Could not decompress _.index.bin\n");
-        return nullptr;
+    memcpy(&h, data, sizeof(h));
+    if (h.magic_ != INDEX_IMAGE_MAGIC || h.version_ != INDEX_IMAGE_VERSION ||
+        (h.hash_algorithm_ != (uint32_t)HashAlgorithm::FNV1A_3_11_2 &&
+         h.hash_algorithm_ != (uint32_t)HashAlgorithm::MurmurHash2A_3_21_2)) {
+        return false;
     }
-    fprintf(stderr, "Index bundle decompressed, %lld bytes\n", BunMemSize(index_bin_mem));
-    idx->index_mem_ = index_bin_mem;
+    table<char> names;
+    if (!bind_table(bundle_infos_, data, size, h.bundles_offset_, h.bundle_count_) ||
+        !bind_table(file_infos_, data, size, h.files_offset_, h.file_count_) ||
+        !bind_table(path_buckets_, data, size, h.path_buckets_offset_, h.path_bucket_count_) ||
+        !bind_table(path_rep_infos_, data, size, h.path_reps_offset_, h.path_rep_count_) ||
+        !bind_table(names, data, size, h.names_offset_, h.names_size_) || path_buckets_.size() > 0xFFFFFFFF) {
+        return false;
+    }
+    for (auto &bi : bundle_infos_) {
+        if ((uint64_t)bi.name_offset_ + bi.name_size_ >= names.size() || names[bi.name_offset_ + bi.name_size_]) {
+            return false;
+        }
+    }
+    // Every id the tables hold is used as an index without further checks.
+    for (auto &fi : file_infos_) {
+        if (fi.bundle_index_ >= bundle_infos_.size()) {
+            return false;
+        }
+    }
+    for (auto &bucket : path_buckets_) {
+        for (uint32_t id : bucket.file_ids_) {
+            if (id != EMPTY_SLOT && id >= file_infos_.size()) {
+                return false;
+            }
+        }
+    }
+    names_ = names.data_;
+    hash_algorithm_ = (HashAlgorithm)h.hash_algorithm_;
+    hash_seed_ = h.hash_seed_;
+    return true;
+}
+
+bool BunIndex::hash_paths(char const *const *paths, size_t count, uint64_t *path_hashes) const {
+    switch (hash_algorithm_) {
+    case HashAlgorithm::FNV1A_3_11_2:
+        hash_files_3_11_2(paths, count, path_hashes);
+        return true;
+    case HashAlgorithm::MurmurHash2A_3_21_2:
+        hash_paths_3_21_2(paths, count, hash_seed_, path_hashes);
+        return true;
+    default:
+        return false;
+    }
+}
+
+int32_t BunIndex::find_file(uint64_t path_hash) const {
+    size_t const bucket_count = path_buckets_.size();
+    size_t b = home_bucket(path_hash, bucket_count);
+    uint16_t const tag = path_tag(path_hash);
+    for (size_t probes = 0; probes < bucket_count; ++probes) {
+        auto &bucket = path_buckets_[b];
+        unsigned matches = 0, empty = 0;
+        for (int s = 0; s < path_bucket::SLOTS; ++s) {
+            matches |= (unsigned)(bucket.tags_[s] == tag) << s;
+            empty |= (unsigned)(bucket.file_ids_[s] == EMPTY_SLOT) << s;
+        }
+        matches &= ~empty;
+        for (int s = 0; matches; ++s, matches >>= 1) {
+            if ((matches & 1) && file_infos_[bucket.file_ids_[s]].path_hash_ == path_hash) {
+                return (int32_t)bucket.file_ids_[s];
+            }
+        }
+        if (empty) {
+            break;
+        }
+        b = b + 1 == bucket_count ? 0 : b + 1;
+    }
+    return -1;
+}
+
+// Prefetches the home buckets a few lookups ahead, and half as far ahead the file_infos whose tags match in the by
+// then cached bucket, so that the cache misses of a batch overlap.
+void BunIndex::find_files(uint64_t const *path_hashes, size_t count, int32_t *file_ids) const {
+    size_t const PREFETCH_DISTANCE = 16;
+    size_t const INFO_PREFETCH_DISTANCE = PREFETCH_DISTANCE / 2;
+    size_t const bucket_count = path_buckets_.size();
+    for (size_t i = 0; i < (std::min)(count, PREFETCH_DISTANCE); ++i) {
+        BUN_PREFETCH(&path_buckets_[home_bucket(path_hashes[i], bucket_count)]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (i + PREFETCH_DISTANCE < count) {
+            BUN_PREFETCH(&path_buckets_[home_bucket(path_hashes[i + PREFETCH_DISTANCE], bucket_count)]);
+        }
+        if (i + INFO_PREFETCH_DISTANCE < count) {
+            uint64_t hash = path_hashes[i + INFO_PREFETCH_DISTANCE];
+            auto &bucket = path_buckets_[home_bucket(hash, bucket_count)];
+            for (int s = 0; s < path_bucket::SLOTS; ++s) {
+                if (bucket.tags_[s] == path_tag(hash) && bucket.file_ids_[s] != EMPTY_SLOT) {
+                    BUN_PREFETCH(&file_infos_[bucket.file_ids_[s]]);
+                }
+            }
+        }
+        file_ids[i] = find_file(path_hashes[i]);
+    }
+}
+
+// Of files sharing a path hash the last one wins.
+static std::vector<path_bucket> build_path_table(std::vector<file_info> const &file_infos) {
+    path_bucket empty_bucket{};
+    std::fill(std::begin(empty_bucket.file_ids_), std::end(empty_bucket.file_ids_), EMPTY_SLOT);
+    std::vector<path_bucket> buckets(file_infos.size() * 4 / (3 * path_bucket::SLOTS) + 1, empty_bucket);
+    for (uint32_t i = 0; i < file_infos.size(); ++i) {
+        uint64_t hash = file_infos[i].path_hash_;
+        for (size_t b = home_bucket(hash, buckets.size());; b = b + 1 == buckets.size() ? 0 : b + 1) {
+            auto &bucket = buckets[b];
+            int s = 0;
+            while (s < path_bucket::SLOTS && bucket.file_ids_[s] != EMPTY_SLOT &&
+                   file_infos[bucket.file_ids_[s]].path_hash_ != hash) {
+                ++s;
+            }
+            if (s < path_bucket::SLOTS) {
+                bucket.file_ids_[s] = i;
+                bucket.tags_[s] = path_tag(hash);
+                break;
+            }
+        }
+    }
+    return buckets;
+}
+
+template <typename T> static uint64_t append_table(std::vector<uint8_t> &image, T const *data, size_t count) {
+    image.resize((image.size() + 7) & ~size_t(7));
+    uint64_t offset = image.size();
+    image.insert(image.end(), reinterpret_cast<uint8_t const *>(data),
+                 reinterpret_cast<uint8_t const *>(data + count));
+    return offset;
+}
 
+static std::filesystem::path index_cache_path(char const *cache_dir, uint64_t key) {
+    char name[64];
+    snprintf(name, sizeof(name), "_.index.%016llx.cache", (unsigned long long)key);
+    return std::filesystem::path(cache_dir) / name;
+}
+
+static bool open_index_cache(BunIndex *idx, std::filesystem::path const &path, uint64_t key) {
+    std::error_code ec;
+    if (!std::filesystem::exists(path, ec)) {
+        return false;
+    }
+    idx->image_mapping_.map(path.string(), ec);
+    if (ec) {
+        return false;
+    }
+    auto *data = reinterpret_cast<uint8_t const *>(idx->image_mapping_.data());
+    size_t size = idx->image_mapping_.size();
+    index_image_header h;
+    if (!idx->bind_image(data, size)) {
+        idx->image_mapping_.unmap();
+        return false;
+    }
+    memcpy(&h, data, sizeof(h));
+    if (h.key_ != key || h.inner_offset_ % 8 || h.inner_offset_ < sizeof(BunMemHeader) || h.inner_offset_ > size ||
+        h.inner_size_ > size - h.inner_offset_) {
+        idx->image_mapping_.unmap();
+        return false;
+    }
+    BunMem inner_mem = const_cast<uint8_t *>(data + h.inner_offset_);
+    if (BunMemSize(inner_mem) != (int64_t)h.inner_size_) {
+        idx->image_mapping_.unmap();
+        return false;
+    }
+    idx->inner_mem_ = inner_mem;
+    return true;
+}
+
+static void write_index_cache(BunIndex *idx, std::filesystem::path const &path) {
+    index_image_header h;
+    memcpy(&h, idx->image_.data(), sizeof(h));
+    uint64_t inner_header_offset = (idx->image_.size() + 7) & ~size_t(7);
+    h.inner_offset_ = inner_header_offset + sizeof(BunMemHeader);
+    h.inner_size_ = BunMemSize(idx->inner_mem_);
+    // The mapping is read-only, the reference count is never touched as the index doesn't free mapped contents.
+    int64_t const inner_header[2] = {1, (int64_t)h.inner_size_};
+    static_assert(sizeof(inner_header) == sizeof(BunMemHeader), "BunMemHeader layout");
+
+    // Every writer gets its own temporary file, so processes warming the same cache can't interleave their writes.
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), ".%08x.tmp", (unsigned)std::random_device{}());
+    std::filesystem::path tmp_path = path;
+    tmp_path += suffix;
+    bool written;
+    {
+        std::ofstream os(tmp_path, std::ios::binary);
+        os.write(reinterpret_cast<char const *>(&h), sizeof(h));
+        os.write(reinterpret_cast<char const *>(idx->image_.data() + sizeof(h)), idx->image_.size() - sizeof(h));
+        char const pad[8]{};
+        os.write(pad, inner_header_offset - idx->image_.size());
+        os.write(reinterpret_cast<char const *>(inner_header), sizeof(inner_header));
+        os.write(reinterpret_cast<char const *>(idx->inner_mem_), h.inner_size_);
+        written = !!os;
+    }
+    std::error_code ec;
+    if (!written) {
+        fprintf(stderr, "Could not write index cache \"%s\"\n", tmp_path.string().c_str());
+        std::filesystem::remove(tmp_path, ec);
+        return;
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+    }
+}
+
+// Parses a decompressed _.index.bin into the flat image.
+static bool build_index_image(BunIndex *idx, BunMem index_mem, uint64_t key) {
+    std::vector<bundle_info> bundle_infos;
+    std::string names;
     uint32_t bundle_count;
-    reader r{idx->index_mem_, (size_t)BunMemSize(idx->index_mem_)};
+    reader r{index_mem, (size_t)BunMemSize(index_mem)};
     r.read(bundle_count);
-    idx->bundle_infos_.reserve(bundle_count);
-    std::map<std::string, size_t> bundle_index_from_name;
+    bundle_infos.reserve(bundle_count);
     for (size_t i = 0; i < bundle_count; ++i) {
         bundle_info bi;
 
@@ -244,25 +898,20 @@ BUN_DLL_PUBLIC BunIndex *BunIndexOpen(Bun *bun, Vfs *vfs, char const *root_dir)
 
         std::vector<char> name_buf(name_length);
         r.read(name_buf);
-        bi.name_.assign(name_buf.begin(), name_buf.end());
+        bi.name_offset_ = (uint32_t)names.size();
+        bi.name_size_ = name_length;
+        names.append(name_buf.begin(), name_buf.end());
+        names += '\0';
 
         r.read(bi.uncompressed_size_);
 
-        bundle_index_from_name[bi.name_] = i;
-
-        idx->bundle_infos_.push_back(bi);
+        bundle_infos.push_back(bi);
     }
 
-    std::map<std::string, size_t> bundle_name_to_bundle_index;
-
-    std::vector<std::vector<std::string>> bundled_filenames(idx->bundle_infos_.size());
-
-    using FilenameBundle = std::map<std::string, size_t>;
-    FilenameBundle filename_bundle;
-
-    std::map<size_t, std::vector<size_t>> bundle_file_seqs;
+    std::vector<file_info> file_infos;
     uint32_t file_count;
     r.read(file_count);
+    file_infos.reserve(file_count);
     for (size_t i = 0; i < file_count; ++i) {
         file_info fi;
 
@@ -271,42 +920,38 @@ BUN_DLL_PUBLIC BunIndex *BunIndexOpen(Bun *bun, Vfs *vfs, char const *root_dir)
         r.read(fi.file_offset_);
         r.read(fi.file_size_);
 
-        idx->path_hash_to_file_info_[fi.path_hash_] = (uint32_t)i;
-
-        bundle_file_seqs[fi.bundle_index_].push_back(i);
-
-        idx->file_infos_.push_back(fi);
+        file_infos.push_back(fi);
     }
+    auto path_buckets = build_path_table(file_infos);
 
-    fprintf(stderr, "Bundle count in index binary: %zu\n", idx->bundle_infos_.size());
-    // fprintf(stderr, "Bundle count in index text:   %zu\n", text_bundle_count);
-    fprintf(stderr, "File count in index binary: %zu\n", idx->file_infos_.size());
-    // fprintf(stderr, "File count in index text:   %zu\n", text_file_count);
+    fprintf(stderr, "Bundle count in index binary: %zu\n", bundle_infos.size());
+    fprintf(stderr, "File count in index binary: %zu\n", file_infos.size());
 
     uint32_t some_count;
     r.read(some_count);
 
-    idx->path_rep_infos_.reserve(some_count);
+    std::vector<path_rep_info> path_rep_infos;
+    path_rep_infos.reserve(some_count);
     for (size_t i = 0; i < some_count; ++i) {
         path_rep_info si;
         r.read(si.hash);
         r.read(si.offset);
         r.read(si.size);
         r.read(si.recursive_size);
-        idx->path_rep_infos_.push_back(si);
+        path_rep_infos.push_back(si);
     }
 
     auto inner_mem = BunDecompressBundleAlloc(idx->bun_, r.p_, r.n_);
     idx->inner_mem_ = inner_mem;
     fprintf(stderr, "Decompressed inner size: %lld\n", BunMemSize(inner_mem));
 
-    idx->hash_algorithm_ = HashAlgorithm::Unknown;
-    idx->hash_seed_ = 0;
+    HashAlgorithm hash_algorithm = HashAlgorithm::Unknown;
+    uint64_t hash_seed = 0;
     if (some_count) {
-        auto root_hash = idx->path_rep_infos_[0].hash;
+        auto root_hash = path_rep_infos[0].hash;
         switch (root_hash) {
         case 0x07e47507b4a92e53:
-            idx->hash_algorithm_ = HashAlgorithm::FNV1A_3_11_2;
+            hash_algorithm = HashAlgorithm::FNV1A_3_11_2;
             break;
         default: {
             // Recover seed from root hash via math wizardry
@@ -315,8 +960,8 @@ BUN_DLL_PUBLIC BunIndex *BunIndexOpen(Bun *bun, Vfs *vfs, char const *root_dir)
             h *= 0x5F7A0EA7E59B19BDULL;
             h ^= h >> 47;
             bool seed_validated = true;
-            for (int i = 1; i < idx->path_rep_infos_.size(); ++i) {
-                auto &ref = idx->path_rep_infos_[i];
+            for (int i = 1; i < path_rep_infos.size(); ++i) {
+                auto &ref = path_rep_infos[i];
                 auto results = generate_paths(inner_mem + ref.offset, ref.size);
                 if (!results.empty()) {
                   auto &r = results[0];
@@ -330,27 +975,114 @@ BUN_DLL_PUBLIC BunIndex *BunIndexOpen(Bun *bun, Vfs *vfs, char const *root_dir)
                 }
             }
             if (seed_validated) {
-                idx->hash_algorithm_ = HashAlgorithm::MurmurHash2A_3_21_2;
-                idx->hash_seed_ = h;
-                fprintf(stderr, "Hash seed: 0x%016llx\n", idx->hash_seed_);
+                hash_algorithm = HashAlgorithm::MurmurHash2A_3_21_2;
+                hash_seed = h;
+                fprintf(stderr, "Hash seed: 0x%016llx\n", hash_seed);
             }
             break;
         }
         }
     }
 
-    if (idx->hash_algorithm_ == HashAlgorithm::Unknown) {
+    if (hash_algorithm == HashAlgorithm::Unknown) {
         fprintf(stderr, "Could not detect path hash algorithm/seed\n");
+        return false;
+    }
+
+    index_image_header h{};
+    h.magic_ = INDEX_IMAGE_MAGIC;
+    h.version_ = INDEX_IMAGE_VERSION;
+    h.hash_algorithm_ = (uint32_t)hash_algorithm;
+    h.key_ = key;
+    h.hash_seed_ = hash_seed;
+    auto &image = idx->image_;
+    image.resize(sizeof(h));
+    h.bundles_offset_ = append_table(image, bundle_infos.data(), h.bundle_count_ = bundle_infos.size());
+    h.files_offset_ = append_table(image, file_infos.data(), h.file_count_ = file_infos.size());
+    h.path_buckets_offset_ = append_table(image, path_buckets.data(), h.path_bucket_count_ = path_buckets.size());
+    h.path_reps_offset_ = append_table(image, path_rep_infos.data(), h.path_rep_count_ = path_rep_infos.size());
+    h.names_offset_ = append_table(image, names.data(), h.names_size_ = names.size());
+    memcpy(image.data(), &h, sizeof(h));
+    return idx->bind_image(image.data(), image.size());
+}
+
+BUN_DLL_PUBLIC BunIndex *BunIndexOpen(Bun *bun, Vfs *vfs, char const *root_dir) {
+    return BunIndexOpenCached(bun, vfs, root_dir, nullptr);
+}
+
+BUN_DLL_PUBLIC BunIndex *BunIndexOpenCached(Bun *bun, Vfs *vfs, char const *root_dir, char const *cache_dir) {
+    auto idx = std::make_unique<BunIndex>();
+    idx->bun_ = bun;
+    idx->vfs_ = vfs;
+    idx->bundle_root_ = vfs ? "Bundles2" : (root_dir + std::string("/Bundles2"));
+    idx->inner_mem_ = nullptr;
+
+    // With a stamp a warm open doesn't read _.index.bin at all, otherwise the cache is keyed by its contents.
+    uint64_t key = cache_dir ? idx->file_stamp("_.index.bin") : 0;
+    std::filesystem::path cache_path;
+    if (key) {
+        cache_path = index_cache_path(cache_dir, key);
+        if (open_index_cache(idx.get(), cache_path, key)) {
+            return idx.release();
+        }
+    }
+
+    std::vector<uint8_t> index_bin_src;
+    if (!idx->read_file("_.index.bin", index_bin_src)) {
+        fprintf(stderr, "Could not read _.index.bin\n");
         return nullptr;
     }
+    if (!key) {
+        key = fnv1a_64(index_bin_src.data(), index_bin_src.size());
+        if (cache_dir) {
+            cache_path = index_cache_path(cache_dir, key);
+            if (open_index_cache(idx.get(), cache_path, key)) {
+                return idx.release();
+            }
+        }
+    }
 
+    auto index_bin_mem = BunDecompressBundleAlloc(bun, index_bin_src.data(), index_bin_src.size());
+    if (!index_bin_mem) {
+        fprintf(stderr, "Could not decompress _.index.bin\n");
+        return nullptr;
+    }
+    fprintf(stderr, "Index bundle decompressed, %lld bytes\n", BunMemSize(index_bin_mem));
+    bool built = build_index_image(idx.get(), index_bin_mem, key);
+    BunMemFree(index_bin_mem);
+    if (!built) {
+        BunMemFree(idx->inner_mem_);
+        return nullptr;
+    }
+    if (cache_dir) {
+        write_index_cache(idx.get(), cache_path);
+    }
     return idx.release();
 }
 
 BUN_DLL_PUBLIC void BunIndexClose(BunIndex *idx) {
     if (idx) {
-        BunMemFree(idx->index_mem_);
-        BunMemFree(idx->inner_mem_);
+        if (!idx->image_mapping_.is_mapped()) {
+            BunMemFree(idx->inner_mem_);
+        }
+        idx->cache_.evict(0);
+        delete idx;
+    }
+}
+
+BUN_DLL_PUBLIC void BunIndexSetCacheBudget(BunIndex *idx, uint64_t budget) {
+    if (idx) {
+        idx->cache_.budget_ = budget;
+        idx->cache_.evict(budget);
+    }
+}
+
+BUN_DLL_PUBLIC void BunIndexCacheStats(BunIndex *idx, uint64_t *hits, uint64_t *misses, uint64_t *size) {
+    if (idx) {
+        std::lock_guard<std::mutex> lock(idx->cache_.mutex_);
+        *hits = idx->cache_.hits_;
+        *misses = idx->cache_.misses_;
+        *size = idx->cache_.size_;
     }
 }
 
@@ -360,21 +1092,30 @@ BUN_DLL_PUBLIC int32_t BunIndexLookupFileByPath(BunIndex *idx, char const *path)
     }
 
     uint64_t path_hash{};
-    switch (idx->hash_algorithm_) { case HashAlgorithm::FNV1A_3_11_2:
-        path_hash = hash_file_3_11_2(path);
-        break;
-    case HashAlgorithm::MurmurHash2A_3_21_2:
-        path_hash = hash_path_3_21_2(path, idx->hash_seed_);
-        break;
-    default:
+    if (!idx->hash_paths(&path, 1, &path_hash)) {
+        return -1;
+    }
+    return idx->find_file(path_hash);
+}
+
+BUN_DLL_PUBLIC int32_t BunIndexLookupFilesByPath(BunIndex *idx, char const *const *paths, size_t count,
+                                                 int32_t *file_ids) {
+    if (!idx) {
         return -1;
     }
 
-    auto I = idx->path_hash_to_file_info_.find(path_hash);
-    if (I != idx->path_hash_to_file_info_.end()) {
-        return I->second;
+    size_t const BATCH_SIZE = 256;
+    uint64_t path_hashes[BATCH_SIZE];
+    int32_t found = 0;
+    for (size_t i = 0; i < count; i += BATCH_SIZE) {
+        size_t n = (std::min)(BATCH_SIZE, count - i);
+        if (!idx->hash_paths(paths + i, n, path_hashes)) {
+            return -1;
+        }
+        idx->find_files(path_hashes, n, file_ids + i);
+        found += (int32_t)std::count_if(file_ids + i, file_ids + i + n, [](int32_t id) { return id >= 0; });
     }
-    return -1;
+    return found;
 }
 
 BUN_DLL_PUBLIC BunMem BunIndexExtractFile(BunIndex *idx, int32_t file_id) {
@@ -384,15 +1125,32 @@ BUN_DLL_PUBLIC BunMem BunIndexExtractFile(BunIndex *idx, int32_t file_id) {
 
     auto &fi = idx->file_infos_[file_id];
     auto &bi = idx->bundle_infos_[fi.bundle_index_];
-    std::filesystem::path bundle_path = idx->bundle_root_;
-    bundle_path /= bi.name_ + ".bundle.bin";
 
+    // A file is copied out of its bundle if that is cached, otherwise only the blocks covering it are decoded. The
+    // cache is filled by BunIndexExtractBundle alone, so reading single files doesn't decode whole bundles.
+    if (BunMem bundle_mem = idx->cache_.find(fi.bundle_index_, false)) {
+        if ((uint64_t)fi.file_offset_ + fi.file_size_ > (uint64_t)BunMemSize(bundle_mem)) {
+            BunMemFree(bundle_mem);
+            return nullptr;
+        }
+        BunMem ret_mem = BunMemAlloc(fi.file_size_);
+        memcpy(ret_mem, bundle_mem + fi.file_offset_, fi.file_size_);
+        BunMemFree(bundle_mem);
+        return ret_mem;
+    }
+
+    std::string bundle_path = idx->bundle_name(bi) + std::string(".bundle.bin");
     std::vector<uint8_t> bundle_data;
-    slurp_file(bundle_path, bundle_data);
-    BunMem all_data = BunDecompressBundleAlloc(idx->bun_, bundle_data.data(), bundle_data.size());
-    BunMem ret_mem = BunMemAlloc(fi.file_size_);
-    memcpy(ret_mem, all_data + fi.file_offset_, fi.file_size_);
-    BunMemFree(all_data);
+    if (!idx->read_file(bundle_path.c_str(), bundle_data)) {
+        return nullptr;
+    }
+    BunMem ret_mem = BunMemAlloc(fi.file_size_ + SAFE_SPACE);
+    if (BunDecompressBundleRange(idx->bun_, bundle_data.data(), bundle_data.size(), fi.file_offset_, ret_mem,
+                                 fi.file_size_) != fi.file_size_) {
+        BunMemFree(ret_mem);
+        return nullptr;
+    }
+    BunMemShrink(ret_mem, fi.file_size_);
     return ret_mem;
 }
 
@@ -401,15 +1159,16 @@ BUN_DLL_PUBLIC BunMem BunIndexExtractBundle(BunIndex *idx, int32_t bundle_id) {
         return nullptr;
     }
 
-    auto &bi = idx->bundle_infos_[bundle_id];
-
-    std::string bundle_path = bi.name_ + ".bundle.bin";
+    return idx->extract_bundle(bundle_id);
+}
 
-    std::vector<uint8_t> bundle_data;
-    if (!idx->read_file(bundle_path.c_str(), bundle_data)) {
+BUN_DLL_PUBLIC BunMem BunIndexReadBundle(BunIndex *idx, int32_t bundle_id) {
+    if (!idx || bundle_id < 0 || bundle_id >= idx->bundle_infos_.size()) {
         return nullptr;
     }
-    return BunDecompressBundleAlloc(idx->bun_, bundle_data.data(), bundle_data.size());
+
+    std::string bundle_path = idx->bundle_name(idx->bundle_infos_[bundle_id]) + std::string(".bundle.bin");
+    return idx->read_file(bundle_path.c_str());
 }
 
 BUN_DLL_PUBLIC int BunIndexBundleInfo(BunIndex const *idx, int32_t bundle_info_id, char const **name,
@@ -418,7 +1177,7 @@ BUN_DLL_PUBLIC int BunIndexBundleInfo(BunIndex const *idx, int32_t bundle_info_i
         return -1;
     }
     auto &bi = idx->bundle_infos_[bundle_info_id];
-    *name = bi.name_.c_str();
+    *name = idx->bundle_name(bi);
     *uncompressed_size = bi.uncompressed_size_;
     return 0;
 }
@@ -456,6 +1215,93 @@ BUN_DLL_PUBLIC BunMem BunIndexPathRepContents(BunIndex const *idx) {
     return idx->inner_mem_;
 }
 
+struct BunPathMatcher {
+    path_matcher matcher_;
+    bool compiled_ = false;
+};
+
+BUN_DLL_PUBLIC BunPathMatcher *BunPathMatcherNew() { return new BunPathMatcher; }
+
+BUN_DLL_PUBLIC void BunPathMatcherDelete(BunPathMatcher *matcher) { delete matcher; }
+
+BUN_DLL_PUBLIC int BunPathMatcherAddGlob(BunPathMatcher *matcher, char const *pattern) {
+    if (!matcher || matcher->compiled_ || !matcher->matcher_.add_glob(pattern)) {
+        return -1;
+    }
+    return 0;
+}
+
+BUN_DLL_PUBLIC int BunPathMatcherAddRegex(BunPathMatcher *matcher, char const *pattern) {
+    if (!matcher || matcher->compiled_ || !matcher->matcher_.add_regex(pattern)) {
+        return -1;
+    }
+    return 0;
+}
+
+BUN_DLL_PUBLIC int BunPathMatcherCompile(BunPathMatcher *matcher, int case_fold) {
+    if (!matcher || !matcher->matcher_.compile(case_fold != 0)) {
+        return -1;
+    }
+    matcher->compiled_ = true;
+    return 0;
+}
+
+BUN_DLL_PUBLIC int BunPathMatcherMatch(BunPathMatcher const *matcher, char const *path, size_t path_size) {
+    return matcher && matcher->compiled_ && matcher->matcher_.match(std::string_view(path, path_size));
+}
+
+static int visit_paths(BunIndex const *idx, path_matcher const *matcher, int worker_count, BunPathVisitor visit,
+                       void *user) {
+    if (worker_count <= 0) {
+        worker_count = (std::max)(1, (int)std::thread::hardware_concurrency());
+    }
+
+    size_t const rep_count = idx->path_rep_infos_.size();
+    uint64_t const inner_size = BunMemSize(idx->inner_mem_);
+    std::atomic<size_t> next_rep{0};
+    std::atomic<bool> failed{false};
+    auto worker = [&](int worker_id) {
+        path_rep_generator gen;
+        size_t i;
+        while (!failed && (i = next_rep++) < rep_count) {
+            auto &ref = idx->path_rep_infos_[i];
+            auto emit = [&](std::string_view path) { visit(user, worker_id, (int32_t)i, path.data(), path.size()); };
+            if ((uint64_t)ref.offset + ref.size > inner_size ||
+                !(matcher ? gen.generate_matching(idx->inner_mem_ + ref.offset, ref.size, *matcher, emit)
+                          : gen.generate(idx->inner_mem_ + ref.offset, ref.size, emit))) {
+                failed = true;
+                break;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    size_t thread_count = (std::min<size_t>)(worker_count, rep_count);
+    for (size_t t = 1; t < thread_count; ++t) {
+        threads.emplace_back(worker, (int)t);
+    }
+    worker(0);
+    for (auto &t : threads) {
+        t.join();
+    }
+    return failed ? -1 : 0;
+}
+
+BUN_DLL_PUBLIC int BunIndexVisitPaths(BunIndex const *idx, int worker_count, BunPathVisitor visit, void *user) {
+    if (!idx || !visit) {
+        return -1;
+    }
+    return visit_paths(idx, nullptr, worker_count, visit, user);
+}
+
+BUN_DLL_PUBLIC int BunIndexVisitMatchingPaths(BunIndex const *idx, BunPathMatcher const *matcher, int worker_count,
+                                              BunPathVisitor visit, void *user) {
+    if (!idx || !matcher || !matcher->compiled_ || !visit) {
+        return -1;
+    }
+    return visit_paths(idx, &matcher->matcher_, worker_count, visit, user);
+}
+
 BUN_DLL_PUBLIC int BunIndexPathRepLowercase(BunIndex const *idx) {
     if (!idx) {
         return 0;
@@ -475,7 +1321,7 @@ BUN_DLL_PUBLIC int32_t BunIndexBundleIdByName(BunIndex *idx, char const *name) {
         return -1;
     }
     for (size_t i = 0; i < idx->bundle_infos_.size(); ++i) {
-        if (idx->bundle_infos_[i].name_ == name) {
+        if (!strcmp(idx->bundle_name(idx->bundle_infos_[i]), name)) {
             return static_cast<int32_t>(i);
         }
     }
@@ -496,9 +1342,8 @@ BUN_DLL_PUBLIC BunMem BunIndexBundleName(BunIndex *idx, int32_t bundle_id) {
         return nullptr;
     }
     auto &bi = idx->bundle_infos_[bundle_id];
-    auto &name = bi.name_;
-    BunMem ret = BunMemAlloc(name.size() + 1);
-    memcpy(ret, name.c_str(), name.size() + 1);
+    BunMem ret = BunMemAlloc(bi.name_size_ + 1);
+    memcpy(ret, idx->bundle_name(bi), bi.name_size_ + 1);
     return ret;
 }
 
@@ -535,33 +1380,33 @@ int32_t BunIndexBundleFileSize(BunIndex *idx, int32_t bundle_id, int32_t file_id
     return -1;
 }
 
-using BunMemHeader = int64_t;
-
 BunMem BunMemAlloc(size_t size) {
-    BunMemHeader h = size;
     uint8_t *p = new uint8_t[sizeof(BunMemHeader) + size];
-    memcpy(p, &h, sizeof(BunMemHeader));
+    auto *h = new (p) BunMemHeader;
+    h->refs_ = 1;
+    h->size_ = size;
     return p + sizeof(BunMemHeader);
 }
 
+BunMem BunMemRetain(BunMem mem) {
+    if (mem) {
+        ++mem_header(mem)->refs_;
+    }
+    return mem;
+}
+
 int64_t BunMemSize(BunMem mem) {
     if (!mem) {
         return -1;
     }
-    BunMemHeader h;
-    memcpy(&h, mem - sizeof(BunMemHeader), sizeof(BunMemHeader));
-    return h;
+    return mem_header(mem)->size_;
 }
 
 void BunMemShrink(BunMem mem, int64_t new_size) {
     if (mem) {
-        uint8_t *header_ptr = mem - sizeof(BunMemHeader);
-        size_t const header_size = sizeof(BunMemHeader);
-        BunMemHeader h;
-        memcpy(&h, header_ptr, header_size);
-        if (h >= new_size) {
-            h = new_size;
-            memcpy(header_ptr, &h, header_size);
+        auto *h = mem_header(mem);
+        if (h->size_ >= new_size) {
+            h->size_ = new_size;
         }
     }
 }
@@ -570,8 +1415,11 @@ void BunMemFree(BunMem mem) {
     if (!mem) {
         return;
     }
-    uint8_t *p = mem - sizeof(BunMemHeader);
-    delete[] p;
+    auto *h = mem_header(mem);
+    if (--h->refs_ == 0) {
+        h->~BunMemHeader();
+        delete[] reinterpret_cast<uint8_t *>(h);
+    }
 }
 
 #ifdef _WIN32
@@ -603,6 +1451,11 @@ void ro_free(uint8_t *s, size_t src_size) {
 #endif
 
 int BunDecompressBlock(Bun *bun, uint8_t const *src_data, size_t src_size, uint8_t *dst_data, size_t dst_size) {
+#ifdef BUN_LINK_OOZ
+    if (bun->builtin_) {
+        return Ooz_Decompress(src_data, (int)src_size, dst_data, dst_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    }
+#endif
     auto *s = ro_clone(src_data, src_size);
     int res = bun->decompress_fun_(s, (int)src_size, dst_data, (int)dst_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
     ro_free(s, src_size);
@@ -614,9 +1467,7 @@ BunMem BunDecompressBlockAlloc(Bun *bun, uint8_t const *src_data, size_t src_siz
     for (size_t i = 0; i < SAFE_SPACE; ++i) {
         mem[dst_size + i] = 0xCD;
     }
-    auto *s = ro_clone(src_data, src_size);
-    int res = bun->decompress_fun_(s, (int)src_size, mem, (int)dst_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-    ro_free(s, src_size);
+    int res = BunDecompressBlock(bun, src_data, src_size, mem, dst_size);
     if (res != dst_size) {
         BunMemFree(mem);
         return nullptr;
@@ -644,13 +1495,59 @@ struct bundle_fixed_header {
     uint32_t unk28[5];
 };
 
+static bool read_fixed_header(reader &r, bundle_fixed_header &fix_h) {
+    return r.read(fix_h.uncompressed_size) && r.read(fix_h.total_payload_size) && r.read(fix_h.head_payload_size) &&
+           r.read(fix_h.first_file_encode) && r.read(fix_h.unk10) && r.read(fix_h.uncompressed_size2) &&
+           r.read(fix_h.total_payload_size2) && r.read(fix_h.block_count) && r.read(fix_h.unk28);
+}
+
+// Decodes the blocks of a bundle on the Bun's worker pool. A decoder writes past the end of its output, which here
+// would be the start of a block another worker may already have written, so each worker decodes into its own
+// scratch block and copies it out. Workers stop taking blocks as soon as one fails.
+static int64_t decompress_blocks_parallel(Bun *bun, uint8_t const *src, size_t src_size,
+                                          std::vector<uint32_t> const &entry_sizes, uint64_t uncompressed_size,
+                                          uint64_t block_size, uint8_t *dst) {
+    std::vector<size_t> src_offsets(entry_sizes.size());
+    size_t src_pos = 0;
+    for (size_t i = 0; i < entry_sizes.size(); ++i) {
+        src_offsets[i] = src_pos;
+        src_pos += entry_sizes[i];
+    }
+    if (src_pos > src_size) {
+        return -1;
+    }
+
+    std::atomic<size_t> next_block{0};
+    std::atomic<bool> failed{false};
+    std::function<void()> worker = [&] {
+        std::vector<uint8_t> scratch(block_size + SAFE_SPACE);
+        size_t i;
+        while (!failed && (i = next_block++) < entry_sizes.size()) {
+            uint64_t out_cur = i * block_size;
+            size_t amount_to_write =
+                out_cur < uncompressed_size ? (size_t)(std::min<uint64_t>)(uncompressed_size - out_cur, block_size) : 0;
+            if (BunDecompressBlock(bun, src + src_offsets[i], entry_sizes[i], scratch.data(), amount_to_write) !=
+                amount_to_write) {
+                failed = true;
+                break;
+            }
+            memcpy(dst + out_cur, scratch.data(), amount_to_write);
+        }
+    };
+
+    size_t thread_count = (std::min<size_t>)(bun->worker_count_, entry_sizes.size());
+    bun->pool_->run(worker, (int)thread_count - 1);
+    if (failed) {
+        return -1;
+    }
+    return (std::min<uint64_t>)(uncompressed_size, entry_sizes.size() * block_size);
+}
+
 int64_t BunDecompressBundle(Bun *bun, uint8_t const *src_data, size_t src_size, uint8_t *dst_data, size_t dst_size) {
     reader r = {src_data, src_size};
 
     bundle_fixed_header fix_h;
-    if (!r.read(fix_h.uncompressed_size) || !r.read(fix_h.total_payload_size) || !r.read(fix_h.head_payload_size) ||
-        !r.read(fix_h.first_file_encode) || !r.read(fix_h.unk10) || !r.read(fix_h.uncompressed_size2) ||
-        !r.read(fix_h.total_payload_size2) || !r.read(fix_h.block_count) || !r.read(fix_h.unk28)) {
+    if (!read_fixed_header(r, fix_h)) {
         return -1;
     }
 
@@ -668,6 +1565,11 @@ int64_t BunDecompressBundle(Bun *bun, uint8_t const *src_data, size_t src_size,
         return -1;
     }
 
+    if (bun->pool_ && entry_sizes.size() > 1) {
+        return decompress_blocks_parallel(bun, r.p_, r.n_, entry_sizes, fix_h.uncompressed_size2, fix_h.unk28[0],
+                                          dst_data);
+    }
+
     uint8_t const *p = r.p_;
     size_t n = r.n_;
     uint8_t *out_p = dst_data;
@@ -704,3 +1606,70 @@ BunMem BunDecompressBundleAlloc(Bun *bun, uint8_t const *src_data, size_t src_si
     BunMemShrink(dst_mem, dst_size);
     return dst_mem;
 }
+
+int64_t BunDecompressBundleRange(Bun *bun, uint8_t const *src_data, size_t src_size, uint64_t offset,
+                                 uint8_t *dst_data, size_t dst_size) {
+    reader r = {src_data, src_size};
+
+    bundle_fixed_header fix_h;
+    if (!read_fixed_header(r, fix_h)) {
+        return -1;
+    }
+    uint64_t const block_size = fix_h.unk28[0];
+    if (!block_size || offset > fix_h.uncompressed_size2 || dst_size > fix_h.uncompressed_size2 - offset) {
+        return -1;
+    }
+
+    std::vector<uint32_t> entry_sizes(fix_h.block_count);
+    if (!r.read(entry_sizes)) {
+        return -1;
+    }
+    if (dst_size == 0) {
+        return 0;
+    }
+
+    // Blocks all decompress to block_size bytes except the last, so the range maps directly to the blocks covering it.
+    size_t const first_block = offset / block_size;
+    size_t const last_block = (offset + dst_size - 1) / block_size;
+    if (last_block >= entry_sizes.size()) {
+        return -1;
+    }
+    uint8_t const *p = r.p_;
+    size_t n = r.n_;
+    for (size_t i = 0; i < first_block; ++i) {
+        if (n < entry_sizes[i]) {
+            return -1;
+        }
+        p += entry_sizes[i];
+        n -= entry_sizes[i];
+    }
+
+    std::vector<uint8_t> block_buf;
+    for (size_t i = first_block; i <= last_block; ++i) {
+        if (n < entry_sizes[i]) {
+            return -1;
+        }
+        uint64_t const block_start = i * block_size;
+        size_t const block_len = (size_t)(std::min<uint64_t>)(fix_h.uncompressed_size2 - block_start, block_size);
+        uint64_t const copy_start = (std::max<uint64_t>)(offset, block_start);
+        uint64_t const copy_end = (std::min<uint64_t>)(offset + dst_size, block_start + block_len);
+        uint8_t *out_p = dst_data + (copy_start - offset);
+
+        if (copy_start == block_start && copy_end == block_start + block_len) {
+            // The caller's scratch space past the end covers the decoder's overrun.
+            if (BunDecompressBlock(bun, p, entry_sizes[i], out_p, block_len) != block_len) {
+                return -1;
+            }
+        } else {
+            block_buf.resize(block_size + SAFE_SPACE);
+            if (BunDecompressBlock(bun, p, entry_sizes[i], block_buf.data(), block_len) != block_len) {
+                return -1;
+            }
+            memcpy(out_p, block_buf.data() + (copy_start - block_start), copy_end - copy_start);
+        }
+        p += entry_sizes[i];
+        n -= entry_sizes[i];
+    }
+
+    return dst_size;
+}
@@ -44,21 +44,61 @@ extern "C" {
 		void (*close)(Vfs*, VfsFile*);
 		int64_t(*size)(Vfs*, VfsFile*);
 		int64_t(*read)(Vfs*, VfsFile*, uint8_t* out, int64_t offset, int64_t size);
+		/* Optional, may be NULL. Returns a value that changes whenever the contents of the file do, like a stored
+		* digest, or 0 if there is none. BunIndexOpenCached uses it to find a cached index without reading _.index.bin.
+		*/
+		uint64_t(*stamp)(Vfs*, VfsFile*);
 	};
 
 	BUN_DLL_PUBLIC BunMem BunMemAlloc(size_t size);
 	BUN_DLL_PUBLIC int64_t BunMemSize(BunMem mem);
+	/* BunMem is reference counted, BunMemFree releases one reference. Retained memory may be shared
+	* with other holders and should be treated as read-only.
+	*/
+	BUN_DLL_PUBLIC BunMem BunMemRetain(BunMem mem);
 	BUN_DLL_PUBLIC void BunMemFree(BunMem mem);
 
 	BUN_DLL_PUBLIC Bun* BunNew(char const* decompressor_path, char const* decompressor_export);
+	/* Uses the Ooz decoder linked into the library, which decodes from the caller's buffers without copying.
+	* Returns NULL if the library was built without it.
+	*/
+	BUN_DLL_PUBLIC Bun* BunNewBuiltin();
 	BUN_DLL_PUBLIC void BunDelete(Bun* bun);
 
+	/* Number of threads BunDecompressBundle decodes blocks on, 1 by default. 0 or less uses one per core.
+	* The extra threads are started here and kept until BunDelete; don't call this while a bundle is being decoded.
+	*/
+	BUN_DLL_PUBLIC void BunSetWorkerCount(Bun* bun, int worker_count);
+
 	BUN_DLL_PUBLIC BunIndex* BunIndexOpen(Bun* bun, Vfs* vfs, char const* bundle_dir);
+	/* Like BunIndexOpen, but keeps the parsed index in cache_dir, keyed by the size and modification time of
+	* _.index.bin, its Vfs stamp, or the hash of its contents if the Vfs has no stamp. A later open of the same index
+	* maps the cached tables instead of rebuilding them, and with a stamp doesn't read _.index.bin.
+	*/
+	BUN_DLL_PUBLIC BunIndex* BunIndexOpenCached(Bun* bun, Vfs* vfs, char const* bundle_dir, char const* cache_dir);
 	BUN_DLL_PUBLIC void BunIndexClose(BunIndex* idx);
 
 	BUN_DLL_PUBLIC int32_t BunIndexLookupFileByPath(BunIndex* idx, char const* path);
+	/* Looks up count paths at once, storing a file id or -1 for each in file_ids. Returns the number of paths found or -1.
+	*/
+	BUN_DLL_PUBLIC int32_t BunIndexLookupFilesByPath(BunIndex* idx, char const* const* paths, size_t count, int32_t* file_ids);
+	/* Decompresses one file. It is copied from its bundle if that is in the cache, otherwise only the blocks of the
+	* bundle covering the file are decoded and the cache is left as it is.
+	*/
 	BUN_DLL_PUBLIC BunMem BunIndexExtractFile(BunIndex* idx, int32_t file_id);
 	BUN_DLL_PUBLIC BunMem BunIndexExtractBundle(BunIndex* idx, int32_t bundle_id);
+	/* Reads the compressed contents of a bundle without decompressing or caching it, for callers that decompress
+	* with BunDecompressBundleAlloc on threads of their own.
+	*/
+	BUN_DLL_PUBLIC BunMem BunIndexReadBundle(BunIndex* idx, int32_t bundle_id);
+
+	/* Decompressed bundles are kept in an LRU cache of at most budget bytes per index, 256 MiB by default, 0 disables it.
+	* Only BunIndexExtractBundle adds to it; it returns a shared reference to the cached bundle, which stays valid after
+	* eviction. Misses count BunIndexExtractBundle calls that had to decode the bundle; BunIndexExtractFile only counts
+	* its hits.
+	*/
+	BUN_DLL_PUBLIC void BunIndexSetCacheBudget(BunIndex* idx, uint64_t budget);
+	BUN_DLL_PUBLIC void BunIndexCacheStats(BunIndex* idx, uint64_t* hits, uint64_t* misses, uint64_t* size);
 
 	BUN_DLL_PUBLIC int BunIndexBundleInfo(BunIndex const* idx, int32_t bundle_info_id, char const** name, uint32_t* uncompressed_size);
 	BUN_DLL_PUBLIC int BunIndexFileInfo(BunIndex const* idx, int32_t file_info_id,
@@ -67,7 +107,36 @@ extern "C" {
 	BUN_DLL_PUBLIC int BunIndexPathRepInfo(BunIndex const* idx, int32_t path_rep_id,
 		uint64_t* hash, uint32_t* offset, uint32_t* size, uint32_t* recursive_size);
 
+	/* Owned by the index and valid until BunIndexClose. It may be mapped read-only, so don't retain or free it.
+	*/
 	BUN_DLL_PUBLIC BunMem BunIndexPathRepContents(BunIndex const* idx);
+
+	/* Calls visit for every path generated from the path reps of the index. The path is null-terminated and only
+	* valid during the call. The path reps are spread over worker_count threads, 0 or less uses one per core, and
+	* visit is called concurrently from them; worker is a stable id below worker_count for per-thread state.
+	* Paths of one path rep are visited in order on one thread. Returns 0, or -1 if a path rep is malformed.
+	*/
+	typedef void (*BunPathVisitor)(void* user, int worker, int32_t path_rep_id, char const* path, size_t path_size);
+	BUN_DLL_PUBLIC int BunIndexVisitPaths(BunIndex const* idx, int worker_count, BunPathVisitor visit, void* user);
+
+	/* A BunPathMatcher compiles any number of glob patterns and regular expressions into one matcher, see
+	* path_match.h for the supported syntax. The Add functions return -1 if a pattern is malformed or, for
+	* regular expressions, uses a feature outside the supported subset. Compile returns -1 if the patterns are
+	* too complex; with case_fold, upper case ASCII letters in paths match as lower case.
+	*/
+	struct BunPathMatcher;
+	BUN_DLL_PUBLIC BunPathMatcher* BunPathMatcherNew();
+	BUN_DLL_PUBLIC void BunPathMatcherDelete(BunPathMatcher* matcher);
+	BUN_DLL_PUBLIC int BunPathMatcherAddGlob(BunPathMatcher* matcher, char const* pattern);
+	BUN_DLL_PUBLIC int BunPathMatcherAddRegex(BunPathMatcher* matcher, char const* pattern);
+	BUN_DLL_PUBLIC int BunPathMatcherCompile(BunPathMatcher* matcher, int case_fold);
+	BUN_DLL_PUBLIC int BunPathMatcherMatch(BunPathMatcher const* matcher, char const* path, size_t path_size);
+
+	/* Like BunIndexVisitPaths, but only visits the paths a compiled matcher accepts. Path rep bases that no
+	* pattern can match are skipped along with every path built on them.
+	*/
+	BUN_DLL_PUBLIC int BunIndexVisitMatchingPaths(BunIndex const* idx, BunPathMatcher const* matcher, int worker_count,
+		BunPathVisitor visit, void* user);
     BUN_DLL_PUBLIC int BunIndexPathRepLowercase(BunIndex const *idx);
 
 	BUN_DLL_PUBLIC int32_t BunIndexBundleCount(BunIndex* idx);
@@ -91,4 +160,9 @@ extern "C" {
 	*/
 	BUN_DLL_PUBLIC int64_t BunDecompressBundle(Bun* bun, uint8_t const* src_data, size_t src_size, uint8_t* dst_data, size_t dst_size);
 	BUN_DLL_PUBLIC BunMem BunDecompressBundleAlloc(Bun* bun, uint8_t const* src_data, size_t src_size);
+
+	/* Decompresses dst_size bytes of a bundle starting at offset, decoding only the blocks that cover that range.
+	*/
+	BUN_DLL_PUBLIC int64_t BunDecompressBundleRange(Bun* bun, uint8_t const* src_data, size_t src_size, uint64_t offset,
+		uint8_t* dst_data, size_t dst_size);
 }
@@ -1,16 +1,24 @@
 #include <bun.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
+#include "extract_manifest.h"
+#include "fnv.h"
 #include "ggpk_vfs.h"
-#include "path_rep.h"
 #include "util.h"
 
 #include <poe/util/utf.hpp>
@@ -18,19 +26,133 @@
 using namespace std::string_view_literals;
 
 static char const *const USAGE =
-    "bun_extract_file list-files GGPK_OR_STEAM_DIR\n"
-    "bun_extract_file extract-files [--regex] GGPK_OR_STEAM_DIR OUTPUT_DIR [FILE_PATHS...]\n\n"
+    "bun_extract_file list-files [--index-cache DIR] GGPK_OR_STEAM_DIR\n"
+    "bun_extract_file extract-files [--regex | --glob] [--index-cache DIR] [--threads N] [--memory-budget MIB]\n"
+    "                 [--manifest FILE [--delete-removed]] GGPK_OR_STEAM_DIR OUTPUT_DIR [FILE_PATHS...]\n\n"
     "GGPK_OR_STEAM_DIR should be either a full path to a Standalone GGPK file or the Steam game directory.\n"
     "If FILE_PATHS are omitted the file paths are taken from stdin.\n"
-    "If --regex is given, FILE_PATHS are interpreted as regular expressions to match.\n";
+    "If --regex is given, FILE_PATHS are interpreted as regular expressions to match.\n"
+    "If --glob is given, FILE_PATHS are interpreted as glob patterns to match, where ** also matches across '/'.\n"
+    "If --index-cache is given, the parsed index is kept in DIR to speed up later runs.\n"
+    "Bundles are decompressed on --threads threads, all cores by default, while at most --memory-budget MiB of\n"
+    "bundle data is held at once, 1024 by default.\n"
+    "If --manifest is given, files recorded in FILE as extracted from an unchanged bundle are skipped and FILE is\n"
+    "updated afterwards. Files no longer in the index are dropped from it and, with --delete-removed, deleted.\n";
+
+struct extract_info {
+  std::string_view path;
+  uint64_t path_hash{};
+  uint32_t offset{};
+  uint32_t size{};
+  // Content hash from the manifest, a file that hashes the same isn't rewritten.
+  bool has_previous{};
+  uint64_t previous_hash{};
+  uint64_t content_hash{};
+  bool done{};
+};
+
+struct bundle_job {
+  int32_t bundle_id{};
+  // Sort key for reading, the data offset within a GGPK or else the bundle's index.
+  int64_t location{};
+  uint64_t signature{};
+  uint64_t reserved{};
+  std::vector<extract_info> parts;
+  BunMem mem{};
+  std::atomic<size_t> parts_left{};
+};
+
+// A queue that blocks producers while it is full and consumers while it is empty, until it is closed.
+template <typename T> struct bounded_queue {
+  explicit bounded_queue(size_t capacity) : capacity(capacity) {}
+
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [&] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+  }
+
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [&] { return !items.empty() || closed; });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+  std::mutex mutex;
+  std::condition_variable not_empty, not_full;
+  std::deque<T> items;
+  size_t capacity;
+  bool closed = false;
+};
+
+// Bytes of bundle data held by the pipeline. acquire waits until the bytes fit in the budget, but admits anything
+// when nothing is in flight so that bundles larger than the budget still get through one at a time.
+struct byte_budget {
+  explicit byte_budget(uint64_t limit) : limit(limit) {}
+
+  void acquire(uint64_t n) {
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [&] { return in_flight == 0 || in_flight + n <= limit; });
+    in_flight += n;
+  }
+
+  void release(uint64_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight -= n;
+    released.notify_all();
+  }
 
-struct fs_node {
-  std::map<std::string_view, std::unique_ptr<fs_node>> children;
+  std::mutex mutex;
+  std::condition_variable released;
+  uint64_t limit;
+  uint64_t in_flight = 0;
+};
 
-  void record_file_path(std::string_view path);
-  void create_directories(std::filesystem::path const &base) const;
+struct extract_stats {
+  std::atomic<size_t> extracted{0};
+  std::atomic<size_t> unchanged{0};
+  std::atomic<size_t> missed{0};
 };
 
+static void extract_bundles(Bun *bun, BunIndex *idx, std::vector<bundle_job *> const &jobs,
+                            std::filesystem::path const &output_dir, int thread_count, uint64_t memory_budget,
+                            bool hash_contents, extract_stats &stats);
+
+// Identifies the contents of a bundle without reading it, 0 if it can't be told.
+static uint64_t bundle_signature(std::shared_ptr<GgpkVfs> const &vfs, std::filesystem::path const &steam_dir,
+                                 ggpk::parsed_file const *entry, char const *bundle_name) {
+  uint64_t signature = 0;
+  if (vfs) {
+    if (entry) {
+      memcpy(&signature, entry->stored_digest_.data(), sizeof(signature));
+    }
+  } else {
+    std::error_code ec;
+    auto bundle_path = steam_dir / "Bundles2" / (std::string(bundle_name) + ".bundle.bin");
+    uint64_t stamp[2] = {std::filesystem::file_size(bundle_path, ec), 0};
+    if (!ec) {
+      stamp[1] = (uint64_t)std::filesystem::last_write_time(bundle_path, ec).time_since_epoch().count();
+    }
+    if (!ec) {
+      signature = fnv1a_64(stamp, sizeof(stamp));
+    }
+  }
+  return signature;
+}
+
 int main(int argc, char *argv[]) {
   std::error_code ec;
   if (argc < 2 || argv[1] == "--help"sv || argv[1] == "-h"sv) {
@@ -42,7 +164,13 @@ int main(int argc, char *argv[]) {
   std::filesystem::path ggpk_or_steam_dir;
   std::filesystem::path output_dir;
   bool use_regex = false;
+  bool use_glob = false;
   bool use_mmap = false;
+  std::string index_cache_dir;
+  int thread_count = 0;
+  uint64_t memory_budget_mib = 1024;
+  std::filesystem::path manifest_path;
+  bool delete_removed = false;
   std::vector<std::string> tail_args;
 
   command = argv[1];
@@ -52,12 +180,30 @@ int main(int argc, char *argv[]) {
     if (argv[argi] == "--regex"sv) {
       use_regex = true;
       ++argi;
+    } else if (argv[argi] == "--glob"sv) {
+      use_glob = true;
+      ++argi;
     } else if (argv[argi] == "--mmap"sv) {
       use_mmap = true;
       ++argi;
     } else if (argv[argi] == "--no-mmap"sv) {
       use_mmap = false;
       ++argi;
+    } else if (argv[argi] == "--index-cache"sv && argi + 1 < argc) {
+      index_cache_dir = argv[argi + 1];
+      argi += 2;
+    } else if (argv[argi] == "--threads"sv && argi + 1 < argc) {
+      thread_count = atoi(argv[argi + 1]);
+      argi += 2;
+    } else if (argv[argi] == "--memory-budget"sv && argi + 1 < argc) {
+      memory_budget_mib = strtoull(argv[argi + 1], nullptr, 10);
+      argi += 2;
+    } else if (argv[argi] == "--manifest"sv && argi + 1 < argc) {
+      manifest_path = argv[argi + 1];
+      argi += 2;
+    } else if (argv[argi] == "--delete-removed"sv) {
+      delete_removed = true;
+      ++argi;
     } else {
       break;
     }
@@ -72,6 +218,10 @@ int main(int argc, char *argv[]) {
       return 1;
     }
   } else if (command == "extract-files"sv) {
+    if (use_regex && use_glob) {
+      fprintf(stderr, USAGE);
+      return 1;
+    }
     if (argi + 1 < argc) {
       ggpk_or_steam_dir = argv[argi++];
       output_dir = argv[argi++];
@@ -94,7 +244,10 @@ int main(int argc, char *argv[]) {
 #else
   std::string ooz_dll = "liblibooz.so";
 #endif
-  Bun *bun = BunNew(ooz_dll.c_str(), "Ooz_Decompress");
+  Bun *bun = BunNewBuiltin();
+  if (!bun) {
+    bun = BunNew(ooz_dll.c_str(), "Ooz_Decompress");
+  }
   if (!bun) {
     bun = BunNew(("./" + ooz_dll).c_str(), "Ooz_Decompress");
     if (!bun) {
@@ -103,28 +256,22 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  BunIndex *idx = BunIndexOpen(bun, borrow_vfs(vfs), ggpk_or_steam_dir.string().c_str());
+  if (!index_cache_dir.empty()) {
+    std::filesystem::create_directories(index_cache_dir, ec);
+  }
+  BunIndex *idx = BunIndexOpenCached(bun, borrow_vfs(vfs), ggpk_or_steam_dir.string().c_str(),
+                                     index_cache_dir.empty() ? nullptr : index_cache_dir.c_str());
   if (!idx) {
     fprintf(stderr, "Could not open index\n");
     return 1;
   }
 
   if (command == "list-files") {
-    auto rep_mem = BunIndexPathRepContents(idx);
-    for (size_t path_rep_id = 0;; ++path_rep_id) {
-      uint64_t hash;
-      uint32_t offset;
-      uint32_t size;
-      uint32_t recursive_size;
-      if (BunIndexPathRepInfo(idx, (int32_t)path_rep_id, &hash, &offset, &size, &recursive_size) < 0) {
-        break;
-      }
-      auto generated = generate_paths(rep_mem + offset, size);
-      for (auto &p : generated) {
-        std::cout << p << std::endl;
-      }
-    }
-    return 0;
+    auto print_path = [](void *, int, int32_t, char const *path, size_t path_size) {
+      fwrite(path, 1, path_size, stdout);
+      fputc('\n', stdout);
+    };
+    return BunIndexVisitPaths(idx, 1, print_path, nullptr) < 0 ? 1 : 0;
   }
 
   std::vector<std::string> wanted_paths = tail_args;
@@ -144,152 +291,386 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  std::vector<std::regex> regexes;
-  if (use_regex) {
-    bool regexes_good = true;
+  if ((use_regex || use_glob) && command == "extract-files") {
+    bool lowercase = BunIndexPathRepLowercase(idx) != 0;
+
+    // Patterns are compiled into one matcher that prunes whole path rep subtrees. Regexes outside of the
+    // subset it supports fall back to matching every path with std::regex.
+    std::unique_ptr<BunPathMatcher, decltype(&BunPathMatcherDelete)> matcher(BunPathMatcherNew(),
+                                                                            &BunPathMatcherDelete);
     for (auto &path : wanted_paths) {
-      try {
-        regexes.push_back(std::regex(path));
-      } catch (std::exception &e) {
-        fprintf(stderr, "Could not compile regex \"%s\": %s\n", path.c_str(), e.what());
-        regexes_good = false;
+      int res = use_glob ? BunPathMatcherAddGlob(matcher.get(), path.c_str())
+                         : BunPathMatcherAddRegex(matcher.get(), path.c_str());
+      if (res < 0) {
+        if (use_glob) {
+          fprintf(stderr, "Could not parse glob \"%s\"\n", path.c_str());
+          return 1;
+        }
+        matcher.reset();
+        break;
       }
     }
-    if (!regexes_good) {
-      return 1;
+    if (matcher && BunPathMatcherCompile(matcher.get(), lowercase) < 0) {
+      if (use_glob) {
+        fprintf(stderr, "Glob patterns are too complex\n");
+        return 1;
+      }
+      matcher.reset();
     }
 
-    if (command == "extract-files") {
-      std::unordered_set<std::string> matching_paths;
-      auto rep_mem = BunIndexPathRepContents(idx);
-      for (size_t path_rep_id = 0;; ++path_rep_id) {
-        uint64_t hash;
-        uint32_t offset;
-        uint32_t size;
-        uint32_t recursive_size;
-        if (BunIndexPathRepInfo(idx, (int32_t)path_rep_id, &hash, &offset, &size, &recursive_size) < 0) {
-          break;
+    std::vector<std::regex> regexes;
+    if (!matcher) {
+      bool regexes_good = true;
+      for (auto &path : wanted_paths) {
+        try {
+          regexes.push_back(std::regex(path));
+        } catch (std::exception &e) {
+          fprintf(stderr, "Could not compile regex \"%s\": %s\n", path.c_str(), e.what());
+          regexes_good = false;
         }
-        auto generated = generate_paths(rep_mem + offset, size);
-        for (auto &p : generated) {
-          if (BunIndexPathRepLowercase(idx)) {
-            for (auto &ch : p) {
-              ch = (char)std::tolower((int)(unsigned char)ch);
-            }
+      }
+      if (!regexes_good) {
+        return 1;
+      }
+    }
+
+    // Each worker matches into its own set, the sets are merged afterwards.
+    struct match_worker {
+      std::string path;
+      std::unordered_set<std::string> matching_paths;
+    };
+    struct match_context {
+      std::vector<std::regex> const *regexes;
+      bool lowercase;
+      std::vector<match_worker> workers;
+
+      match_worker &assign_path(int worker, char const *path, size_t path_size) {
+        auto &w = workers[worker];
+        w.path.assign(path, path_size);
+        if (lowercase) {
+          for (auto &ch : w.path) {
+            ch = (char)std::tolower((int)(unsigned char)ch);
           }
-          if (!matching_paths.count(p)) {
-            for (auto &r : regexes) {
-              if (std::regex_match(p, r)) {
-                matching_paths.insert(p);
-              }
+        }
+        return w;
+      }
+    } ctx;
+    ctx.regexes = &regexes;
+    ctx.lowercase = lowercase;
+    int worker_count = (std::max)(1, (int)std::thread::hardware_concurrency());
+    ctx.workers.resize(worker_count);
+
+    if (matcher) {
+      auto add_path = [](void *user, int worker, int32_t, char const *path, size_t path_size) {
+        auto &ctx = *reinterpret_cast<match_context *>(user);
+        auto &w = ctx.assign_path(worker, path, path_size);
+        w.matching_paths.insert(w.path);
+      };
+      BunIndexVisitMatchingPaths(idx, matcher.get(), worker_count, add_path, &ctx);
+    } else {
+      auto match_path = [](void *user, int worker, int32_t, char const *path, size_t path_size) {
+        auto &ctx = *reinterpret_cast<match_context *>(user);
+        auto &w = ctx.assign_path(worker, path, path_size);
+        if (!w.matching_paths.count(w.path)) {
+          for (auto &r : *ctx.regexes) {
+            if (std::regex_match(w.path, r)) {
+              w.matching_paths.insert(w.path);
+              break;
             }
           }
         }
-      }
-      wanted_paths.assign(matching_paths.begin(), matching_paths.end());
+      };
+      BunIndexVisitPaths(idx, worker_count, match_path, &ctx);
     }
-  }
-
-  fs_node root;
 
-  struct extract_info {
-    std::string_view path;
-    uint32_t offset{};
-    uint32_t size{};
-  };
+    std::unordered_set<std::string> matching_paths;
+    for (auto &w : ctx.workers) {
+      matching_paths.merge(w.matching_paths);
+    }
+    wanted_paths.assign(matching_paths.begin(), matching_paths.end());
+  }
 
-  std::unordered_map<uint32_t, std::vector<extract_info>> bundle_parts_to_extract;
+  std::vector<char const *> wanted_c_paths;
   for (auto &path : wanted_paths) {
     if (path.front() == '"' && path.back() == '"') {
       path = path.substr(1, path.size() - 2);
     }
+    wanted_c_paths.push_back(path.c_str());
+  }
+  std::vector<int32_t> file_ids(wanted_paths.size(), -1);
+  BunIndexLookupFilesByPath(idx, wanted_c_paths.data(), wanted_c_paths.size(), file_ids.data());
 
-    int32_t file_id = BunIndexLookupFileByPath(idx, path.c_str());
+  std::vector<bundle_job> bundle_jobs(BunIndexBundleCount(idx));
+  for (size_t i = 0; i < wanted_paths.size(); ++i) {
+    auto &path = wanted_paths[i];
+    int32_t file_id = file_ids[i];
     if (file_id < 0) {
       fprintf(stderr, "Could not find file \"%s\"\n", path.c_str());
       continue;
     }
 
     uint32_t bundle_id{};
-
-    uint64_t path_hash{};
     extract_info ei{};
     ei.path = path;
 
-    BunIndexFileInfo(idx, file_id, &path_hash, &bundle_id, &ei.offset, &ei.size);
-    bundle_parts_to_extract[bundle_id].push_back(ei);
+    BunIndexFileInfo(idx, file_id, &ei.path_hash, &bundle_id, &ei.offset, &ei.size);
+    bundle_jobs[bundle_id].parts.push_back(ei);
+  }
 
-    root.record_file_path(path);
+  extract_manifest manifest;
+  if (!manifest_path.empty() && !manifest.load(manifest_path)) {
+    fprintf(stderr, "Ignoring malformed manifest \"%s\"\n", manifest_path.string().c_str());
   }
 
-  fprintf(stderr, "Creating directories...\n");
-  std::filesystem::create_directories(output_dir, ec);
-  root.create_directories(output_dir);
+  // Bundles are read in the order they are laid out in a GGPK to keep reads sequential. In a Steam install each
+  // bundle is a file of its own, where index order keeps bundles of the same directory together.
+  std::vector<bundle_job *> jobs;
+  size_t unchanged = 0;
+  for (int32_t bundle_id = 0; bundle_id < (int32_t)bundle_jobs.size(); ++bundle_id) {
+    auto &job = bundle_jobs[bundle_id];
+    if (job.parts.empty()) {
+      continue;
+    }
+    char const *name;
+    uint32_t uncompressed_size;
+    BunIndexBundleInfo(idx, bundle_id, &name, &uncompressed_size);
+    job.bundle_id = bundle_id;
+    job.location = bundle_id;
+    ggpk::parsed_file const *entry = nullptr;
+    if (vfs) {
+      entry = ggpk_lookup(vfs, (std::string("Bundles2/") + name + ".bundle.bin").c_str());
+      job.location = entry ? (int64_t)entry->data_offset_ : -1;
+    }
+
+    if (!manifest_path.empty()) {
+      job.signature = bundle_signature(vfs, ggpk_or_steam_dir, entry, name);
+      for (auto &part : job.parts) {
+        auto I = manifest.entries.find(part.path_hash);
+        if (I != manifest.entries.end() && I->second.size == part.size) {
+          part.has_previous = true;
+          part.previous_hash = I->second.content_hash;
+        }
+      }
+      auto is_unchanged = [&](extract_info const &part) {
+        if (!job.signature || !part.has_previous) {
+          return false;
+        }
+        auto &e = manifest.entries.find(part.path_hash)->second;
+        std::error_code size_ec;
+        return e.bundle_signature == job.signature && e.bundle == name && e.offset == part.offset &&
+               e.path == part.path && std::filesystem::file_size(output_dir / part.path, size_ec) == part.size &&
+               !size_ec;
+      };
+      size_t part_count = job.parts.size();
+      job.parts.erase(std::remove_if(job.parts.begin(), job.parts.end(), is_unchanged), job.parts.end());
+      unchanged += part_count - job.parts.size();
+      if (job.parts.empty()) {
+        continue;
+      }
+    }
+    jobs.push_back(&job);
+  }
+  std::sort(jobs.begin(), jobs.end(), [](bundle_job *a, bundle_job *b) { return a->location < b->location; });
 
   fprintf(stderr, "Extracting files...\n");
-  size_t extracted = 0;
-  size_t missed = 0;
-  for (auto &[bundle_id, parts] : bundle_parts_to_extract) {
-    std::vector<uint8_t> bundle_data;
-    auto bundle_mem = BunIndexExtractBundle(idx, bundle_id);
-    if (!bundle_mem) {
-      missed += parts.size();
+  std::filesystem::create_directories(output_dir, ec);
+  extract_stats stats;
+  extract_bundles(bun, idx, jobs, output_dir, thread_count, memory_budget_mib << 20, !manifest_path.empty(), stats);
+  size_t extracted = stats.extracted;
+  size_t missed = stats.missed;
+  unchanged += stats.unchanged;
+
+  if (!manifest_path.empty()) {
+    for (auto *job : jobs) {
       char const *name;
-      uint32_t cb;
-      BunIndexBundleInfo(idx, bundle_id, &name, &cb);
-      fprintf(stderr, "Could not open bundle \"%s\", missing %zu files.\n", name, parts.size());
-      continue;
+      uint32_t uncompressed_size;
+      BunIndexBundleInfo(idx, job->bundle_id, &name, &uncompressed_size);
+      for (auto &part : job->parts) {
+        if (part.done) {
+          manifest.entries[part.path_hash] =
+              manifest_entry{std::string(part.path), name, part.offset, part.size, job->signature, part.content_hash};
+        }
+      }
     }
-    for (auto &part : parts) {
-      std::filesystem::path output_path = output_dir / part.path;
-      if (!dump_file(output_path, bundle_mem + part.offset, part.size)) {
-        fprintf(stderr, "Could not write file \"%s\"\n", output_path.string().c_str());
-        ++missed;
+
+    // Entries for paths that have left the index are dropped, as are ones keyed by a path hash the index no longer
+    // uses for their path.
+    std::vector<uint64_t> recorded_hashes;
+    std::vector<char const *> recorded_paths;
+    for (auto &[path_hash, e] : manifest.entries) {
+      recorded_hashes.push_back(path_hash);
+      recorded_paths.push_back(e.path.c_str());
+    }
+    std::vector<int32_t> recorded_ids(recorded_paths.size(), -1);
+    BunIndexLookupFilesByPath(idx, recorded_paths.data(), recorded_paths.size(), recorded_ids.data());
+    size_t removed = 0;
+    for (size_t i = 0; i < recorded_hashes.size(); ++i) {
+      uint64_t path_hash{};
+      uint32_t bundle_id, offset, size;
+      if (recorded_ids[i] >= 0) {
+        BunIndexFileInfo(idx, recorded_ids[i], &path_hash, &bundle_id, &offset, &size);
+        if (path_hash != recorded_hashes[i]) {
+          manifest.entries.erase(recorded_hashes[i]);
+        }
         continue;
       }
-      ++extracted;
+      if (delete_removed) {
+        std::filesystem::remove(output_dir / manifest.entries[recorded_hashes[i]].path, ec);
+      }
+      manifest.entries.erase(recorded_hashes[i]);
+      ++removed;
+    }
+    if (removed) {
+      fprintf(stderr, "%zu files are no longer in the index%s.\n", removed, delete_removed ? " and were deleted" : "");
+    }
+
+    if (!manifest.save(manifest_path)) {
+      fprintf(stderr, "Could not write manifest \"%s\"\n", manifest_path.string().c_str());
     }
-    BunMemFree(bundle_mem);
   }
-  fprintf(stderr, "Done, %zu/%zu extracted, %zu missed.\n", extracted, wanted_paths.size(), missed);
+
+  fprintf(stderr, "Done, %zu/%zu extracted, %zu unchanged, %zu missed.\n", extracted, wanted_paths.size(), unchanged,
+          missed);
   BunIndexClose(idx);
   BunDelete(bun);
 
   return 0;
 }
 
-void fs_node::record_file_path(std::string_view path) {
-  {
-    fs_node *cur_node = this;
-    size_t comp_start = 0;
-    while (true) {
-      std::string_view comp;
-      if (auto pos = path.find_first_of("/\\", comp_start); pos != path.npos) {
-        comp = path.substr(comp_start, pos - comp_start);
-      } else {
-        break; // if there's no more slashes we've reached the filename and should stop.
+// Extracts in three stages connected by bounded queues: readers fetch compressed bundles in job order, decompressors
+// inflate them and hand each part to a pool of writers, which drop a bundle once its last part is written.
+static void extract_bundles(Bun *bun, BunIndex *idx, std::vector<bundle_job *> const &jobs,
+                            std::filesystem::path const &output_dir, int thread_count, uint64_t memory_budget,
+                            bool hash_contents, extract_stats &stats) {
+  int const reader_count = 2;
+  int const writer_count = 4;
+  if (thread_count <= 0) {
+    thread_count = (std::max)(1, (int)std::thread::hardware_concurrency());
+  }
+
+  byte_budget budget(memory_budget);
+  bounded_queue<bundle_job *> decompress_queue(thread_count * 2);
+  bounded_queue<std::pair<bundle_job *, extract_info *>> write_queue(4096);
+
+  auto report_missing = [&](bundle_job &job) {
+    char const *name;
+    uint32_t uncompressed_size;
+    BunIndexBundleInfo(idx, job.bundle_id, &name, &uncompressed_size);
+    fprintf(stderr, "Could not open bundle \"%s\", missing %zu files.\n", name, job.parts.size());
+    stats.missed += job.parts.size();
+  };
+
+  std::atomic<size_t> next_job{0};
+  auto read_bundles = [&] {
+    size_t i;
+    while ((i = next_job++) < jobs.size()) {
+      auto &job = *jobs[i];
+      char const *name;
+      uint32_t uncompressed_size;
+      BunIndexBundleInfo(idx, job.bundle_id, &name, &uncompressed_size);
+
+      // The compressed data is not known until read, reserve as much again as the bundle will decompress to and
+      // return what the compressed data doesn't need.
+      job.reserved = uint64_t(uncompressed_size) * 2;
+      budget.acquire(job.reserved);
+      job.mem = BunIndexReadBundle(idx, job.bundle_id);
+      if (!job.mem) {
+        budget.release(job.reserved);
+        report_missing(job);
+        continue;
       }
-      comp_start = comp_start + comp.size() + 1;
-      if (comp.empty())
+      uint64_t needed = uncompressed_size + (uint64_t)BunMemSize(job.mem);
+      if (needed < job.reserved) {
+        budget.release(job.reserved - needed);
+        job.reserved = needed;
+      }
+      decompress_queue.push(&job);
+    }
+  };
+
+  auto decompress_bundles = [&] {
+    bundle_job *job;
+    while (decompress_queue.pop(job)) {
+      uint64_t compressed_size = (uint64_t)BunMemSize(job->mem);
+      BunMem bundle_mem = BunDecompressBundleAlloc(bun, job->mem, compressed_size);
+      BunMemFree(job->mem);
+      job->mem = bundle_mem;
+      if (!bundle_mem) {
+        budget.release(job->reserved);
+        report_missing(*job);
         continue;
-      auto &children = cur_node->children;
-      fs_node *next_node{};
-      if (auto next_iter = children.find(comp); next_iter != children.end()) {
-        next_node = next_iter->second.get();
+      }
+      uint64_t compressed_reserved = (std::min)(compressed_size, job->reserved);
+      budget.release(compressed_reserved);
+      job->reserved -= compressed_reserved;
+
+      job->parts_left = job->parts.size();
+      for (auto &part : job->parts) {
+        write_queue.push({job, &part});
+      }
+    }
+  };
+
+  auto write_parts = [&] {
+    std::pair<bundle_job *, extract_info *> item;
+    while (write_queue.pop(item)) {
+      auto &[job, part] = item;
+      std::filesystem::path output_path = output_dir / part->path;
+      uint8_t const *data = job->mem + part->offset;
+      bool in_bounds = (uint64_t)part->offset + part->size <= (uint64_t)BunMemSize(job->mem);
+      bool same = false;
+      bool written = false;
+      std::error_code ec;
+      if (in_bounds && hash_contents) {
+        part->content_hash = fnv1a_64(data, part->size);
+        same = part->has_previous && part->content_hash == part->previous_hash &&
+               std::filesystem::file_size(output_path, ec) == part->size && !ec;
+      }
+      if (in_bounds && !same) {
+        // Directories are created on demand, the first file written to each one fails without it.
+        written = dump_file(output_path, data, part->size);
+        if (!written) {
+          std::filesystem::create_directories(output_path.parent_path(), ec);
+          written = dump_file(output_path, data, part->size);
+        }
+      }
+      if (same) {
+        part->done = true;
+        ++stats.unchanged;
+      } else if (written) {
+        part->done = true;
+        ++stats.extracted;
       } else {
-        auto new_node = std::make_unique<fs_node>();
-        next_node = new_node.get();
-        children.insert({comp, std::move(new_node)});
+        fprintf(stderr, "Could not write file \"%s\"\n", output_path.string().c_str());
+        ++stats.missed;
+      }
+      if (--job->parts_left == 0) {
+        BunMemFree(job->mem);
+        job->mem = nullptr;
+        budget.release(job->reserved);
       }
-      cur_node = next_node;
     }
-  }
-}
+  };
 
-void fs_node::create_directories(std::filesystem::path const &base) const {
-  for (auto &[child_name, child_node] : children) {
-    std::filesystem::path child_path = base / child_name;
-    std::filesystem::create_directory(child_path);
-    child_node->create_directories(child_path);
+  std::vector<std::thread> readers, decompressors, writers;
+  for (int i = 0; i < writer_count; ++i) {
+    writers.emplace_back(write_parts);
+  }
+  for (int i = 0; i < thread_count; ++i) {
+    decompressors.emplace_back(decompress_bundles);
+  }
+  for (int i = 0; i < reader_count; ++i) {
+    readers.emplace_back(read_bundles);
+  }
+  for (auto &t : readers) {
+    t.join();
+  }
+  decompress_queue.close();
+  for (auto &t : decompressors) {
+    t.join();
+  }
+  write_queue.close();
+  for (auto &t : writers) {
+    t.join();
   }
 }
@@ -0,0 +1,358 @@
+#include "stdafx.h"
+#include "compr_calibrate.h"
+#include "compr_util.h"
+#include "compr_entropy.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <vector>
+
+int Kraken_DecodeBytes(byte **output, const byte *src, const byte *src_end, int *decoded_size, size_t output_size,
+                       bool force_memmove, uint8 *scratch, uint8 *scratch_end);
+int EncodeArray_Huff(uint8 *dst, uint8 *dst_end, const uint8 *src, int src_size, const HistoU8 &histo,
+                     float speed_tradeoff, int platforms, float *cost_ptr, int *mode_ptr, int opts, int level);
+
+// Calibration decodes synthetic arrays with every entropy chunk type and
+// fits two things to the measured decode times: the weights with which
+// CombineCostComponents blends the four per-platform models, and a scale per
+// measured timing model. The result is normalized so the average prediction
+// over all samples equals the default (platforms == 0) prediction, which keeps
+// the meaning of spaceSpeedTradeoffBytes unchanged.
+
+static const char *const kCostFamilyNames[kCostFamily_Count] = {
+  "huff", "huff2", "tans", "rle", "memset",
+};
+
+struct CalibrationSample {
+  int family;
+  float comp[4];
+  double nanos;
+};
+
+// Evaluates a timing function once per platform bit and divides out the
+// fixed per-platform weight of CombineCostComponents, yielding the raw
+// a, b, c and d components.
+template<typename Fn>
+static void GetCostComponents(Fn fn, float *comp) {
+  comp[0] = fn(2) / 1.130f;
+  comp[1] = fn(8) / 0.961f;
+  comp[2] = fn(1) / 0.762f;
+  comp[3] = fn(4) / 1.310f;
+}
+
+static uint32 CalibrationRandom(uint32 *state) {
+  uint32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// Geometrically skewed symbols drawn from an alphabet of |num_syms| entries.
+static void GenerateSkewedBytes(uint8 *dst, int size, int num_syms, uint32 *seed) {
+  for (int i = 0; i < size; i++) {
+    uint32 r = CalibrationRandom(seed);
+    int sym = BSF(r | 0x80000000) * num_syms / 16 + (r >> 24) % (num_syms / 4 + 1);
+    dst[i] = (uint8)std::min(sym, num_syms - 1);
+  }
+}
+
+// Alternating literal runs and byte repeats, which is what the RLE mode targets.
+static void GenerateRunBytes(uint8 *dst, int size, uint32 *seed) {
+  int pos = 0;
+  while (pos < size) {
+    uint32 r = CalibrationRandom(seed);
+    int lits = r % 8, run = 3 + (r >> 8) % 40;
+    for (; lits && pos < size; lits--)
+      dst[pos++] = (uint8)CalibrationRandom(seed);
+    uint8 v = (uint8)(r >> 16) & 0xf;
+    for (; run && pos < size; run--)
+      dst[pos++] = v;
+  }
+}
+
+// Returns the minimum time in nanoseconds of decoding |src| back into |size| bytes.
+static double TimeDecode(const uint8 *src, int src_size, int size, uint8 *dst, uint8 *scratch, int scratch_size) {
+  typedef std::chrono::steady_clock Clock;
+  double best = 1e30;
+  int reps = 1;
+  for (int round = 0; round < 6; round++) {
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < reps; i++) {
+      uint8 *out = dst;
+      int decoded_size;
+      int n = Kraken_DecodeBytes(&out, src, src + src_size, &decoded_size, size, false, scratch, scratch + scratch_size);
+      if (n != src_size || decoded_size != size)
+        return -1;
+    }
+    double nanos = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    if (round == 0) {
+      // Size the rounds to take about half a millisecond each.
+      reps = (int)clamp<double>(5e5 / std::max(nanos, 1.0), 1, 10000);
+      continue;
+    }
+    best = std::min(best, nanos / reps);
+  }
+  return best;
+}
+
+// Solves the 4x4 system |m| x = |v| in place using gaussian elimination.
+static bool SolveLinear4(double m[4][4], double v[4], double x[4]) {
+  for (int col = 0; col < 4; col++) {
+    int pivot = col;
+    for (int row = col + 1; row < 4; row++)
+      if (fabs(m[row][col]) > fabs(m[pivot][col]))
+        pivot = row;
+    if (fabs(m[pivot][col]) < 1e-30)
+      return false;
+    for (int k = 0; k < 4; k++)
+      std::swap(m[col][k], m[pivot][k]);
+    std::swap(v[col], v[pivot]);
+    for (int row = col + 1; row < 4; row++) {
+      double f = m[row][col] / m[col][col];
+      for (int k = col; k < 4; k++)
+        m[row][k] -= f * m[col][k];
+      v[row] -= f * v[col];
+    }
+  }
+  for (int col = 3; col >= 0; col--) {
+    double t = v[col];
+    for (int k = col + 1; k < 4; k++)
+      t -= m[col][k] * x[k];
+    x[col] = t / m[col][col];
+  }
+  return true;
+}
+
+static double PredictCost(const CalibrationSample &s, const double *w) {
+  return s.comp[0] * w[0] + s.comp[1] * w[1] + s.comp[2] * w[2] + s.comp[3] * w[3];
+}
+
+// Alternates between a least squares fit of the blend weights with the scales
+// fixed, and the closed form scales with the weights fixed. Errors are relative
+// so the small arrays count as much as the big ones. The weights are
+// regularized towards the default equal weighting since the per-platform models
+// are strongly correlated.
+static bool FitCostProfile(const std::vector<CalibrationSample> &samples, CostProfile *profile) {
+  double default_sum = 0, measured_sum = 0;
+  for (const CalibrationSample &s : samples) {
+    default_sum += (s.comp[0] + s.comp[1] + s.comp[2] + s.comp[3]) * 0.25;
+    measured_sum += s.nanos;
+  }
+  if (samples.size() < 4 || measured_sum <= 0)
+    return false;
+  double norm = default_sum / measured_sum;
+
+  double w[4] = { 0.25, 0.25, 0.25, 0.25 };
+  double scale[kCostFamily_Count];
+  for (int f = 0; f < kCostFamily_Count; f++)
+    scale[f] = 1.0;
+
+  for (int iter = 0; iter < 8; iter++) {
+    double ata[4][4] = { { 0 } }, aty[4] = { 0 }, x[4];
+    for (const CalibrationSample &s : samples) {
+      double r[4], y = s.nanos * norm;
+      for (int i = 0; i < 4; i++)
+        r[i] = scale[s.family] * s.comp[i] / y;
+      for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++)
+          ata[i][j] += r[i] * r[j];
+        aty[i] += r[i];
+      }
+    }
+    double lambda = 1e-2 * (ata[0][0] + ata[1][1] + ata[2][2] + ata[3][3]) * 0.25;
+    for (int i = 0; i < 4; i++) {
+      ata[i][i] += lambda;
+      aty[i] += lambda * 0.25;
+    }
+    if (!SolveLinear4(ata, aty, x))
+      return false;
+    double wsum = 0;
+    for (int i = 0; i < 4; i++)
+      wsum += (w[i] = std::max(x[i], 0.0));
+    if (wsum <= 0)
+      return false;
+    for (int i = 0; i < 4; i++)
+      w[i] /= wsum;
+
+    double num[kCostFamily_Count] = { 0 }, den[kCostFamily_Count] = { 0 };
+    for (const CalibrationSample &s : samples) {
+      double p = PredictCost(s, w), y = s.nanos * norm;
+      num[s.family] += p / y;
+      den[s.family] += p * p / (y * y);
+    }
+    for (int f = 0; f < kCostFamily_Count; f++)
+      scale[f] = den[f] > 0 ? num[f] / den[f] : 1.0;
+  }
+
+  double predicted_sum = 0;
+  for (const CalibrationSample &s : samples)
+    predicted_sum += PredictCost(s, w) * scale[s.family];
+  double renorm = default_sum / predicted_sum;
+
+  double err = 0;
+  for (const CalibrationSample &s : samples) {
+    double p = PredictCost(s, w) * scale[s.family] * renorm, y = s.nanos * norm;
+    err += (p - y) * (p - y) / (y * y);
+  }
+  for (int i = 0; i < 4; i++)
+    profile->weights[i] = (float)w[i];
+  for (int f = 0; f < kCostFamily_Count; f++)
+    profile->scale[f] = (float)(scale[f] * renorm);
+  profile->num_samples = (int)samples.size();
+  profile->fit_error = (float)sqrt(err / samples.size());
+  return true;
+}
+
+bool CalibrateCostProfile(CostProfile *profile, bool verbose) {
+  static const int kSizes[] = { 4096, 16384, 65536, 0x20000 };
+  static const int kNumSyms[] = { 4, 16, 64, 256 };
+  static const char *const kModeNames[] = { "memcpy", "tans", "huff", "rle", "huff2", "multi" };
+  const int max_size = 0x20000;
+  const int scratch_size = 0x6C000;
+
+  std::vector<uint8> src(max_size), enc(max_size * 2 + 256), dec(max_size + 64), scratch(scratch_size);
+  std::vector<CalibrationSample> samples;
+  uint32 seed = 0x9E3779B9;
+
+  for (int size : kSizes) {
+    for (int num_syms : kNumSyms) {
+      GenerateSkewedBytes(src.data(), size, num_syms, &seed);
+      HistoU8 histo;
+      CountBytesHistoU8(src.data(), size, &histo);
+      int used_syms = 0;
+      for (int i = 0; i < 256; i++)
+        used_syms += (histo.count[i] != 0);
+
+      for (int mode : { 2, 4, 1 }) {
+        CalibrationSample s;
+        float cost = kInvalidCost;
+        int n;
+        s.family = (mode == 1) ? kCostFamily_tANS : (mode == 2) ? kCostFamily_SingleHuffman : kCostFamily_DoubleHuffman;
+        if (mode == 1) {
+          n = EncodeArrayU8_tANS(enc.data() + 5, enc.data() + enc.size(), src.data(), size, histo, 0.0f, 0, &cost);
+          int L_bits = std::max(std::min(ilog2round(size - 5) - 2, 11), 8);
+          GetCostComponents([&](int p) { return GetTime_tANS(p, size - 5, used_syms, 1 << L_bits); }, s.comp);
+        } else {
+          // The double huffman decision depends on speed_tradeoff, a large value forces it.
+          int huff_mode = 0;
+          int opts = kEntropyOpt_SupportsNewHuffman | (mode == 4 ? kEntropyOpt_AllowDoubleHuffman : 0);
+          n = EncodeArray_Huff(enc.data() + 5, enc.data() + enc.size(), src.data(), size, histo,
+                               mode == 4 ? 1.0f : 0.0f, 0, &cost, &huff_mode, opts, 4);
+          if (huff_mode != mode)
+            continue;
+          if (mode == 2)
+            GetCostComponents([&](int p) { return GetTime_SingleHuffman(p, size, used_syms); }, s.comp);
+          else
+            GetCostComponents([&](int p) { return GetTime_DoubleHuffman(p, size, used_syms); }, s.comp);
+        }
+        if (n < 0 || n >= size)
+          continue;
+        WriteChunkHeader(enc.data(), mode, size, n);
+        s.nanos = TimeDecode(enc.data(), n + 5, size, dec.data(), scratch.data(), scratch_size);
+        if (s.nanos <= 0 || memcmp(dec.data(), src.data(), size) != 0)
+          return false;
+        samples.push_back(s);
+        if (verbose)
+          fprintf(stderr, "%-6s %7d bytes %3d syms: %10.0f ns\n", kModeNames[mode], size, used_syms, s.nanos);
+      }
+    }
+
+    // Run length coded arrays.
+    {
+      CalibrationSample s;
+      s.family = kCostFamily_AdvRLE;
+      GenerateRunBytes(src.data(), size, &seed);
+      float cost = kInvalidCost;
+      int n = EncodeArray_AdvRLE(enc.data() + 5, enc.data() + enc.size(), src.data(), size, 0.0f, 0, &cost, 0, 4);
+      if (n > 0 && n < size) {
+        WriteChunkHeader(enc.data(), 3, size, n);
+        GetCostComponents([&](int p) { return GetTime_AdvRLE(p, size); }, s.comp);
+        s.nanos = TimeDecode(enc.data(), n + 5, size, dec.data(), scratch.data(), scratch_size);
+        if (s.nanos <= 0 || memcmp(dec.data(), src.data(), size) != 0)
+          return false;
+        samples.push_back(s);
+        if (verbose)
+          fprintf(stderr, "%-6s %7d bytes          : %10.0f ns\n", kModeNames[3], size, s.nanos);
+      }
+    }
+
+    // Memset, which is an RLE chunk with a single byte payload.
+    {
+      CalibrationSample s;
+      s.family = kCostFamily_Memset;
+      enc[5] = 0x55;
+      memset(src.data(), 0x55, size);
+      WriteChunkHeader(enc.data(), 3, size, 1);
+      GetCostComponents([&](int p) { return GetTime_Memset(p, size); }, s.comp);
+      s.nanos = TimeDecode(enc.data(), 6, size, dec.data(), scratch.data(), scratch_size);
+      if (s.nanos <= 0 || memcmp(dec.data(), src.data(), size) != 0)
+        return false;
+      samples.push_back(s);
+      if (verbose)
+        fprintf(stderr, "%-6s %7d bytes          : %10.0f ns\n", "memset", size, s.nanos);
+    }
+  }
+
+  if (!FitCostProfile(samples, profile))
+    return false;
+  if (verbose) {
+    fprintf(stderr, "fitted weights %.4f %.4f %.4f %.4f from %d samples, rms error %.1f%%\n",
+            profile->weights[0], profile->weights[1], profile->weights[2], profile->weights[3],
+            profile->num_samples, profile->fit_error * 100.0f);
+    for (int f = 0; f < kCostFamily_Count; f++)
+      fprintf(stderr, "scale %-13s %.4f\n", kCostFamilyNames[f], profile->scale[f]);
+  }
+  return true;
+}
+
+static const char kCostProfileMagic[] = "ooz-cost-profile 1";
+
+bool SaveCostProfile(const char *filename, const CostProfile *profile) {
+  FILE *f = fopen(filename, "w");
+  if (!f)
+    return false;
+  fprintf(f, "%s\n", kCostProfileMagic);
+  fprintf(f, "weights %.6g %.6g %.6g %.6g\n",
+          profile->weights[0], profile->weights[1], profile->weights[2], profile->weights[3]);
+  for (int i = 0; i < kCostFamily_Count; i++)
+    fprintf(f, "scale %s %.6g\n", kCostFamilyNames[i], profile->scale[i]);
+  fprintf(f, "samples %d\n", profile->num_samples);
+  fprintf(f, "fit_error %.6g\n", profile->fit_error);
+  return fclose(f) == 0;
+}
+
+bool LoadCostProfile(const char *filename, CostProfile *profile) {
+  FILE *f = fopen(filename, "r");
+  if (!f)
+    return false;
+  char line[256];
+  bool ok = fgets(line, sizeof(line), f) && !strncmp(line, kCostProfileMagic, sizeof(kCostProfileMagic) - 1);
+  bool has_weights = false;
+  memset(profile, 0, sizeof(CostProfile));
+  for (int i = 0; i < kCostFamily_Count; i++)
+    profile->scale[i] = 1.0f;
+  while (ok && fgets(line, sizeof(line), f)) {
+    float *w = profile->weights, v;
+    char name[32];
+    if (sscanf(line, "weights %f %f %f %f", &w[0], &w[1], &w[2], &w[3]) == 4) {
+      has_weights = true;
+    } else if (sscanf(line, "scale %31s %f", name, &v) == 2) {
+      for (int i = 0; i < kCostFamily_Count; i++)
+        if (!strcmp(name, kCostFamilyNames[i]))
+          profile->scale[i] = v;
+    } else if (sscanf(line, "samples %d", &profile->num_samples) != 1) {
+      sscanf(line, "fit_error %f", &profile->fit_error);
+    }
+  }
+  fclose(f);
+  if (!ok || !has_weights)
+    return false;
+  for (int i = 0; i < 4; i++)
+    if (!(profile->weights[i] >= 0.0f))
+      return false;
+  for (int i = 0; i < kCostFamily_Count; i++)
+    if (!(profile->scale[i] > 0.0f))
+      return false;
+  return profile->weights[0] + profile->weights[1] + profile->weights[2] + profile->weights[3] > 0.0f;
+}
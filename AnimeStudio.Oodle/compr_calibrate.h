@@ -0,0 +1,41 @@
+#pragma once
+
+// The encoder's timing models (GetTime_*) each carry four sets of coefficients,
+// one per target platform, which CombineCostComponents blends according to the
+// |platforms| bitmask. A cost profile replaces that blend with weights measured
+// on the machine that will actually run the decoder.
+enum {
+  kPlatformHost = 0x10,
+};
+
+// Timing models that the calibration measures directly. Each gets its own
+// scale on top of the blend, the remaining models only use the blend.
+enum {
+  kCostFamily_SingleHuffman,
+  kCostFamily_DoubleHuffman,
+  kCostFamily_tANS,
+  kCostFamily_AdvRLE,
+  kCostFamily_Memset,
+  kCostFamily_Count,
+};
+
+struct CostProfile {
+  // Weights for the a, b, c and d components of CombineCostComponents.
+  float weights[4];
+  float scale[kCostFamily_Count];
+  // Number of samples the weights were fitted from, and the relative rms error
+  // of the fit. Informational only.
+  int num_samples;
+  float fit_error;
+};
+
+// The profile is process-wide and read without locking by every encoder, so
+// set it before any compression starts and not while one is running.
+void SetCostProfile(const CostProfile *profile);
+const CostProfile *GetCostProfile();
+int GetEncoderPlatforms();
+float GetHostCostScale(int platforms, int family);
+
+bool CalibrateCostProfile(CostProfile *profile, bool verbose);
+bool SaveCostProfile(const char *filename, const CostProfile *profile);
+bool LoadCostProfile(const char *filename, CostProfile *profile);
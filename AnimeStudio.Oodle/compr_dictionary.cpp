@@ -0,0 +1,129 @@
+#include "stdafx.h"
+#include "compr_dictionary.h"
+#include "compress.h"
+#include <algorithm>
+#include <vector>
+
+int CompressBlockWithDictionary(int codec_id, const uint8 *dict, int dict_size, const uint8 *src_in, uint8 *dst_in,
+                                int src_size, int level, const CompressOptions *compressopts) {
+  if (dict_size <= 0)
+    return CompressBlock(codec_id, (uint8*)src_in, dst_in, src_size, level, compressopts, NULL, NULL);
+  // The encoder wants the window in one piece; for the small inputs this is
+  // meant for the copy is cheap next to preloading the match finder.
+  std::vector<uint8> window(dict_size + src_size);
+  memcpy(window.data(), dict, dict_size);
+  memcpy(window.data() + dict_size, src_in, src_size);
+  return CompressBlock(codec_id, window.data() + dict_size, dst_in, src_size, level, compressopts, window.data(), NULL);
+}
+
+// The trainer follows the COVER idea: every dmer (dmer_length byte string) is
+// scored by the number of samples it occurs in, and the corpus is split in
+// one epoch per segment to pick. From each epoch the segment with the highest
+// sum of distinct dmer scores is taken, after which its dmers score zero so
+// later segments cover new content. The best segments go to the end of the
+// dictionary where offsets are cheapest.
+static const int kDmerLength = 8;
+
+static uint32 HashDmer(const uint8 *p, int bits) {
+  return (uint32)((*(uint64*)p * 0xcf1bbcdcb7a56463ull) >> (64 - bits));
+}
+
+struct DictSegment {
+  uint64 score;
+  int pos;
+  bool operator<(const DictSegment &o) const { return score < o.score; }
+};
+
+int TrainDictionary(const uint8 *samples, const int *sample_sizes, int num_samples,
+                    uint8 *dict, int dict_capacity, int segment_size) {
+  size_t total = 0;
+  for (int i = 0; i < num_samples; i++)
+    total += sample_sizes[i];
+  if (dict_capacity <= 0)
+    return 0;
+  // Small corpora fit whole.
+  if (total <= (size_t)dict_capacity) {
+    memcpy(dict, samples, total);
+    return (int)total;
+  }
+  if (total > INT_MAX)
+    return -1;
+  int corpus_size = (int)total;
+  segment_size = std::max(std::min(segment_size, dict_capacity), kDmerLength);
+
+  int bits = 16;
+  while (bits < 24 && (1 << bits) < (int64)corpus_size * 2)
+    bits++;
+
+  // Dmer of each position, or -1 where it would cross a sample boundary.
+  std::vector<int> dmer(corpus_size, -1);
+  std::vector<uint32> freq(1 << bits), last_sample(1 << bits, ~0u);
+  for (int i = 0, pos = 0; i < num_samples; pos += sample_sizes[i++]) {
+    for (int j = 0; j + kDmerLength <= sample_sizes[i]; j++) {
+      uint32 h = HashDmer(samples + pos + j, bits);
+      dmer[pos + j] = h;
+      if (last_sample[h] != (uint32)i) {
+        last_sample[h] = i;
+        freq[h]++;
+      }
+    }
+  }
+  // Dmers that only occur in one sample won't help any other input.
+  for (uint32 &f : freq)
+    if (f < 2)
+      f = 0;
+
+  int num_epochs = std::max(dict_capacity / segment_size, 1);
+  int epoch_size = corpus_size / num_epochs;
+  if (epoch_size < segment_size) {
+    epoch_size = segment_size;
+    num_epochs = corpus_size / segment_size;
+  }
+
+  std::vector<DictSegment> picked;
+  std::vector<uint32> in_window(1 << bits);
+  for (int e = 0; e < num_epochs; e++) {
+    int begin = e * epoch_size, end = std::min(begin + epoch_size, corpus_size);
+    int last = end - segment_size;
+    if (last < begin)
+      continue;
+    // Slide a segment_size window over the epoch, counting each dmer once.
+    uint64 score = 0;
+    DictSegment best = { 0, begin };
+    for (int i = begin; i < end - kDmerLength + 1; i++) {
+      int h = dmer[i];
+      if (h >= 0 && in_window[h]++ == 0)
+        score += freq[h];
+      int first = i - (segment_size - kDmerLength);
+      if (first < begin)
+        continue;
+      if (score > best.score && first <= last)
+        best.score = score, best.pos = first;
+      h = dmer[first];
+      if (h >= 0 && --in_window[h] == 0)
+        score -= freq[h];
+    }
+    // Windows still open at the end of the epoch
+    for (int i = std::max(end - segment_size + 1, begin); i < end - kDmerLength + 1; i++) {
+      int h = dmer[i];
+      if (h >= 0)
+        in_window[h]--;
+    }
+    if (best.score == 0)
+      continue;
+    picked.push_back(best);
+    for (int i = best.pos; i < best.pos + segment_size - kDmerLength + 1; i++)
+      if (dmer[i] >= 0)
+        freq[dmer[i]] = 0;
+  }
+
+  std::stable_sort(picked.begin(), picked.end());
+  int dict_size = std::min<int>(picked.size() * segment_size, dict_capacity);
+  uint8 *d = dict + dict_size;
+  for (size_t i = picked.size(); i-- > 0 && d > dict; ) {
+    int n = std::min<int>(segment_size, d - dict);
+    d -= n;
+    memcpy(d, samples + picked[i].pos + segment_size - n, n);
+  }
+  return dict_size;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// Preset dictionaries for small inputs. The dictionary is placed in front of
+// the input as preload window, so matches can reach back into it. Decoding
+// needs the same dictionary, see Kraken_CreateDictionary.
+
+struct CompressOptions;
+
+int CompressBlockWithDictionary(int codec_id, const uint8 *dict, int dict_size, const uint8 *src_in, uint8 *dst_in,
+                                int src_size, int level, const CompressOptions *compressopts);
+
+// Builds a dictionary of at most |dict_capacity| bytes from the samples stored
+// back to back in |samples|. Returns the dictionary size.
+int TrainDictionary(const uint8 *samples, const int *sample_sizes, int num_samples,
+                    uint8 *dict, int dict_capacity, int segment_size);
@@ -2,13 +2,40 @@
 #include "stdafx.h"
 #include "compr_entropy.h"
 #include "compr_util.h"
+#include "compr_profile.h"
+#include "compr_calibrate.h"
 #include <algorithm>
 #include <vector>
 #include "qsort.h"
 
 #pragma warning (disable: 4018)
 
+static CostProfile cost_profile;
+static bool cost_profile_set;
+
+void SetCostProfile(const CostProfile *profile) {
+  cost_profile_set = (profile != NULL);
+  if (profile)
+    cost_profile = *profile;
+}
+
+const CostProfile *GetCostProfile() {
+  return cost_profile_set ? &cost_profile : NULL;
+}
+
+int GetEncoderPlatforms() {
+  return cost_profile_set ? kPlatformHost : 0;
+}
+
+float GetHostCostScale(int platforms, int family) {
+  return (platforms & kPlatformHost) ? cost_profile.scale[family] : 1.0f;
+}
+
 float CombineCostComponents(int platforms, float a, float b, float c, float d) {
+  if (platforms & kPlatformHost) {
+    const float *w = cost_profile.weights;
+    return a * w[0] + b * w[1] + c * w[2] + d * w[3];
+  }
   if ((platforms & 0xf) == 0)
     return (a + b + c + d) * 0.25f;
   int n = 0;
@@ -35,7 +62,7 @@ float GetTime_SingleHuffman(int platforms, int count, int numsyms) {
     1880.931f + count * 3.243f + numsyms * 10.960f,
     2219.6531f + count * 2.993f + numsyms * 24.622f,
     2889.8579f + count * 2.468f + numsyms * 21.296f,
-    2029.866f + count * 2.699f + numsyms * 8.459f);
+    2029.866f + count * 2.699f + numsyms * 8.459f) * GetHostCostScale(platforms, kCostFamily_SingleHuffman);
 }
 
 float GetTime_DoubleHuffman(int platforms, int count, int numsyms) {
@@ -44,50 +71,86 @@ float GetTime_DoubleHuffman(int platforms, int count, int numsyms) {
     2029.917f + count * 2.436f + numsyms * 10.792f,
     2540.026f + count * 2.087f + numsyms * 20.994f,
     3227.433f + count * 2.501f + numsyms * 18.925f,
-    2084.978f + count * 1.875f + numsyms * 8.9510f);
+    2084.978f + count * 1.875f + numsyms * 8.9510f) * GetHostCostScale(platforms, kCostFamily_DoubleHuffman);
 }
 
 float GetTime_AdvRLE(int platforms, int src_size) {
   return CombineCostComponents1A(platforms, src_size,
                                  0.172f, 0.282f, 0.377f, 0.161f,
-                                 284.970f, 326.121f, 388.669f, 274.267f);
+                                 284.970f, 326.121f, 388.669f, 274.267f) * GetHostCostScale(platforms, kCostFamily_AdvRLE);
 }
 
 float GetTime_Memset(int platforms, int src_size) {
   return CombineCostComponents1A(platforms, src_size,
                                  0.125f, 0.171f, 0.256f, 0.083f,
-                                 28.0f, 53.0f, 58.0f, 29.0f);
+                                 28.0f, 53.0f, 58.0f, 29.0f) * GetHostCostScale(platforms, kCostFamily_Memset);
 }
 
 void CountBytesHistoU8(const uint8 *data, size_t data_size, HistoU8 *histo) {
-  // todo: optimize
-  memset(histo, 0, sizeof(HistoU8));
-  for (size_t i = 0; i < data_size; i++)
-    histo->count[data[i]]++;
+  // Count into four interleaved tables so that runs of the same byte don't
+  // serialize on the increment of a single counter, then sum them up.
+  uint32 counts[4][256];
+  memset(counts, 0, sizeof(counts));
+  size_t i = 0;
+  for (; i + 16 <= data_size; i += 16) {
+    uint64 a = *(uint64*)(data + i), b = *(uint64*)(data + i + 8);
+    counts[0][(uint8)a]++;
+    counts[1][(uint8)(a >> 8)]++;
+    counts[2][(uint8)(a >> 16)]++;
+    counts[3][(uint8)(a >> 24)]++;
+    counts[0][(uint8)(a >> 32)]++;
+    counts[1][(uint8)(a >> 40)]++;
+    counts[2][(uint8)(a >> 48)]++;
+    counts[3][(uint8)(a >> 56)]++;
+    counts[0][(uint8)b]++;
+    counts[1][(uint8)(b >> 8)]++;
+    counts[2][(uint8)(b >> 16)]++;
+    counts[3][(uint8)(b >> 24)]++;
+    counts[0][(uint8)(b >> 32)]++;
+    counts[1][(uint8)(b >> 40)]++;
+    counts[2][(uint8)(b >> 48)]++;
+    counts[3][(uint8)(b >> 56)]++;
+  }
+  for (; i < data_size; i++)
+    counts[0][data[i]]++;
+  for (size_t j = 0; j < 256; j += 4) {
+    simde__m128i v = simde_mm_add_epi32(
+        simde_mm_add_epi32(simde_mm_loadu_si128((simde__m128i*)&counts[0][j]), simde_mm_loadu_si128((simde__m128i*)&counts[1][j])),
+        simde_mm_add_epi32(simde_mm_loadu_si128((simde__m128i*)&counts[2][j]), simde_mm_loadu_si128((simde__m128i*)&counts[3][j])));
+    simde_mm_storeu_si128((simde__m128i*)&histo->count[j], v);
+  }
+}
+
+// Sums the first n4 * 4 entries of a.
+static uint GetHistoSumVec(const uint *a, size_t n4) {
+  simde__m128i acc = simde_mm_setzero_si128();
+  for (size_t i = 0; i < n4; i++)
+    acc = simde_mm_add_epi32(acc, simde_mm_loadu_si128((const simde__m128i*)&a[i * 4]));
+  acc = simde_mm_add_epi32(acc, simde_mm_shuffle_epi32(acc, SIMDE_MM_SHUFFLE(1, 0, 3, 2)));
+  acc = simde_mm_add_epi32(acc, simde_mm_shuffle_epi32(acc, SIMDE_MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint)simde_mm_cvtsi128_si32(acc);
 }
 
 uint GetHistoSum(const uint *a, size_t n) {
-  // todo: optimize
-  uint sum = 0;
-  for (size_t i = 0; i < n; i++)
+  uint sum = GetHistoSumVec(a, n >> 2);
+  for (size_t i = n & ~(size_t)3; i < n; i++)
     sum += a[i];
   return sum;
 }
 
 uint GetHistoSum(const HistoU8 &h) {
-  // todo: optimize
-  uint sum = 0;
-  for (size_t i = 0; i < 256; i++)
-    sum += h.count[i];
-  return sum;
+  return GetHistoSumVec(h.count, 256 / 4);
 }
 
 uint GetHistoMax(const HistoU8 &histo) {
-  // todo: optimize
-  uint m = 0;
-  for (size_t i = 0; i < 256; i++)
-    m = std::max(m, histo.count[i]);
-  return m;
+  uint m0 = 0, m1 = 0, m2 = 0, m3 = 0;
+  for (size_t i = 0; i < 256; i += 4) {
+    m0 = std::max(m0, histo.count[i + 0]);
+    m1 = std::max(m1, histo.count[i + 1]);
+    m2 = std::max(m2, histo.count[i + 2]);
+    m3 = std::max(m3, histo.count[i + 3]);
+  }
+  return std::max(std::max(m0, m1), std::max(m2, m3));
 }
 
 void ConvertHistoToCost(const HistoU8 &src, uint *dst, int extra, int q) {
@@ -534,6 +597,8 @@ public:
 private:
   static const HistoU8*ScaleCounts(const HistoU8 &counts, HistoU8 *out_counts);
 
+  bool LoadMemoized(const HistoU8 &histo, int limit);
+  void StoreMemoized(const HistoU8 &histo, int limit);
   void LimitCodeLensPackageMerge(Entry *ents, const HistoU8 &histo, int limit);
   void LimitCodeLensHeuristic(Entry *ents, const HistoU8 &histo, int limit, Entry *he);
   void CalcNumsymsEtc();
@@ -697,14 +762,122 @@ void HuffBuilder::BuildCodeLens(const HistoU8 &histo_in, int src_size, int limit
     min_code_len_ = min_code_len;
   } else {
     // Max code length too long, use slow limited package merge or fast heuristic
-    if (use_package_merge)
-      LimitCodeLensPackageMerge(ents, *histop, limit);
-    else
+    if (use_package_merge) {
+      if (!LoadMemoized(*histop, limit)) {
+        LimitCodeLensPackageMerge(ents, *histop, limit);
+        StoreMemoized(*histop, limit);
+      }
+    } else {
       LimitCodeLensHeuristic(ents, *histop, limit, ents);
+    }
   }
   assert(max_code_len_ <= limit);
 }
 
+// The encoder may encode the same array more than once while trying out
+// different modes for one block. Length limiting with package-merge is by far
+// the most expensive part of building the code, so remember the last few
+// results per thread.
+struct HuffCodeLenMemo {
+  enum { kNumEntries = 8 };
+  struct Entry {
+    bool valid;
+    uint8 limit;
+    uint8 min_code_len, max_code_len;
+    uint32 hash;
+    int numsyms_of_len[HuffBuilder::kMaxCodeLen];
+    uint8 sym2len[HuffBuilder::kAlphabetSize];
+    HistoU8 histo;
+  } ents[kNumEntries];
+};
+
+static thread_local HuffCodeLenMemo huff_code_len_memo;
+
+static uint32 HashHistoForMemo(const HistoU8 &histo, int limit) {
+  uint32 hash = limit;
+  for (size_t i = 0; i < 256; i++)
+    hash = (hash + histo.count[i]) * 0x9E3779B1;
+  return hash;
+}
+
+bool HuffBuilder::LoadMemoized(const HistoU8 &histo, int limit) {
+  uint32 hash = HashHistoForMemo(histo, limit);
+  const HuffCodeLenMemo::Entry &m = huff_code_len_memo.ents[hash >> 29];
+  if (!m.valid || m.hash != hash || m.limit != limit ||
+      memcmp(&m.histo, &histo, sizeof(HistoU8)) != 0)
+    return false;
+  min_code_len_ = m.min_code_len;
+  max_code_len_ = m.max_code_len;
+  memcpy(numsyms_of_len_, m.numsyms_of_len, sizeof(numsyms_of_len_));
+  memcpy(sym2len_, m.sym2len, sizeof(sym2len_));
+  return true;
+}
+
+void HuffBuilder::StoreMemoized(const HistoU8 &histo, int limit) {
+  uint32 hash = HashHistoForMemo(histo, limit);
+  HuffCodeLenMemo::Entry &m = huff_code_len_memo.ents[hash >> 29];
+  m.valid = true;
+  m.limit = (uint8)limit;
+  m.min_code_len = (uint8)min_code_len_;
+  m.max_code_len = (uint8)max_code_len_;
+  m.hash = hash;
+  memcpy(m.numsyms_of_len, numsyms_of_len_, sizeof(numsyms_of_len_));
+  memcpy(m.sym2len, sym2len_, sizeof(sym2len_));
+  m.histo = histo;
+}
+
+// Boundary package-merge (Katajainen, Moffat and Turpin). Instead of
+// materializing every list of the classic package-merge, only two lookahead
+// chains are kept per code length, each step appends a single node. Runs in
+// O(limit * n) time and the node pool is bounded by 2 * limit * n.
+struct PackageMergeNode {
+  uint32 weight;
+  uint16 count;
+  uint16 tail;
+};
+
+struct PackageMergeState {
+  enum { kNoTail = 0xFFFF };
+  const HuffBuilder::Entry *leaves;
+  int num_leaves;
+  PackageMergeNode *pool;
+  int pool_next;
+  uint16 lists[HuffBuilder::kMaxCodeLen][2];
+};
+
+static void BoundaryPackageMerge(PackageMergeState *st, int index) {
+  PackageMergeNode *pool = st->pool;
+  int last_count = pool[st->lists[index][1]].count;
+  if (index == 0 && last_count >= st->num_leaves)
+    return;
+  uint16 old_chain = st->lists[index][1];
+  uint16 new_chain = (uint16)st->pool_next++;
+  st->lists[index][0] = old_chain;
+  st->lists[index][1] = new_chain;
+  PackageMergeNode *node = &pool[new_chain];
+  if (index == 0) {
+    node->weight = st->leaves[last_count].count;
+    node->count = (uint16)(last_count + 1);
+    node->tail = PackageMergeState::kNoTail;
+    return;
+  }
+  uint32 sum = pool[st->lists[index - 1][0]].weight + pool[st->lists[index - 1][1]].weight;
+  if (last_count < st->num_leaves && sum > st->leaves[last_count].count) {
+    // Next leaf is lighter than the package, it goes into this list.
+    node->weight = st->leaves[last_count].count;
+    node->count = (uint16)(last_count + 1);
+    node->tail = pool[old_chain].tail;
+  } else {
+    // Package consumed the two lookahead chains of the previous list,
+    // create new ones.
+    node->weight = sum;
+    node->count = (uint16)last_count;
+    node->tail = st->lists[index - 1][1];
+    BoundaryPackageMerge(st, index - 1);
+    BoundaryPackageMerge(st, index - 1);
+  }
+}
+
 void HuffBuilder::LimitCodeLensPackageMerge(Entry *ents, const HistoU8 &histo, int limit) {
   Entry *e = ents;
   for (size_t i = 0; i < kAlphabetSize; i++) {
@@ -717,59 +890,62 @@ void HuffBuilder::LimitCodeLensPackageMerge(Entry *ents, const HistoU8 &histo, i
 
   int num_symbols = e - ents;
   num_symbols_ = num_symbols;
-  e->count = 0xFFFF;
+  assert(num_symbols > limit && num_symbols <= (1 << limit) && limit <= kMaxCodeLen);
 
   if (num_symbols <= 32)
     MySort(ents, e);
   else
     RadixSortEnts(ents, num_symbols);
 
-  int ents_per_codelen = 2 * (num_symbols - 1);
-  Entry *tempmem = new Entry[ents_per_codelen * (limit - 1)];
-
-  Entry *huffents[16];
-  huffents[0] = ents;
-  for (int i = 1; i < limit; i++)
-    huffents[i] = tempmem + (i - 1) * ents_per_codelen;
-
-  int numsyms[16] = { num_symbols };
-
-  for (int i = 1; i < limit; i++) {
-    int x = 0, k;
-    Entry *e = ents;
-    for (k = 0; k < ents_per_codelen; k++) {
-      int num = e->count, countsum;
-      if (x + 1 >= numsyms[i - 1] || (countsum = huffents[i - 1][x].count + huffents[i - 1][x + 1].count) > num) {
-        if (num == 0xFFFF)
-          break;
-        huffents[i][k].count = num;
-        huffents[i][k].sym = e->sym;
-        e++;
-      } else {
-        huffents[i][k].count = countsum;
-        huffents[i][k].sym = x | 0x8000;
-        x += 2;
-      }
-    }
-    numsyms[i] = k;
+  PackageMergeState st;
+  st.leaves = ents;
+  st.num_leaves = num_symbols;
+  st.pool = new PackageMergeNode[2 * limit * num_symbols];
+  st.pool_next = 2;
+  st.pool[0].weight = ents[0].count;
+  st.pool[0].count = 1;
+  st.pool[0].tail = PackageMergeState::kNoTail;
+  st.pool[1].weight = ents[1].count;
+  st.pool[1].count = 2;
+  st.pool[1].tail = PackageMergeState::kNoTail;
+  for (int i = 0; i < limit; i++) {
+    st.lists[i][0] = 0;
+    st.lists[i][1] = 1;
   }
 
-  memset(sym2len_, 0, sizeof(sym2len_));
+  // The final list needs 2n - 2 items, two of them are already there.
+  int top = limit - 1;
+  for (int i = 0; i < 2 * num_symbols - 5; i++)
+    BoundaryPackageMerge(&st, top);
+
+  int last_count = st.pool[st.lists[top][1]].count;
+  uint32 sum = st.pool[st.lists[top - 1][0]].weight + st.pool[st.lists[top - 1][1]].weight;
+  if (last_count < num_symbols && sum > ents[last_count].count) {
+    PackageMergeNode *node = &st.pool[st.pool_next];
+    node->count = (uint16)(last_count + 1);
+    node->tail = st.pool[st.lists[top][1]].tail;
+    st.lists[top][1] = (uint16)st.pool_next++;
+  } else {
+    st.pool[st.lists[top][1]].tail = st.lists[top - 1][1];
+  }
 
-  int loop_ctr = numsyms[limit - 1];
-  for (int i = limit - 1; i >= 0; i--) {
-    int loop_ctr_next = 0;
-    for (int j = 0; j < loop_ctr; j++) {
-      uint16 sym = huffents[i][j].sym;
-      if (sym & 0x8000)
-        loop_ctr_next = sym - 0x7FFE;
-      else
-        sym2len_[sym]++;
-    }
-    loop_ctr = loop_ctr_next;
+  // Walking the final chain from the top list down yields boundaries in the
+  // sorted leaves. Leaves between two boundaries share a code length, lengths
+  // grow towards the lightest leaves.
+  int counts[kMaxCodeLen + 1];
+  int num_counts = 0;
+  for (uint16 c = st.lists[top][1]; c != PackageMergeState::kNoTail; c = st.pool[c].tail)
+    counts[++num_counts] = st.pool[c].count;
+
+  memset(sym2len_, 0, sizeof(sym2len_));
+  int len = 1;
+  for (int i = 1, val = counts[1]; i <= num_counts; i++, len++) {
+    int next = (i < num_counts) ? counts[i + 1] : 0;
+    for (; val > next; val--)
+      sym2len_[ents[val - 1].sym] = len;
   }
+  delete[] st.pool;
   CalcNumsymsEtc();
-  delete[] tempmem;
 }
 
 void HuffBuilder::CalcNumsymsEtc() {
@@ -783,7 +959,7 @@ void HuffBuilder::CalcNumsymsEtc() {
     min_len++;
   min_code_len_ = min_len;
 
-  int max_len = 31;
+  int max_len = kMaxCodeLen - 1;
   while (!numsyms_of_len_[max_len])
     max_len--;
   max_code_len_ = max_len;
@@ -1257,6 +1433,7 @@ int EncodeArray_Huff(uint8 *dst, uint8 *dst_end, const uint8 *src, int src_size,
 }
 
 int EncodeArrayU8WithHisto(uint8 *dst, uint8 *dst_end, const uint8 *src, int src_size, const HistoU8 &histo, int opts, float speed_tradeoff, int platforms, float *cost_ptr, int level) {
+  ProfileScope profile(kProfilePhase_Entropy, src_size);
   uint8 *dst_org = dst;
   if (src_size + 5 > dst_end - dst)
     return -1;
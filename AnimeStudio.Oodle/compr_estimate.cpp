@@ -0,0 +1,394 @@
+#include "stdafx.h"
+#include "compr_estimate.h"
+#include "compress.h"
+#include "compr_util.h"
+#include "compr_entropy.h"
+#include "compr_calibrate.h"
+#include "compr_kraken.h"
+#include "compr_leviathan.h"
+#include "compr_mermaid.h"
+#include <algorithm>
+#include <climits>
+#include <vector>
+
+// One sample is taken from each sampled 256k block, made of kSampleSlices
+// slices from the ends of equal parts of the block. The block is also split
+// into kPieceSize pieces that are either raw, costing at least kRawPieceCost
+// of their size with an order-0 entropy coder, or not, and the slices of each
+// kind only stand for the pieces of that kind. That way a block that is part
+// noise and part text is seen as such wherever the slices land. The probe
+// keeps one hash table over the input: the kHistorySize bytes in front of a
+// slice are all inserted, older ones up to kFarHistorySize back only every
+// kFarStride bytes, which still finds the long repeats the encoders' large
+// hash tables do. At most kMaxSamples blocks evenly spread over the input
+// are sampled.
+static const int kSampleSize = 0x8000;
+static const int kSampleSlices = 4;
+static const int kPieceSize = 0x4000;
+static const float kRawPieceCost = 0.97f;
+static const int kHistorySize = 0x4000;
+static const int kFarHistorySize = 0x400000;
+static const int kFarStride = 16;
+static const int kMaxSamples = 64;
+static const int kProbeHashBits = 18;
+static const int kProbeWays = 4;
+
+struct EstimateSample {
+  int len;
+  int lits;
+  int tokens;
+  // Tokens with a literal run or match too long for a single token byte.
+  int long_tokens;
+  // Tokens that don't reuse the previous offset, and the sum of their
+  // offset bit lengths.
+  int new_offsets;
+  int offset_bits;
+  HistoU8 lit_histo;
+};
+
+static void AddLits(EstimateSample *s, const uint8 *p, int n) {
+  for (int i = 0; i < n; i++)
+    s->lit_histo.count[p[i]]++;
+  s->lits += n;
+}
+
+static inline uint32 ProbeHash(uint32 v) {
+  return (v * 0x9E3779B1) >> (32 - kProbeHashBits);
+}
+
+static inline int GetMatchLength(const uint8 *src, int pos, int len, int offs) {
+  int ml = 4;
+  while (pos + ml < len && src[pos + ml] == src[pos + ml - offs])
+    ml++;
+  return ml;
+}
+
+// Positions are relative to |src|, the probe is moved up when they would
+// no longer fit in an int.
+struct ProbeMatcher {
+  const uint8 *src;
+  int len;
+  std::vector<int> table;
+
+  void Reset(const uint8 *base) {
+    src = base;
+    table.assign(kProbeWays << kProbeHashBits, -1);
+  }
+
+  int *Bucket(int pos) {
+    return &table[ProbeHash(*(uint32*)(src + pos)) * kProbeWays];
+  }
+
+  void Insert(int pos) {
+    int *bucket = Bucket(pos);
+    memmove(bucket + 1, bucket, sizeof(int) * (kProbeWays - 1));
+    bucket[0] = pos;
+  }
+
+  // Longest match at |pos| among the last offset and the hash candidates,
+  // then adds |pos| to the table.
+  int Find(int pos, int last_offs, int *offs_ptr) {
+    uint32 v = *(uint32*)(src + pos);
+    int ml = 0, offs = 0;
+    if (last_offs && *(uint32*)(src + pos - last_offs) == v)
+      ml = GetMatchLength(src, pos, len, last_offs), offs = last_offs;
+    int *bucket = Bucket(pos);
+    for (int i = 0; i < kProbeWays; i++) {
+      int cand = bucket[i];
+      if (cand >= 0 && *(uint32*)(src + cand) == v) {
+        int cur = GetMatchLength(src, pos, len, pos - cand);
+        // A new offset has to be a little longer to beat the last one.
+        if (cur > ml + (offs == last_offs && offs))
+          ml = cur, offs = pos - cand;
+      }
+    }
+    Insert(pos);
+    *offs_ptr = offs;
+    return ml;
+  }
+};
+
+// Parse of pm.src[start, len) with a few hash candidates, the last offset
+// and one step of lazy matching, about what the fast levels do, added to
+// |s|. Positions that keep missing are skipped faster, so noise costs little
+// to probe. Matches shorter than |min_match| are left as literals.
+static void ProbeSample(ProbeMatcher &pm, int start, int len, int min_match, EstimateSample *s) {
+  const uint8 *src = pm.src;
+  pm.len = len;
+  s->len += len - start;
+
+  int pos = start, lit_start = start, last_offs = 0, misses = 0;
+  int end = len - 8;
+  while (pos < end) {
+    int offs;
+    int ml = pm.Find(pos, last_offs, &offs);
+    if (ml < min_match) {
+      pos += 1 + (misses++ >> 5);
+      continue;
+    }
+    while (pos + 1 < end) {
+      int offs1;
+      int ml1 = pm.Find(pos + 1, last_offs, &offs1);
+      if (ml1 <= ml + 1)
+        break;
+      pos++, ml = ml1, offs = offs1;
+    }
+
+    int lrl = pos - lit_start;
+    AddLits(s, src + lit_start, lrl);
+    s->tokens++;
+    s->long_tokens += (lrl > 7 || ml > 17);
+    if (offs != last_offs) {
+      s->new_offsets++;
+      s->offset_bits += BSR(offs) + 1;
+    }
+    last_offs = offs;
+    misses = 0;
+    pos += ml;
+    lit_start = pos;
+  }
+  AddLits(s, src + lit_start, len - lit_start);
+}
+
+static int GetUsedSyms(const HistoU8 &h) {
+  int n = 0;
+  for (int i = 0; i < 256; i++)
+    n += (h.count[i] != 0);
+  return n;
+}
+
+// Size and decode time of the LZ encoding of a sample. The per token byte
+// counts are rough averages of what each codec spends on commands, offsets
+// and extra lengths.
+static void EstimateLz(int codec_id, const EstimateSample &s, int platforms, float *size, float *time) {
+  float lit_huff = s.lits ? GetHistoCostApprox(s.lit_histo, s.lits) * 0.125f : 0.0f;
+  float lit_time = s.lits ? GetTime_SingleHuffman(platforms, s.lits, GetUsedSyms(s.lit_histo)) : 0.0f;
+  float offs_bytes = (s.offset_bits + s.new_offsets) * 0.125f;
+
+  switch (codec_id) {
+  case kCompressorKraken:
+    *size = std::min(lit_huff, (float)s.lits) + s.tokens * 0.75f + offs_bytes + s.long_tokens;
+    *time = GetTime_KrakenWriteBits(platforms, s.len, s.tokens, s.long_tokens) + lit_time +
+            GetTime_SingleHuffman(platforms, s.tokens, 64);
+    break;
+  case kCompressorLeviathan:
+    *size = std::min(lit_huff, (float)s.lits) + s.tokens * 0.6f + offs_bytes * 0.95f + s.long_tokens;
+    *time = GetTime_Leviathan(platforms, s.len, s.tokens, s.long_tokens) + lit_time;
+    break;
+  case kCompressorMermaid:
+    // Mermaid entropy codes its tokens, Selkie doesn't.
+    *size = std::min(lit_huff, (float)s.lits) + s.tokens * 0.6f + s.new_offsets * 2 + s.long_tokens * 2;
+    *time = GetTime_Mermaid(platforms, s.len, s.tokens, s.long_tokens) + lit_time +
+            GetTime_MermaidOff16(platforms, s.new_offsets);
+    break;
+  default:
+    // Selkie stores its literals raw too.
+    *size = (float)s.lits + s.tokens + s.new_offsets * 2 + s.long_tokens * 2;
+    *time = GetTime_Selkie(platforms, s.len, s.tokens, s.long_tokens, s.lits) +
+            GetTime_MermaidOff16(platforms, s.new_offsets);
+    break;
+  }
+}
+
+// The probe parses the same way at every level but -4, while the encoders
+// find more and better matches as the level goes up. Measured ratio of
+// actual to probed LZ size, per level from -4 to 8 and codec (Kraken,
+// Mermaid, Selkie, Leviathan). Level 0 and Leviathan below level 1 have no
+// parser.
+static const float kLzParseGain[13][kMaxCompressEstimates] = {
+  { 1.425f, 1.325f, 1.190f, 1.000f },  // -4
+  { 1.095f, 0.971f, 1.060f, 1.000f },  // -3
+  { 1.027f, 0.938f, 1.032f, 1.000f },  // -2
+  { 1.054f, 1.051f, 1.148f, 1.000f },  // -1
+  { 1.000f, 1.000f, 1.000f, 1.000f },  // 0
+  { 0.956f, 1.048f, 1.132f, 1.018f },  // 1
+  { 0.927f, 1.000f, 1.067f, 0.968f },  // 2
+  { 0.873f, 0.950f, 1.006f, 0.896f },  // 3
+  { 0.833f, 0.894f, 0.909f, 0.861f },  // 4
+  { 0.768f, 0.821f, 0.858f, 0.795f },  // 5
+  { 0.749f, 0.809f, 0.846f, 0.778f },  // 6
+  { 0.727f, 0.777f, 0.846f, 0.760f },  // 7
+  { 0.725f, 0.777f, 0.846f, 0.760f },  // 8
+};
+
+static float GetLzParseGain(int codec_index, int level) {
+  return kLzParseGain[std::max(-4, std::min(level, 8)) + 4][codec_index];
+}
+
+// Level 0 stores, and Leviathan has no parser below level 1, leaving only
+// plain huffman.
+static bool HasLzParser(int codec_id, int level) {
+  return level > 0 || (level < 0 && codec_id != kCompressorLeviathan);
+}
+
+static bool IsPlainHuffmanChecked(int codec_id, int level) {
+  switch (codec_id) {
+  case kCompressorKraken: return level >= 3;
+  case kCompressorLeviathan: return true;
+  case kCompressorMermaid: return level >= 4;
+  default: return false;
+  }
+}
+
+int EstimateCompression(const uint8 *src, size_t src_size, int level, const CompressOptions *compressopts,
+                        CompressEstimate *estimates) {
+  static const int kCodecs[kMaxCompressEstimates] = {
+    kCompressorKraken, kCompressorMermaid, kCompressorSelkie, kCompressorLeviathan
+  };
+  if (!compressopts)
+    compressopts = GetDefaultCompressOpts(level);
+  int platforms = GetEncoderPlatforms();
+
+  double size[kMaxCompressEstimates] = { 0 }, time[kMaxCompressEstimates] = { 0 };
+  double stored[kMaxCompressEstimates] = { 0 };
+  size_t num_blocks = (src_size + 0x3FFFF) >> 18;
+  size_t block_step = std::max<size_t>(1, (num_blocks + kMaxSamples - 1) / kMaxSamples);
+  size_t sampled_bytes = 0;
+  ProbeMatcher pm;
+  pm.Reset(src);
+  // Everything from the start of the history of a sample up to src + inserted
+  // is in the probe.
+  size_t inserted = 0;
+  // Levels -2 and -3 hash 16-bit positions, so they only find matches close
+  // by.
+  bool far_history = level != -2 && level != -3;
+  // Level -4 only takes matches of 8 bytes or more.
+  int min_match = (level <= -4) ? 8 : 1;
+
+  for (size_t blk = 0; blk < num_blocks; blk += block_step) {
+    const uint8 *block = src + (blk << 18);
+    int block_len = (int)std::min<size_t>(src_size - (blk << 18), 0x40000);
+    int len = std::min(block_len, kSampleSize);
+    sampled_bytes += block_len;
+
+    // Block and quantum headers, and a chunk header per 128k.
+    for (int i = 0; i < kMaxCompressEstimates; i++)
+      size[i] += 5 + 3 * ((block_len + 0x1FFFF) >> 17);
+
+    if (AreAllBytesEqual(block + block_len - len, len) && AreAllBytesEqual(block, block_len)) {
+      for (int i = 0; i < kMaxCompressEstimates; i++)
+        time[i] += GetTime_Memset(platforms, block_len);
+      continue;
+    }
+    // Raw and other pieces of the block. A block too small for more than
+    // one slice is probed whole.
+    int num_slices = (len == kSampleSize) ? kSampleSlices : 1;
+    int slice_len = len / num_slices;
+    int num_pieces = (block_len + kPieceSize - 1) / kPieceSize;
+    bool piece_raw[0x40000 / kPieceSize] = { false };
+    int kind_bytes[2] = { 0, 0 };
+    HistoU8 histo;
+    memset(&histo, 0, sizeof(histo));
+    for (int p = 0; p < num_pieces; p++) {
+      int n = std::min(kPieceSize, block_len - p * kPieceSize);
+      HistoU8 piece_histo;
+      CountBytesHistoU8(block + p * kPieceSize, n, &piece_histo);
+      for (int i = 0; i < 256; i++)
+        histo.count[i] += piece_histo.count[i];
+      piece_raw[p] = num_slices > 1 && GetHistoCostApprox(piece_histo, n) >= n * 8 * kRawPieceCost;
+      kind_bytes[piece_raw[p]] += n;
+    }
+
+    // When no slice lands on a kind of piece the block has, the slice
+    // nearest to the last such piece is moved there, unless it would then
+    // overlap another one.
+    int slice_end[kSampleSlices];
+    for (int k = 0; k < num_slices; k++)
+      slice_end[k] = block_len * (k + 1) / num_slices;
+    for (int kind = 0; kind < 2 && num_slices > 1; kind++) {
+      bool sampled = false;
+      for (int k = 0; k < num_slices; k++)
+        sampled |= (piece_raw[(slice_end[k] - 1) / kPieceSize] == (kind != 0));
+      int p = num_pieces - 1;
+      while (p >= 0 && piece_raw[p] != (kind != 0))
+        p--;
+      if (sampled || p < 0)
+        continue;
+      int end = std::max(std::min((p + 1) * kPieceSize, block_len), slice_len);
+      int k = 0;
+      for (int j = 1; j < num_slices; j++)
+        if (abs(slice_end[j] - end) < abs(slice_end[k] - end))
+          k = j;
+      if ((k == 0 || slice_end[k - 1] <= end - slice_len) && (k == num_slices - 1 || end <= slice_end[k + 1] - slice_len))
+        slice_end[k] = end;
+    }
+
+    EstimateSample kind_sample[2];
+    memset(kind_sample, 0, sizeof(kind_sample));
+    for (int k = 0; k < num_slices; k++) {
+      size_t slice_pos = (blk << 18) + slice_end[k] - slice_len;
+      size_t history_from = slice_pos - std::min<size_t>(slice_pos, far_history ? kFarHistorySize : kHistorySize);
+      if (!far_history || slice_pos + slice_len - (pm.src - src) > INT_MAX) {
+        pm.Reset(src + history_from);
+        inserted = history_from;
+      }
+      inserted = std::max(inserted, history_from);
+      size_t dense_from = std::max(inserted, slice_pos - std::min<size_t>(slice_pos, kHistorySize));
+      int base = (int)(pm.src - src);
+      for (size_t i = (inserted + kFarStride - 1) & ~(size_t)(kFarStride - 1); i < dense_from; i += kFarStride)
+        pm.Insert((int)(i - base));
+      for (size_t i = dense_from; i < slice_pos; i++)
+        pm.Insert((int)(i - base));
+      EstimateSample *ks = &kind_sample[piece_raw[(slice_end[k] - 1) / kPieceSize]];
+      ProbeSample(pm, (int)(slice_pos - base), (int)(slice_pos + slice_len - base), min_match, ks);
+      inserted = slice_pos + slice_len;
+    }
+    // A kind that still has no slice is counted with the other one.
+    for (int kind = 0; kind < 2; kind++) {
+      if (!kind_sample[kind].len) {
+        kind_bytes[!kind] += kind_bytes[kind];
+        kind_bytes[kind] = 0;
+      }
+    }
+
+    float raw_time = GetTime_Memset(platforms, block_len);
+    float huff_size = GetHistoCostApprox(histo, block_len) * 0.125f;
+    float huff_time = GetTime_SingleHuffman(platforms, block_len, GetUsedSyms(histo));
+
+    for (int i = 0; i < kMaxCompressEstimates; i++) {
+      // Same choice as CompressQuantum: LZ, plain huffman or stored, by
+      // size plus weighted decode time.
+      float tradeoff = GetSpeedTradeoff(kCodecs[i], compressopts);
+      float best_size = (float)block_len, best_time = raw_time;
+      float best_cost = best_size + best_time * tradeoff;
+      bool is_stored = true;
+
+      // The choice is made on the probed size. The parse gain only adjusts
+      // the LZ size reported for the pieces that aren't raw, a better parse
+      // doesn't shrink noise.
+      float lz_size = 0, lz_gained_size = 0, lz_time = 0;
+      for (int kind = 0; kind < 2; kind++) {
+        if (!kind_bytes[kind])
+          continue;
+        float kind_size, kind_time;
+        EstimateLz(kCodecs[i], kind_sample[kind], platforms, &kind_size, &kind_time);
+        float scale = (float)kind_bytes[kind] / kind_sample[kind].len;
+        lz_size += kind_size * scale;
+        lz_gained_size += kind_size * (kind ? 1.0f : GetLzParseGain(i, level)) * scale;
+        lz_time += kind_time * scale;
+      }
+      if (HasLzParser(kCodecs[i], level) && lz_size + lz_time * tradeoff < best_cost) {
+        best_size = lz_gained_size, best_time = lz_time;
+        best_cost = lz_size + lz_time * tradeoff;
+        is_stored = false;
+      }
+      if (IsPlainHuffmanChecked(kCodecs[i], level) && huff_size + huff_time * tradeoff < best_cost) {
+        best_size = huff_size, best_time = huff_time;
+        is_stored = false;
+      }
+      size[i] += best_size;
+      time[i] += best_time;
+      if (is_stored)
+        stored[i] += block_len;
+    }
+  }
+
+  double extrapolate = sampled_bytes ? (double)src_size / sampled_bytes : 0.0;
+  for (int i = 0; i < kMaxCompressEstimates; i++) {
+    estimates[i].codec_id = kCodecs[i];
+    estimates[i].compressed_size = (int64)(size[i] * extrapolate + 0.5);
+    estimates[i].decode_time = (float)(time[i] * extrapolate);
+    estimates[i].stored_bytes = (int64)(stored[i] * extrapolate + 0.5);
+  }
+  return kMaxCompressEstimates;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// Predicts how well each codec would do on a buffer without running the
+// encoder. A few samples from the buffer go through a greedy hash probe, and
+// the encoder's own histogram costs and timing models turn the result into
+// a size and a decode time. Meant for triage, such as skipping inputs that
+// won't compress or picking a codec; the numbers are not exact.
+
+struct CompressOptions;
+
+struct CompressEstimate {
+  int codec_id;
+  int64 compressed_size;
+  // Decode time in the units of the encoder's timing models.
+  float decode_time;
+  // Input bytes that are expected to be stored uncompressed.
+  int64 stored_bytes;
+};
+
+enum {
+  kMaxCompressEstimates = 4,
+  // Range of estimated / actual compressed size, in percent off, measured
+  // over text, binaries, mixed archives, random and already compressed data
+  // and their mixtures at levels -4 to 8 for every codec. Other data can fall
+  // outside it.
+  kEstimateErrorLowPercent = -18,
+  kEstimateErrorHighPercent = 22,
+};
+
+// Fills |estimates| with one entry per codec (Kraken, Mermaid, Selkie and
+// Leviathan) and returns the number of entries.
+int EstimateCompression(const uint8 *src, size_t src_size, int level, const CompressOptions *compressopts,
+                        CompressEstimate *estimates);
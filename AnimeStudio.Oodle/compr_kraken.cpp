@@ -4,6 +4,7 @@
 #include "compress.h"
 #include "compr_util.h"
 #include "compr_entropy.h"
+#include "compr_calibrate.h"
 #include <algorithm>
 #include <memory>
 #include "match_hasher.h"
@@ -72,8 +73,10 @@ struct Krak {
     Token *data;
     int size, capacity;
   };
+  // The cost of the best path to each state lives in a separate array next
+  // to the State array: it's compared for every candidate, while the rest is
+  // only read or written when a candidate wins.
   struct State {
-    int best_bit_count;
     int recent_offs[3];
     int matchlen;
     int litlen;
@@ -81,7 +84,6 @@ struct Krak {
     int prev_state;
 
     void Initialize() {
-      best_bit_count = 0;
       recent_offs[0] = 8;
       recent_offs[1] = 8;
       recent_offs[2] = 8;
@@ -318,7 +320,7 @@ struct Krak {
 
 
 
-static float GetTime_KrakenWriteBits(int platforms, int src_len, int tokens, int len8) {
+float GetTime_KrakenWriteBits(int platforms, int src_len, int tokens, int len8) {
   return CombineCostComponents(platforms,
       200.0f + src_len * 0.405f + tokens * 15.213f + len8 * 4.017f,
       200.0f + src_len * 0.419f + tokens * 19.861f + len8 * 10.898f,
@@ -339,6 +341,7 @@ static int Kraken_EncodeLzArrays(float *cost_ptr, int *chunk_type_ptr, Krak::Sta
                                  uint8 *dst, uint8 *dst_end,
                                  LzCoder *lzcoder, LzTemp *lztemp,
                                  KrakEncLz *kl, int start_pos) {
+  ProfileScope profile(kProfilePhase_TokenEncoding, kl->src_len, kl->src_ptr);
   uint8 *dst_org = dst;
 
   if (stats)
@@ -754,6 +757,73 @@ no_match:
   return Kraken_EncodeLzArrays(cost_ptr, chunk_type_ptr, NULL, dst, dst_end, coder, lztemp, &kl, start_pos);
 }
 
+// Level -4. Each position gets one hash probe of 8 bytes and nothing else:
+// no recent offsets, no backing up over literals and no inserts inside
+// matches. Matches shorter than 8 bytes are left as literals, which keeps the
+// token count and the branches per byte down. A probe that lands within the
+// last 8 bytes means a run, which is taken at offset 8. The step grows with
+// the literal run so data without matches is crossed quickly, and a quantum
+// that comes out nearly all literals is stored without running the entropy
+// coders.
+template<typename Hasher>
+int KrakenCompressUltrafast(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls_unused,
+                            const uint8 *src, int src_size,
+                            uint8 *dst, uint8 *dst_end,
+                            int start_pos, int *chunk_type_ptr, float *cost_ptr) {
+  *chunk_type_ptr = -1;
+  if (src_size <= 128)
+    return -1;
+
+  uint dict_size = coder->opts->dictionarySize > 0 && coder->opts->dictionarySize <= 0x40000000 ?
+      coder->opts->dictionarySize : 0x40000000;
+
+  KrakEncLz kl;
+  KrakEncLz_Init(&kl, lztemp, src_size, src, coder->encode_flags);
+  KrakenRecentOffs recent;
+
+  const uint8 *src_cur = src + ((start_pos == 0) ? 8 : 0);
+  const uint8 *src_end = src + src_size;
+  const uint8 *src_end_safe = src_end - 16;
+  const uint8 *litstart = src_cur;
+  Hasher *hasher = (Hasher*)coder->hasher;
+  const uint8 *src_base = hasher->src_base_;
+  uint64 hashmult = hasher->hashmult_;
+  typename Hasher::ElemType *hash_ptr = hasher->hash_ptr_;
+  int hashshift = 64 - hasher->hash_bits_;
+
+  while (src_cur < src_end_safe) {
+    uint64 u64_at_cur = *(uint64*)src_cur;
+    typename Hasher::ElemType *hash = &hash_ptr[(size_t)(u64_at_cur * hashmult >> hashshift)];
+    uint32 offs = (typename Hasher::ElemType)(src_cur - src_base - *hash);
+    *hash = src_cur - src_base;
+    if ((uint)(offs - 8) < (uint)(dict_size - 8)) {
+      if (u64_at_cur != *(uint64*)(src_cur - offs))
+        goto no_match;
+    } else if (offs - 1 < 8 && u64_at_cur == *(uint64*)(src_cur - 8)) {
+      offs = 8;
+    } else {
+no_match:
+      src_cur += 1 + ((src_cur - litstart) >> 4);
+      continue;
+    }
+    const uint8 *matchstart = src_cur;
+    for (src_cur += 8; src_cur < src_end - 8; src_cur += 8) {
+      uint64 v = *(uint64*)src_cur ^ *(uint64*)(src_cur - offs);
+      if (v != 0) {
+        src_cur += BSF64(v) >> 3;
+        break;
+      }
+    }
+    src_cur = std::min(src_cur, src_end - 8);
+    KrakEnc_AddToken<false, false>(kl, recent, litstart, matchstart - litstart, src_cur - matchstart, offs);
+    litstart = src_cur;
+  }
+  KrakEnc_AddFinal<false>(kl, litstart, src_end);
+  if (kl.lits - kl.lits_start > src_size - (src_size >> 5))
+    return src_size;
+  return Kraken_EncodeLzArrays(cost_ptr, chunk_type_ptr, NULL, dst, dst_end, coder, lztemp, &kl, start_pos);
+}
+
 static __forceinline void KrakCheckRecentMatch(const uint8 *src, const uint8 *src_end, uint32 u32, KrakenRecentOffs &recent, int idx, int &best_ml, int &best_off) {
   int ml = GetMatchlengthQ(src, recent.offs[4 + idx], src_end, u32);
   if (ml > best_ml)
@@ -1059,10 +1129,10 @@ static int Krak_EncodeTokens(LzTemp *lztemp, float *cost_ptr, int *chunk_type_pt
 }
 
 template<int IsRecent>
-static __forceinline bool UpdateState(int state_idx, int bits, int lrl, int ml, int recent, int prev_state, int qrm, Krak::State *S) {
-  Krak::State *st = &S[state_idx];
-  if (bits < st->best_bit_count) {
-    st->best_bit_count = bits;
+static __forceinline bool UpdateState(int state_idx, int bits, int lrl, int ml, int recent, int prev_state, int qrm, Krak::State *S, int *B) {
+  if (bits < B[state_idx]) {
+    Krak::State *st = &S[state_idx];
+    B[state_idx] = bits;
     st->litlen = lrl;
     st->matchlen = ml;
     int *recent_offs_ptr = S[prev_state].recent_offs;
@@ -1094,16 +1164,70 @@ static __forceinline bool UpdateState(int state_idx, int bits, int lrl, int ml,
 }
 
 template<int IsRecent>
-static __forceinline void UpdateStatesZ(int pos, int bits, int lrl, int ml, int recent, int prev_state, Krak::State *S, const uint8 *src_ptr, int offs, int Z, Krak::CostModel &cm, int *litindexes) {
+static __forceinline void UpdateStatesZ(int pos, int bits, int lrl, int ml, int recent, int prev_state, Krak::State *S, int *B, const uint8 *src_ptr, int offs, int Z, Krak::CostModel &cm, int *litindexes) {
   int after_match = pos + ml;
-  UpdateState<IsRecent>(after_match * Z, bits, lrl, ml, recent, prev_state, 0, S);
+  UpdateState<IsRecent>(after_match * Z, bits, lrl, ml, recent, prev_state, 0, S, B);
   for (int jj = 1; jj < Z; jj++) {
     bits += Krak::BitsForLit(src_ptr, after_match + jj - 1, offs, cm, jj - 1);
-    if (UpdateState<IsRecent>((after_match + jj) * Z + jj, bits, lrl, ml, recent, prev_state, 0, S) && jj == Z - 1)
+    if (UpdateState<IsRecent>((after_match + jj) * Z + jj, bits, lrl, ml, recent, prev_state, 0, S, B) && jj == Z - 1)
       litindexes[after_match + jj] = jj;
   }
 }
 
+// Same as calling UpdateStatesZ for every shorter length tml in [tml_from, tml_to).
+// From length 17 on the token price is one token_cost entry plus a contiguous
+// run of matchlen_cost, so four lengths are priced and compared against B at once
+// and only the winners go through UpdateState, in the same order as before.
+template<int IsRecent>
+static __forceinline void UpdateStatesShorter(int pos, int bits, int tml_from, int tml_to, int recent_field, int length_field,
+                                              int lrl, int recent, int prev_state, Krak::State *S, int *B,
+                                              const uint8 *src_ptr, int offs, int Z, Krak::CostModel &cm, int *litindexes) {
+  int tml = tml_from;
+  for (; tml < tml_to && tml < 17; tml++)
+    UpdateStatesZ<IsRecent>(pos, bits + Krak::BitsForToken(cm, tml, pos - lrl, recent_field, length_field),
+                            lrl, tml, recent, prev_state, S, B, src_ptr, offs, Z, cm, litindexes);
+  if (Z <= 2) {
+    simde__m128i token_bits = simde_mm_set1_epi32(bits + cm.token_cost[(15 << 2) + (recent_field << 6) + length_field]);
+    for (; tml + 4 <= tml_to; tml += 4) {
+      int after_match = pos + tml;
+      simde__m128i cost = simde_mm_add_epi32(token_bits, simde_mm_loadu_si128((const simde__m128i *)&cm.matchlen_cost[tml - 17]));
+      int costs[4], costs_lit[4], better, better_lit = 0;
+      simde_mm_storeu_si128((simde__m128i *)costs, cost);
+      if (Z == 1) {
+        better = simde_mm_movemask_ps(simde_mm_castsi128_ps(
+          simde_mm_cmpgt_epi32(simde_mm_loadu_si128((const simde__m128i *)&B[after_match]), cost)));
+      } else {
+        // B is interleaved by lit count, so the no-lit states are the even
+        // slots at after_match and the one-lit states the odd slots one past it.
+        const simde__m128i *b = (const simde__m128i *)&B[after_match * 2];
+        simde__m128i b0 = simde_mm_castps_si128(simde_mm_shuffle_ps(
+          simde_mm_castsi128_ps(simde_mm_loadu_si128(b)), simde_mm_castsi128_ps(simde_mm_loadu_si128(b + 1)), SIMDE_MM_SHUFFLE(2, 0, 2, 0)));
+        simde__m128i b1 = simde_mm_castps_si128(simde_mm_shuffle_ps(
+          simde_mm_castsi128_ps(simde_mm_loadu_si128((const simde__m128i *)&B[after_match * 2 + 2])),
+          simde_mm_castsi128_ps(simde_mm_loadu_si128((const simde__m128i *)&B[after_match * 2 + 6])), SIMDE_MM_SHUFFLE(3, 1, 3, 1)));
+        simde__m128i cost_lit = simde_mm_add_epi32(cost, simde_mm_setr_epi32(
+          Krak::BitsForLit(src_ptr, after_match + 0, offs, cm, 0), Krak::BitsForLit(src_ptr, after_match + 1, offs, cm, 0),
+          Krak::BitsForLit(src_ptr, after_match + 2, offs, cm, 0), Krak::BitsForLit(src_ptr, after_match + 3, offs, cm, 0)));
+        simde_mm_storeu_si128((simde__m128i *)costs_lit, cost_lit);
+        better = simde_mm_movemask_ps(simde_mm_castsi128_ps(simde_mm_cmpgt_epi32(b0, cost)));
+        better_lit = simde_mm_movemask_ps(simde_mm_castsi128_ps(simde_mm_cmpgt_epi32(b1, cost_lit)));
+      }
+      // Each lane targets its own states, so the masks stay valid while
+      // earlier lanes are written.
+      for (int i = 0; i < 4; i++) {
+        if (better >> i & 1)
+          UpdateState<IsRecent>((after_match + i) * Z, costs[i], lrl, tml + i, recent, prev_state, 0, S, B);
+        if ((better_lit >> i & 1) &&
+            UpdateState<IsRecent>((after_match + i + 1) * 2 + 1, costs_lit[i], lrl, tml + i, recent, prev_state, 0, S, B))
+          litindexes[after_match + i + 1] = 1;
+      }
+    }
+  }
+  for (; tml < tml_to; tml++)
+    UpdateStatesZ<IsRecent>(pos, bits + Krak::BitsForToken(cm, tml, pos - lrl, recent_field, length_field),
+                            lrl, tml, recent, prev_state, S, B, src_ptr, offs, Z, cm, litindexes);
+}
+
 int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
                   const MatchLenStorage *mls,
                   const uint8 *src_ptr, int src_size,
@@ -1137,7 +1261,9 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
   int tokens_capacity = 4096 + 8;
   Krak::Token *tokens_begin = (Krak::Token*)lztemp->lztoken_scratch.Allocate(sizeof(Krak::Token) * tokens_capacity);
 
-  Krak::State *S = (Krak::State*)lztemp->states.Allocate(sizeof(Krak::State) * Z * (src_size + 1));
+  int num_states = Z * (src_size + 1);
+  Krak::State *S = (Krak::State*)lztemp->states.Allocate((sizeof(Krak::State) + sizeof(int)) * num_states);
+  int *B = (int*)(S + num_states);
   uint8 *tmp_dst = (uint8*)S, *tmp_dst_end = tmp_dst + lztemp->states.size;
 
   int chunk_type = 0, tmp_chunk_type;
@@ -1219,7 +1345,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
     Krak::MakeCostModel(&stats, &cost_model);
 
     for (int i = 0; i <= Z * src_size; i++)
-      S[i].best_bit_count = INT_MAX;
+      B[i] = INT_MAX;
 
     int final_lz_offset = -1;
     int last_recent0 = 0;
@@ -1228,6 +1354,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
 
     // Initial state
     S[Z * chunk_start].Initialize();
+    B[Z * chunk_start] = 0;
 
     while (chunk_start < src_size - 16) {
       int lit_bits_since_prev = 0;
@@ -1246,15 +1373,15 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
       if (Z > 1) {
         for (int i = 1; i < Z; i++)
           for (int j = 0; j < Z; j++)
-            S[Z * (chunk_start + i) + j].best_bit_count = INT_MAX;
+            B[Z * (chunk_start + i) + j] = INT_MAX;
 
         for (int j = 1; j < Z; j++)
-          S[Z * chunk_start + j].best_bit_count = INT_MAX;
+          B[Z * chunk_start + j] = INT_MAX;
 
         if (max_offset - chunk_start > Z) {
           for (int i = 1; i < Z; i++) {
             S[(chunk_start + i) * Z + i] = S[(chunk_start + i - 1) * Z + i - 1];
-            S[(chunk_start + i) * Z + i].best_bit_count +=
+            B[(chunk_start + i) * Z + i] = B[(chunk_start + i - 1) * Z + i - 1] +
               Krak::BitsForLit(src_ptr, chunk_start + i - 1, S[chunk_start * Z].recent_offs[0], cost_model, i - 1);
           }
           litindexes[chunk_start + Z - 1] = Z - 1;
@@ -1278,9 +1405,9 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
           // path to the state, reset the accumulation.
           if (pos != prev_offset) {
             lit_bits_since_prev += Krak::BitsForLit(src_ptr, pos - 1, S[prev_offset].recent_offs[0], cost_model, pos - prev_offset - 1);
-            int curbits = S[pos].best_bit_count;
+            int curbits = B[pos];
             if (curbits != INT_MAX) {
-              int prevbits = S[prev_offset].best_bit_count + lit_bits_since_prev;
+              int prevbits = B[prev_offset] + lit_bits_since_prev;
               if (curbits < prevbits + Krak::BitsForLitlen(cost_model, pos - prev_offset)) {
                 prev_offset = pos;
                 lit_bits_since_prev = 0;
@@ -1295,8 +1422,8 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
           if (pos >= max_offset) {
             int tmp_cur_offset = 0, best_bits = 0x7FFFFFFF;
             for (int i = 0; i < Z; i++) {
-              if (S[Z * pos + i].best_bit_count < best_bits) {
-                best_bits = S[Z * pos + i].best_bit_count;
+              if (B[Z * pos + i] < best_bits) {
+                best_bits = B[Z * pos + i];
                 tmp_cur_offset = pos - ((i != Z - 1) ? i : litindexes[pos]);
               }
             }
@@ -1306,12 +1433,13 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             }
           }
           // Update the alternate state with the lit cost.
-          Krak::State *cur = &S[Z * pos + Z - 1];
-          if (cur->best_bit_count != 0x7FFFFFFF) {
-            int bits = cur->best_bit_count + Krak::BitsForLit(src_ptr, pos, cur->recent_offs[0], cost_model, litindexes[pos]);
-            if (bits < cur[Z].best_bit_count) {
+          int cur_idx = Z * pos + Z - 1;
+          Krak::State *cur = &S[cur_idx];
+          if (B[cur_idx] != 0x7FFFFFFF) {
+            int bits = B[cur_idx] + Krak::BitsForLit(src_ptr, pos, cur->recent_offs[0], cost_model, litindexes[pos]);
+            if (bits < B[cur_idx + Z]) {
               cur[Z] = *cur;
-              cur[Z].best_bit_count = bits;
+              B[cur_idx + Z] = bits;
               litindexes[pos + 1] = litindexes[pos] + 1;
             }
           }
@@ -1369,7 +1497,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             if (pos - lrl < chunk_start)
               break;
             prev_state = pos - lrl;
-            total_bits = S[prev_state].best_bit_count;
+            total_bits = B[prev_state];
             if (total_bits == INT_MAX)
               continue;
             total_bits += (lrl == lits_since_prev) ? lit_bits_since_prev :
@@ -1378,7 +1506,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
           } else {
             if (lazy < Z) {
               prev_state = Z * pos + lazy;
-              total_bits = S[prev_state].best_bit_count;
+              total_bits = B[prev_state];
               if (total_bits == INT_MAX)
                 continue;
               lrl = (lazy == Z - 1) ? litindexes[pos] : lazy;
@@ -1387,7 +1515,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
               if (pos - lrl < chunk_start)
                 break;
               prev_state = Z * (pos - lrl);
-              total_bits = S[prev_state].best_bit_count;
+              total_bits = B[prev_state];
               if (total_bits == INT_MAX)
                 continue;
               total_bits += Krak::BitsForLits(src_ptr, pos - lrl, lrl,
@@ -1410,11 +1538,10 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             recent_best_length = ml;
             max_offset = std::max(max_offset, pos + ml);
             int full_bits = total_bits + Krak::BitsForToken(cost_model, ml, pos - lrl, ridx, length_field);
-            UpdateStatesZ<kRECENT>(pos, full_bits, lrl, ml, ridx, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+            UpdateStatesZ<kRECENT>(pos, full_bits, lrl, ml, ridx, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
             if (ml > 2 && ml < length_long_enough_thres) {
-              for (int tml = 2; tml < ml; tml++)
-                UpdateStatesZ<kRECENT>(pos, total_bits + Krak::BitsForToken(cost_model, tml, pos - lrl, ridx, length_field),
-                                       lrl, tml, ridx, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+              UpdateStatesShorter<kRECENT>(pos, total_bits, 2, ml, ridx, length_field,
+                                           lrl, ridx, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
             }
             // check if we have another recent0 match after 1-2 lits
             if (pos + ml + 4 < src_size - 16) {
@@ -1426,7 +1553,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
                     Krak::BitsForToken(cost_model, tml, pos + ml, 0, num_lazy);
                   max_offset = std::max(max_offset, pos + ml + tml + num_lazy);
                   UpdateState<kRECENT>((pos + ml + tml + num_lazy) * Z,
-                                       cost, lrl, ml, ridx, prev_state, num_lazy | (tml << 8), S);
+                                       cost, lrl, ml, ridx, prev_state, num_lazy | (tml << 8), S, B);
                   break;
                 }
               }
@@ -1453,11 +1580,10 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
               int bits_with_offlen = total_bits + match_found_offset_bits[matchidx];
               int full_bits = bits_with_offlen + Krak::BitsForToken(cost_model, ml, pos - lrl, Krak::kRecentOffsetCount, length_field);
 
-              UpdateStatesZ<kOFFSET>(pos, full_bits, lrl, ml, offs, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+              UpdateStatesZ<kOFFSET>(pos, full_bits, lrl, ml, offs, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
               if (ml > min_match_length && ml < length_long_enough_thres) {
-                for (int tml = min_match_length; tml < ml; tml++)
-                  UpdateStatesZ<kOFFSET>(pos, bits_with_offlen + Krak::BitsForToken(cost_model, tml, pos - lrl, Krak::kRecentOffsetCount, length_field),
-                                         lrl, tml, offs, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+                UpdateStatesShorter<kOFFSET>(pos, bits_with_offlen, min_match_length, ml, Krak::kRecentOffsetCount, length_field,
+                                             lrl, offs, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
               }
               // check if we have another recent0 match after 1-2 lits
               if (after_match + 4 < src_size - 16) {
@@ -1469,7 +1595,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
                       Krak::BitsForToken(cost_model, tml, after_match, 0, num_lazy);
                     max_offset = std::max(max_offset, after_match + tml + num_lazy);
                     UpdateState<kOFFSET>((after_match + tml + num_lazy) * Z,
-                                         cost, lrl, ml, offs, prev_state, num_lazy | (tml << 8), S);
+                                         cost, lrl, ml, offs, prev_state, num_lazy | (tml << 8), S, B);
                     break;
                   }
                 }
@@ -1493,7 +1619,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             int recent_offs = S[current_end * Z].recent_offs[0];
             for (int i = 1; i < Z; i++) {
               S[(current_end + i) * Z + i] = S[(current_end + i - 1) * Z + i - 1];
-              S[(current_end + i) * Z + i].best_bit_count +=
+              B[(current_end + i) * Z + i] = B[(current_end + i - 1) * Z + i - 1] +
                 Krak::BitsForLit(src_ptr, current_end + i - 1, recent_offs, cost_model, i - 1);
             }
             litindexes[current_end + Z - 1] = Z - 1;
@@ -1508,7 +1634,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
         int best_bits = INT_MAX;
         if (Z == 1) {
           for (int final_offs = std::max(chunk_start, prev_offset - 8); final_offs < src_size; final_offs++) {
-            int bits = S[final_offs].best_bit_count;
+            int bits = B[final_offs];
             if (bits != INT_MAX) {
               bits += Krak::BitsForLits(src_ptr, final_offs, src_size - final_offs, S[final_offs].recent_offs[0], cost_model, 0);
               if (bits < best_bits) {
@@ -1521,7 +1647,7 @@ int KrakenOptimal(LzCoder *lzcoder, LzTemp *lztemp,
         } else {
           for (int final_offs = std::max(chunk_start, max_offset - 8); final_offs < src_size; final_offs++) {
             for (int idx = 0; idx < Z; idx++) {
-              int bits = S[Z * final_offs + idx].best_bit_count;
+              int bits = B[Z * final_offs + idx];
               if (bits != INT_MAX) {
                 int litidx = ((idx == Z - 1) ? litindexes[final_offs] : idx);
                 int offs = final_offs - litidx;
@@ -1619,6 +1745,8 @@ int KrakenDoCompress(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls,
     return KrakenCompressVeryfast<-2, FastMatchHasher<uint16>>(coder, lztemp, mls, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
   if (coder->compression_level == -3)
     return KrakenCompressVeryfast<-3, FastMatchHasher<uint16>>(coder, lztemp, mls, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
+  if (coder->compression_level == -4)
+    return KrakenCompressUltrafast<FastMatchHasher<uint32>>(coder, lztemp, mls, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
 
   if (coder->compression_level == 2)
     return KrakenCompressFast<2, false, 0>(coder, lztemp, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
@@ -1642,10 +1770,10 @@ void SetupEncoder_Kraken(LzCoder *coder, int src_len, int level,
   coder->codec_id = kCompressorKraken;
   coder->quantum_blocksize = 0x20000;
   coder->check_plain_huffman = (level >= 3);
-  coder->platforms = 0;
+  coder->platforms = GetEncoderPlatforms();
   coder->compression_level = level;
   coder->opts = copts;
-  coder->speed_tradeoff = (copts->spaceSpeedTradeoffBytes * 0.00390625f) * 0.0099999998f;
+  coder->speed_tradeoff = GetSpeedTradeoff(kCompressorKraken, copts);
   coder->max_matches_to_consider = 4;
   coder->limit_local_dictsize = (level >= 6);
   coder->compressor_file_id = 6;
@@ -1681,6 +1809,12 @@ void SetupEncoder_Kraken(LzCoder *coder, int src_len, int level,
       hash_bits = std::min(hash_bits, 12);
     CreateLzHasher<FastMatchHasher<uint16>, 0x1000000>(coder, src_base, src_start, hash_bits, min_match_len);
     coder->entropy_opts &= ~(kEntropyOpt_tANS | kEntropyOpt_MultiArray | kEntropyOpt_RLE);
+  } else if (level == -4) {
+    // Hash all 8 bytes since that's the shortest match this level takes.
+    if (copts->hashBits <= 0)
+      hash_bits = std::min(hash_bits, 16);
+    CreateLzHasher<FastMatchHasher<uint32>, 0x1000000>(coder, src_base, src_start, hash_bits, 8);
+    coder->entropy_opts &= ~(kEntropyOpt_tANS | kEntropyOpt_MultiArray | kEntropyOpt_RLE);
   } else if (level == 2) {
     CreateLzHasher< MatchHasher<2, false> >(coder, src_base, src_start, hash_bits, min_match_len);
     coder->entropy_opts &= ~(kEntropyOpt_tANS | kEntropyOpt_MultiArray);
@@ -8,6 +8,8 @@ void SetupEncoder_Kraken(LzCoder *coder, int src_len, int level,
                          const CompressOptions *copts,
                          const uint8 *src_base, const uint8 *src_start);
 
+float GetTime_KrakenWriteBits(int platforms, int src_len, int tokens, int len8);
+
 int KrakenDoCompress(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls_unused,
                      const uint8 *src, int src_size,
                      uint8 *dst, uint8 *dst_end,
@@ -4,6 +4,7 @@
 #include "compress.h"
 #include "compr_util.h"
 #include "compr_entropy.h"
+#include "compr_calibrate.h"
 #include "compr_match_finder.h"
 #include "match_hasher.h"
 #include <algorithm>
@@ -35,8 +36,10 @@ struct Levi {
     int size, capacity;
   };
 
+  // The cost of the best path to each state lives in a separate array next
+  // to the State array: it's compared for every candidate, while the rest is
+  // only read or written when a candidate wins.
   struct State {
-    int best_bit_count;
     int recent_offs[7];
     int matchlen;
     int litlen;
@@ -44,7 +47,6 @@ struct Levi {
     int prev_state;
 
     void Initialize() {
-      best_bit_count = 0;
       recent_offs[0] = 8;
       recent_offs[1] = 8;
       recent_offs[2] = 8;
@@ -467,7 +469,7 @@ static __forceinline bool IsMatchLongEnough(uint ml, uint offs) {
   }
 }
 
-static float GetTime_Leviathan(int platforms, int packed_size, int num_tokens, int u8_len) {
+float GetTime_Leviathan(int platforms, int packed_size, int num_tokens, int u8_len) {
   return CombineCostComponents(platforms,
                                200.0f + packed_size * 0.407f + num_tokens * 18.920f + u8_len * 3.716f,
                                200.0f + packed_size * 0.445f + num_tokens * 19.738f + u8_len * 7.407f,
@@ -848,6 +850,7 @@ static int Leviathan_EncodeLzArrays(LzTemp *lz_temp, float *cost_ptr, Levi::LitS
                                     const uint8 *src, int src_len, uint8 *dst, uint8 *dst_end,
                              int unused_start_pos, LzCoder *lzcoder, int recent_offs0, Levi::TokenArray *tokens,
                              int initial_bytes, Levi::Stats *arrhisto, int min_offset) {
+  ProfileScope profile(kProfilePhase_TokenEncoding, src_len, src);
   uint8 *dst_org = dst;
   int litlen_total = litstats->total_lits;
   int num_tokens = tokens->size;
@@ -1303,10 +1306,10 @@ static int RunLeviMatcherToGetStats(float *cost_ptr, int *chunk_type_ptr, Levi::
 
 
 template<int IsRecent>
-static __forceinline bool UpdateState(int state_entry, int bits, int lrl, int ml, int recent, int prev_state, int qrm, Levi::State *state) {
-  Levi::State *st = &state[state_entry];
-  if (bits < st->best_bit_count) {
-    st->best_bit_count = bits;
+static __forceinline bool UpdateState(int state_entry, int bits, int lrl, int ml, int recent, int prev_state, int qrm, Levi::State *state, int *B) {
+  if (bits < B[state_entry]) {
+    Levi::State *st = &state[state_entry];
+    B[state_entry] = bits;
     st->litlen = lrl;
     st->matchlen = ml;
     int *recent_offs_ptr = state[prev_state].recent_offs;
@@ -1347,16 +1350,71 @@ static __forceinline bool UpdateState(int state_entry, int bits, int lrl, int ml
 }
 
 template<int IsRecent>
-static __forceinline void UpdateStatesZ(int pos, int bits, int lrl, int ml, int recent, int prev_state, Levi::State *S, const uint8 *src_ptr, int offs, int Z, Levi::CostModel &cm, int *litindexes) {
+static __forceinline void UpdateStatesZ(int pos, int bits, int lrl, int ml, int recent, int prev_state, Levi::State *S, int *B, const uint8 *src_ptr, int offs, int Z, Levi::CostModel &cm, int *litindexes) {
   int after_match = pos + ml;
-  UpdateState<IsRecent>(after_match * Z, bits, lrl, ml, recent, prev_state, 0, S);
+  UpdateState<IsRecent>(after_match * Z, bits, lrl, ml, recent, prev_state, 0, S, B);
   for (int jj = 1; jj < Z; jj++) {
     bits += Levi::BitsForLit(src_ptr, after_match + jj - 1, offs, cm, jj - 1);
-    if (UpdateState<IsRecent>((after_match + jj) * Z + jj, bits, lrl, ml, recent, prev_state, 0, S) && jj == Z - 1)
+    if (UpdateState<IsRecent>((after_match + jj) * Z + jj, bits, lrl, ml, recent, prev_state, 0, S, B) && jj == Z - 1)
       litindexes[after_match + jj] = jj;
   }
 }
 
+// Same as calling UpdateStatesZ for every shorter length tml in [tml_from, tml_to).
+// From length 9 on the token price is one token_cost entry plus a contiguous
+// run of matchlen_cost, so four lengths are priced and compared against B at once
+// and only the winners go through UpdateState, in the same order as before.
+template<int IsRecent>
+static __forceinline void UpdateStatesShorter(int pos, int bits, int tml_from, int tml_to, int recent_field, int length_field,
+                                              int lrl, int recent, int prev_state, Levi::State *S, int *B,
+                                              const uint8 *src_ptr, int offs, int Z, Levi::CostModel &cm, int *litindexes) {
+  int tml = tml_from;
+  for (; tml < tml_to && tml < 9; tml++)
+    UpdateStatesZ<IsRecent>(pos, bits + Levi::BitsForToken(cm, tml, pos - lrl, recent_field, length_field),
+                            lrl, tml, recent, prev_state, S, B, src_ptr, offs, Z, cm, litindexes);
+  if (Z <= 2) {
+    simde__m128i token_bits = simde_mm_set1_epi32(bits +
+      cm.token_cost[cm.token_cost_mask & (pos - lrl)][7 + (recent_field << 5) + (length_field << 3)]);
+    for (; tml + 4 <= tml_to; tml += 4) {
+      int after_match = pos + tml;
+      simde__m128i cost = simde_mm_add_epi32(token_bits, simde_mm_loadu_si128((const simde__m128i *)&cm.matchlen_cost[tml - 9]));
+      int costs[4], costs_lit[4], better, better_lit = 0;
+      simde_mm_storeu_si128((simde__m128i *)costs, cost);
+      if (Z == 1) {
+        better = simde_mm_movemask_ps(simde_mm_castsi128_ps(
+          simde_mm_cmpgt_epi32(simde_mm_loadu_si128((const simde__m128i *)&B[after_match]), cost)));
+      } else {
+        // B is interleaved by lit count, so the no-lit states are the even
+        // slots at after_match and the one-lit states the odd slots one past it.
+        const simde__m128i *b = (const simde__m128i *)&B[after_match * 2];
+        simde__m128i b0 = simde_mm_castps_si128(simde_mm_shuffle_ps(
+          simde_mm_castsi128_ps(simde_mm_loadu_si128(b)), simde_mm_castsi128_ps(simde_mm_loadu_si128(b + 1)), SIMDE_MM_SHUFFLE(2, 0, 2, 0)));
+        simde__m128i b1 = simde_mm_castps_si128(simde_mm_shuffle_ps(
+          simde_mm_castsi128_ps(simde_mm_loadu_si128((const simde__m128i *)&B[after_match * 2 + 2])),
+          simde_mm_castsi128_ps(simde_mm_loadu_si128((const simde__m128i *)&B[after_match * 2 + 6])), SIMDE_MM_SHUFFLE(3, 1, 3, 1)));
+        simde__m128i cost_lit = simde_mm_add_epi32(cost, simde_mm_setr_epi32(
+          Levi::BitsForLit(src_ptr, after_match + 0, offs, cm, 0), Levi::BitsForLit(src_ptr, after_match + 1, offs, cm, 0),
+          Levi::BitsForLit(src_ptr, after_match + 2, offs, cm, 0), Levi::BitsForLit(src_ptr, after_match + 3, offs, cm, 0)));
+        simde_mm_storeu_si128((simde__m128i *)costs_lit, cost_lit);
+        better = simde_mm_movemask_ps(simde_mm_castsi128_ps(simde_mm_cmpgt_epi32(b0, cost)));
+        better_lit = simde_mm_movemask_ps(simde_mm_castsi128_ps(simde_mm_cmpgt_epi32(b1, cost_lit)));
+      }
+      // Each lane targets its own states, so the masks stay valid while
+      // earlier lanes are written.
+      for (int i = 0; i < 4; i++) {
+        if (better >> i & 1)
+          UpdateState<IsRecent>((after_match + i) * Z, costs[i], lrl, tml + i, recent, prev_state, 0, S, B);
+        if ((better_lit >> i & 1) &&
+            UpdateState<IsRecent>((after_match + i + 1) * 2 + 1, costs_lit[i], lrl, tml + i, recent, prev_state, 0, S, B))
+          litindexes[after_match + i + 1] = 1;
+      }
+    }
+  }
+  for (; tml < tml_to; tml++)
+    UpdateStatesZ<IsRecent>(pos, bits + Levi::BitsForToken(cm, tml, pos - lrl, recent_field, length_field),
+                            lrl, tml, recent, prev_state, S, B, src_ptr, offs, Z, cm, litindexes);
+}
+
 int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
                      const MatchLenStorage *mls,
                      const uint8 *src_ptr, int src_size,
@@ -1391,7 +1449,9 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
   int tokens_capacity = 4096 + 8;
   Levi::Token *tokens_begin = (Levi::Token*)lztemp->lztoken_scratch.Allocate(sizeof(Levi::Token) * tokens_capacity);
 
-  Levi::State *S = (Levi::State*)lztemp->states.Allocate(sizeof(Levi::State) * Z * (src_size + 1));
+  int num_states = Z * (src_size + 1);
+  Levi::State *S = (Levi::State*)lztemp->states.Allocate((sizeof(Levi::State) + sizeof(int)) * num_states);
+  int *B = (int*)(S + num_states);
   uint8 *tmp_dst = (uint8*)S, *tmp_dst_end = tmp_dst + lztemp->states.size;
 
   int chunk_type = 0, tmp_chunk_type;
@@ -1475,7 +1535,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
     Levi::MakeCostModel(&stats, &cost_model);
 
     for (int i = 0; i <= Z * src_size; i++)
-      S[i].best_bit_count = INT_MAX;
+      B[i] = INT_MAX;
 
     int final_lz_offset = -1;
     int last_recent0 = 0;
@@ -1484,6 +1544,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
 
     // Initial state
     S[Z * chunk_start].Initialize();
+    B[Z * chunk_start] = 0;
 
     while (chunk_start < src_size - 16) {
       int lit_bits_since_prev = 0;
@@ -1502,15 +1563,15 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
       if (Z > 1) {
         for (int i = 1; i < Z; i++)
           for (int j = 0; j < Z; j++)
-            S[Z * (chunk_start + i) + j].best_bit_count = INT_MAX;
+            B[Z * (chunk_start + i) + j] = INT_MAX;
 
         for (int j = 1; j < Z; j++)
-          S[Z * chunk_start + j].best_bit_count = INT_MAX;
+          B[Z * chunk_start + j] = INT_MAX;
 
         if (max_offset - chunk_start > Z) {
           for (int i = 1; i < Z; i++) {
             S[(chunk_start + i) * Z + i] = S[(chunk_start + i - 1) * Z + i - 1];
-            S[(chunk_start + i) * Z + i].best_bit_count +=
+            B[(chunk_start + i) * Z + i] = B[(chunk_start + i - 1) * Z + i - 1] +
               Levi::BitsForLit(src_ptr, chunk_start + i - 1, S[chunk_start * Z].recent_offs[0], cost_model, i - 1);
           }
           litindexes[chunk_start + Z - 1] = Z - 1;
@@ -1533,9 +1594,9 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
           // path to the state, reset the accumulation.
           if (pos != prev_offset) {
             lit_bits_since_prev += Levi::BitsForLit(src_ptr, pos - 1, S[prev_offset].recent_offs[0], cost_model, pos - prev_offset - 1);
-            int curbits = S[pos].best_bit_count;
+            int curbits = B[pos];
             if (curbits != INT_MAX) {
-              int prevbits = S[prev_offset].best_bit_count + lit_bits_since_prev;
+              int prevbits = B[prev_offset] + lit_bits_since_prev;
               if (curbits < prevbits + Levi::BitsForLitlen(cost_model, pos - prev_offset)) {
                 prev_offset = pos;
                 lit_bits_since_prev = 0;
@@ -1550,8 +1611,8 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
           if (pos >= max_offset) {
             int tmp_cur_offset = 0, best_bits = 0x7FFFFFFF;
             for (int i = 0; i < Z; i++) {
-              if (S[Z * pos + i].best_bit_count < best_bits) {
-                best_bits = S[Z * pos + i].best_bit_count;
+              if (B[Z * pos + i] < best_bits) {
+                best_bits = B[Z * pos + i];
                 tmp_cur_offset = pos - ((i != Z - 1) ? i : litindexes[pos]);
               }
             }
@@ -1561,12 +1622,13 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             }
           }
           // Update the alternate state with the lit cost.
-          Levi::State *cur = &S[Z * pos + Z - 1];
-          if (cur->best_bit_count != 0x7FFFFFFF) {
-            int bits = cur->best_bit_count + Levi::BitsForLit(src_ptr, pos, cur->recent_offs[0], cost_model, litindexes[pos]);
-            if (bits < cur[Z].best_bit_count) {
+          int cur_idx = Z * pos + Z - 1;
+          Levi::State *cur = &S[cur_idx];
+          if (B[cur_idx] != 0x7FFFFFFF) {
+            int bits = B[cur_idx] + Levi::BitsForLit(src_ptr, pos, cur->recent_offs[0], cost_model, litindexes[pos]);
+            if (bits < B[cur_idx + Z]) {
               cur[Z] = *cur;
-              cur[Z].best_bit_count = bits;
+              B[cur_idx + Z] = bits;
               litindexes[pos + 1] = litindexes[pos] + 1;
             }
           }
@@ -1636,7 +1698,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             if (pos - lrl < chunk_start)
               break;
             prev_state = pos - lrl;
-            total_bits = S[prev_state].best_bit_count;
+            total_bits = B[prev_state];
             if (total_bits == INT_MAX)
               continue;
             total_bits += (lrl == lits_since_prev) ? lit_bits_since_prev :
@@ -1645,7 +1707,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
           } else {
             if (lazy < Z) {
               prev_state = Z * pos + lazy;
-              total_bits = S[prev_state].best_bit_count;
+              total_bits = B[prev_state];
               if (total_bits == INT_MAX)
                 continue;
               lrl = (lazy == Z - 1) ? litindexes[pos] : lazy;
@@ -1654,7 +1716,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
               if (pos - lrl < chunk_start)
                 break;
               prev_state = Z * (pos - lrl);
-              total_bits = S[prev_state].best_bit_count;
+              total_bits = B[prev_state];
               if (total_bits == INT_MAX)
                 continue;
               total_bits += Levi::BitsForLits(src_ptr, pos - lrl, lrl,
@@ -1677,11 +1739,10 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             recent_best_length = ml;
             max_offset = std::max(max_offset, pos + ml);
             int full_bits = total_bits + Levi::BitsForToken(cost_model, ml, pos - lrl, ridx, length_field);
-            UpdateStatesZ<kRECENT>(pos, full_bits, lrl, ml, ridx, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+            UpdateStatesZ<kRECENT>(pos, full_bits, lrl, ml, ridx, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
             if (ml > 2 && ml < length_long_enough_thres) {
-              for (int tml = 2; tml < ml; tml++)
-                UpdateStatesZ<kRECENT>(pos, total_bits + Levi::BitsForToken(cost_model, tml, pos - lrl, ridx, length_field),
-                                           lrl, tml, ridx, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+              UpdateStatesShorter<kRECENT>(pos, total_bits, 2, ml, ridx, length_field,
+                                           lrl, ridx, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
             }
             // check if we have another recent0 match after 1-2 lits
             if (pos + ml + 4 < src_size - 16) {
@@ -1693,7 +1754,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
                     Levi::BitsForToken(cost_model, tml, pos + ml, 0, num_lits_x);
                   max_offset = std::max(max_offset, pos + ml + tml + num_lits_x);
                   UpdateState<kRECENT>((pos + ml + tml + num_lits_x) * Z,
-                                       cost, lrl, ml, ridx, prev_state, num_lits_x | (tml << 8), S);
+                                       cost, lrl, ml, ridx, prev_state, num_lits_x | (tml << 8), S, B);
                   break;
                 }
               }
@@ -1719,11 +1780,10 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
               int bits_with_offs = total_bits + match_found_offset_bits[matchidx];
 
               int full_bits = bits_with_offs + Levi::BitsForToken(cost_model, ml, pos - lrl, Levi::kRecentOffsetCount, length_field);
-              UpdateStatesZ<kOFFSET>(pos, full_bits, lrl, ml, offs, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+              UpdateStatesZ<kOFFSET>(pos, full_bits, lrl, ml, offs, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
               if (ml > min_match_length && ml < length_long_enough_thres) {
-                for (int tml = min_match_length; tml < ml; tml++)
-                  UpdateStatesZ<kOFFSET>(pos, bits_with_offs + Levi::BitsForToken(cost_model, tml, pos - lrl, Levi::kRecentOffsetCount, length_field),
-                                         lrl, tml, offs, prev_state, S, src_ptr, offs, Z, cost_model, litindexes);
+                UpdateStatesShorter<kOFFSET>(pos, bits_with_offs, min_match_length, ml, Levi::kRecentOffsetCount, length_field,
+                                             lrl, offs, prev_state, S, B, src_ptr, offs, Z, cost_model, litindexes);
               }
               // check if we have another recent0 match after 1-2 lits
               if (pos + ml + 4 < src_size - 16) {
@@ -1735,7 +1795,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
                         Levi::BitsForToken(cost_model, tml, pos + ml, 0, num_lits_x);
                     max_offset = std::max(max_offset, pos + ml + tml + num_lits_x);
                     UpdateState<kOFFSET>((pos + ml + tml + num_lits_x) * Z,
-                                         cost, lrl, ml, offs, prev_state, num_lits_x | (tml << 8), S);
+                                         cost, lrl, ml, offs, prev_state, num_lits_x | (tml << 8), S, B);
                     break;
                   }
                 }
@@ -1759,7 +1819,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
             int recent_offs = S[current_end * Z].recent_offs[0];
             for (int i = 1; i < Z; i++) {
               S[(current_end + i) * Z + i] = S[(current_end + i - 1) * Z + i - 1];
-              S[(current_end + i) * Z + i].best_bit_count +=
+              B[(current_end + i) * Z + i] = B[(current_end + i - 1) * Z + i - 1] +
                 Levi::BitsForLit(src_ptr, current_end + i - 1, recent_offs, cost_model, i - 1);
             }
             litindexes[current_end + Z - 1] = Z - 1;
@@ -1774,7 +1834,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
         int best_bits = INT_MAX;
         if (Z == 1) {
           for (int final_offs = std::max(chunk_start, prev_offset - 8); final_offs < src_size; final_offs++) {
-            int bits = S[final_offs].best_bit_count;
+            int bits = B[final_offs];
             if (bits != INT_MAX) {
               bits += Levi::BitsForLits(src_ptr, final_offs, src_size - final_offs, S[final_offs].recent_offs[0], cost_model, 0);
               if (bits < best_bits) {
@@ -1787,7 +1847,7 @@ int LeviathanOptimal(LzCoder *lzcoder, LzTemp *lztemp,
         } else {
           for (int final_offs = std::max(chunk_start, max_offset - 8); final_offs < src_size; final_offs++) {
             for (int idx = 0; idx < Z; idx++) {
-              int bits = S[Z * final_offs + idx].best_bit_count;
+              int bits = B[Z * final_offs + idx];
               if (bits != INT_MAX) {
                 int litidx = ((idx == Z - 1) ? litindexes[final_offs] : idx);
                 int offs = final_offs - litidx;
@@ -2063,10 +2123,10 @@ void SetupEncoder_Leviathan(LzCoder *coder, int src_len, int level,
   coder->codec_id = kCompressorLeviathan;
   coder->quantum_blocksize = 0x20000;
   coder->check_plain_huffman = true;
-  coder->platforms = 0;
+  coder->platforms = GetEncoderPlatforms();
   coder->compression_level = level;
   coder->opts = copts;
-  coder->speed_tradeoff = (copts->spaceSpeedTradeoffBytes * 0.00390625f) * 0.0024999999f;
+  coder->speed_tradeoff = GetSpeedTradeoff(kCompressorLeviathan, copts);
   coder->entropy_opts = 0xff;
   coder->max_matches_to_consider = 4;
   coder->limit_local_dictsize = (level >= 6);
@@ -2075,7 +2135,7 @@ void SetupEncoder_Leviathan(LzCoder *coder, int src_len, int level,
     coder->entropy_opts &= ~kEntropyOpt_MultiArrayAdvanced;
   if (level <= 2)
     coder->entropy_opts &= ~kEntropyOpt_MultiArray;
-  coder->platforms = 0;
+  coder->platforms = GetEncoderPlatforms();
 
   if (level <= 1) {
     coder->entropy_opts &= ~kEntropyOpt_tANS;
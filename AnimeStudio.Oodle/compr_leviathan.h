@@ -8,6 +8,8 @@ void SetupEncoder_Leviathan(LzCoder *coder, int src_len, int level,
                             const CompressOptions *copts,
                             const uint8 *src_base, const uint8 *src_start);
 
+float GetTime_Leviathan(int platforms, int packed_size, int num_tokens, int u8_len);
+
 int LeviathanDoCompress(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls_unused,
                       const uint8 *src, int src_size,
                       uint8 *dst, uint8 *dst_end,
@@ -2,6 +2,8 @@
 #include "stdafx.h"
 #include "compr_match_finder.h"
 #include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include "compress.h"
 #include "compr_util.h"
@@ -90,16 +92,22 @@ static uint8 *VarLenWriteLength(uint8 *dst, unsigned int value, int A, int B) {
   }
 }
 
+static int64 GetMemoryUsage(const MatchLenStorage *mls) {
+  return mls->byte_buffer.capacity() + mls->offset2pos.capacity() * sizeof(int);
+}
+
 MatchLenStorage *MatchLenStorage::Create(int entries, float avg_bytes) {
   MatchLenStorage *mls = new MatchLenStorage;
   mls->byte_buffer.resize((int)(entries * avg_bytes));
   mls->offset2pos.resize(entries);
   mls->byte_buffer_use = 1;
   mls->window_base = NULL;
+  Profile_AddMemory(GetMemoryUsage(mls));
   return mls;
 }
 
 void MatchLenStorage::Destroy(MatchLenStorage *mls) {
+  Profile_AddMemory(-GetMemoryUsage(mls));
   delete mls;
 }
 
@@ -109,8 +117,11 @@ void MatchLenStorage_InsertMatches(MatchLenStorage *mls, int at_offset, LengthAn
   mls->offset2pos[at_offset] = mls->byte_buffer_use;
 
   int needed_bytes = mls->byte_buffer_use + 16 * num_lao + 2;
-  if (needed_bytes >= mls->byte_buffer.size())
+  if (needed_bytes >= mls->byte_buffer.size()) {
+    size_t old_capacity = mls->byte_buffer.capacity();
     mls->byte_buffer.resize(needed_bytes);
+    Profile_AddMemory(mls->byte_buffer.capacity() - old_capacity);
+  }
 
   uint8 *cur_ptr = mls->byte_buffer.data() + mls->byte_buffer_use;
 
@@ -632,6 +643,8 @@ void LRM_CreateHashIndex(LRMEnt *lrm, int hash_lookup_bits) {
     hash_begin_scan_pos[i] = current_pos;
   }
   hash_begin_scan_pos[entries] = arrhashpos_minus1;
+  lrm->hashpos_data = arrhashpos;
+  lrm->hash_begin_scan_pos_data = hash_begin_scan_pos;
 }
 
 uint32 LRMScanner_HashIt(const uint8 *src, int src_size) {
@@ -649,6 +662,7 @@ void LRM_FillMerge(LRMEnt *dst, LRMEnt *src_a, LRMEnt *src_b, int lrm_hash_looku
   dst->cur_hashmult = src_a->cur_hashmult;
   dst->lrm_base_ptr = dst->buf = src_a->buf;
   dst->buf_size = src_b->buf - src_a->buf + src_b->buf_size;
+  dst->buf_pos = src_a->buf_pos;
 
   int position_increment = src_b->buf - src_a->buf;
 
@@ -689,7 +703,86 @@ void LRM_FillMerge(LRMEnt *dst, LRMEnt *src_a, LRMEnt *src_b, int lrm_hash_looku
   LRM_CreateHashIndex(dst, lrm_hash_lookup_bits);
 }
 
-void LRM_Fill(LRMEnt *lrm, uint8 *buf, int buf_size, int step_size, int hash_lookup_bits, int hash_length) {
+static int lrm_thread_count;
+
+void LRM_SetThreadCount(int threads) {
+  lrm_thread_count = std::max(threads, 0);
+}
+
+static int LRM_GetThreadCount() {
+  if (lrm_thread_count)
+    return lrm_thread_count;
+  return clamp((int)std::thread::hardware_concurrency(), 1, 64);
+}
+
+// Runs fn(0) .. fn(count - 1) on up to |threads| threads, the calling
+// thread included.
+template<typename Fn>
+static void ParallelFor(int count, int threads, const Fn &fn) {
+  threads = std::min(threads, count);
+  if (threads <= 1) {
+    for (int i = 0; i < count; i++)
+      fn(i);
+    return;
+  }
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for (int i; (i = next++) < count; )
+      fn(i);
+  };
+  std::vector<std::thread> pool;
+  for (int i = 1; i < threads; i++)
+    pool.emplace_back(worker);
+  worker();
+  for (std::thread &t : pool)
+    t.join();
+}
+
+// Stable LSD radix sort on the hash, 8 bits per pass. Each thread counts and
+// scatters one slice of the array, and the slices' buckets are laid out in
+// slice order, so entries with equal hashes keep their order. Passes where
+// all entries have the same digit are skipped.
+static void LRM_RadixSort(HashPos *arr, size_t count, int threads) {
+  if (count < 2)
+    return;
+  threads = (int)std::max<size_t>(1, std::min<size_t>(threads, count >> 16));
+  size_t slice = (count + threads - 1) / threads;
+  std::vector<HashPos> tmp(count);
+  std::vector<size_t> histo(threads * 256);
+  HashPos *src = arr, *dst = tmp.data();
+
+  for (int shift = 0; shift < 32; shift += 8) {
+    ParallelFor(threads, threads, [&](int t) {
+      size_t *h = &histo[t * 256];
+      memset(h, 0, sizeof(size_t) * 256);
+      for (size_t i = t * slice, end = std::min(count, i + slice); i < end; i++)
+        h[(src[i].hash >> shift) & 0xff]++;
+    });
+    size_t sum = 0;
+    bool single_digit = false;
+    for (int d = 0; d < 256; d++) {
+      size_t start = sum;
+      for (int t = 0; t < threads; t++) {
+        size_t n = histo[t * 256 + d];
+        histo[t * 256 + d] = sum;
+        sum += n;
+      }
+      single_digit |= (sum - start == count);
+    }
+    if (single_digit)
+      continue;
+    ParallelFor(threads, threads, [&](int t) {
+      size_t *h = &histo[t * 256];
+      for (size_t i = t * slice, end = std::min(count, i + slice); i < end; i++)
+        dst[h[(src[i].hash >> shift) & 0xff]++] = src[i];
+    });
+    std::swap(src, dst);
+  }
+  if (src != arr)
+    memcpy(arr, src, sizeof(HashPos) * count);
+}
+
+static void LRM_Fill(LRMEnt *lrm, uint8 *buf, int buf_size, int step_size, int hash_lookup_bits, int hash_length, int threads) {
   assert(buf_size >= hash_length);
   assert(hash_length >= 8);
   assert(buf_size <= (1 << 30));
@@ -719,14 +812,8 @@ void LRM_Fill(LRMEnt *lrm, uint8 *buf, int buf_size, int step_size, int hash_loo
     }
   }
 
-  struct sorter {
-    bool operator()(const HashPos &a, const HashPos &b) {
-      return a.hash < b.hash;
-    }
-  };
-
   lrm->arrhashpos.resize(num_hashpos + 1);
-  MySort(lrm->arrhashpos.data(), lrm->arrhashpos.data() + num_hashpos);
+  LRM_RadixSort(lrm->arrhashpos.data(), num_hashpos, threads);
 
   HashPos hp = { 0xffffffff, lrm->arrhashpos.back().position };
   lrm->arrhashpos.push_back(hp);
@@ -739,7 +826,10 @@ void LRM_FillCascade(LRMCascade *lrm, uint8 *src_ptr, int src_size, int lrm_step
   lrm->src_ptr = src_ptr;
   lrm->src_size = src_size;
   lrm->base_bufsize = base_bufsize;
+  int threads = LRM_GetThreadCount();
 
+  // The entries of a level are independent, so each level is built in
+  // parallel. Levels above the first merge pairs from the level below.
   for (int arridx = 0; arridx < 8; arridx++) {
     int lrm_bufsize = base_bufsize << arridx;
     if (src_size < lrm_bufsize)
@@ -755,7 +845,7 @@ void LRM_FillCascade(LRMCascade *lrm, uint8 *src_ptr, int src_size, int lrm_step
     if (arridx != 0) {
       LRMEnt **lrments_prev = vec[-1].data();
 
-      for (int inneridx = 0; inneridx < lrm_array_cur_count; inneridx++) {
+      ParallelFor(lrm_array_cur_count, threads, [&](int inneridx) {
         LRMEnt *ent = new LRMEnt;
         lrments[inneridx] = ent;
 
@@ -763,13 +853,18 @@ void LRM_FillCascade(LRMCascade *lrm, uint8 *src_ptr, int src_size, int lrm_step
 
         delete lrments_prev[inneridx * 2 + 1];
         lrments_prev[inneridx * 2 + 1] = NULL;
-      }
+      });
     } else {
-      for (int inneridx = 0, pos = 0; inneridx < lrm_array_cur_count; inneridx++, pos += lrm_bufsize) {
+      // Threads left over when there are fewer entries than threads go to
+      // the sorts.
+      int sort_threads = std::max(1, threads / lrm_array_cur_count);
+      ParallelFor(lrm_array_cur_count, threads, [&](int inneridx) {
+        int pos = inneridx * lrm_bufsize;
         LRMEnt *ent = new LRMEnt;
         lrments[inneridx] = ent;
-        LRM_Fill(ent, src_ptr + pos, std::min(src_size - pos, lrm_bufsize), lrm_step_size, lrm_hash_lookup_bits, hash_length);
-      }
+        LRM_Fill(ent, src_ptr + pos, std::min(src_size - pos, lrm_bufsize), lrm_step_size, lrm_hash_lookup_bits, hash_length, sort_threads);
+        ent->buf_pos = pos;
+      });
     }
   }
 }
@@ -788,6 +883,206 @@ void LRM_FreeCascade(LRMCascade *lrm) {
   delete lrm;
 }
 
+LRMCascade *LRM_AllocateReferenceCascade(uint8 *ref, int ref_size, int lrm_step_size, int hash_lookup_bits, int max_bufsize, int hash_length) {
+  if (ref_size < hash_length)
+    return NULL;
+  // The cascade only indexes whole blocks, so split the reference into
+  // equal blocks instead of leaving a partial one unindexed.
+  int nblocks = (ref_size + max_bufsize - 1) / max_bufsize;
+  int base_bufsize = ref_size / nblocks;
+  return LRM_AllocateCascade(ref, ref_size, lrm_step_size, hash_lookup_bits, 0, base_bufsize, hash_length);
+}
+
+void LRM_BindCascade(LRMCascade *lrm, uint8 *src_ptr) {
+  lrm->src_ptr = src_ptr;
+  for (size_t i = 0; i < 8; i++) {
+    for (LRMEnt *ent : lrm->lrms[i]) {
+      if (ent)
+        ent->buf = ent->lrm_base_ptr = src_ptr ? src_ptr + ent->buf_pos : NULL;
+    }
+  }
+}
+
+// Serialized layout, in host byte order: LRMFileHeader, then for each slot of
+// each level an LRMFileEnt followed by its HashPos array and scan index, each
+// padded to 8 bytes. Holes left by LRM_FillCascade are kept as absent slots.
+static const uint32 kLrmFileMagic = 0x314d524c; // 'LRM1'
+
+struct LRMFileHeader {
+  uint32 magic;
+  int src_size;
+  int base_bufsize;
+  int hash_length;
+  uint32 cur_hashmult;
+  int num_ents[8];
+  int reserved;
+};
+
+struct LRMFileEnt {
+  int present;
+  int buf_pos;
+  int buf_size;
+  int hashpos_count;
+  int hash_begin_scan_pos_shift;
+  int reserved;
+};
+
+static size_t LRM_AlignSize(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+// Both arrays end with a sentinel, so their sizes follow from the scan index.
+static int LRM_GetHashPosCount(const LRMEnt *ent) {
+  return ent->hash_begin_scan_pos_data[1 << (32 - ent->hash_begin_scan_pos_shift)] + 1;
+}
+
+static size_t LRM_WriteCascade(const LRMCascade *lrm, uint8 *dst) {
+  size_t pos = sizeof(LRMFileHeader);
+  LRMFileHeader hdr = {};
+  hdr.magic = kLrmFileMagic;
+  hdr.src_size = lrm->src_size;
+  hdr.base_bufsize = lrm->base_bufsize;
+  for (size_t i = 0; i < 8; i++) {
+    hdr.num_ents[i] = lrm->lrms[i].size();
+    for (const LRMEnt *ent : lrm->lrms[i]) {
+      LRMFileEnt fe = {};
+      size_t hashpos_bytes = 0, scan_pos_bytes = 0;
+      if (ent) {
+        hdr.hash_length = ent->hash_length;
+        hdr.cur_hashmult = ent->cur_hashmult;
+        fe.present = 1;
+        fe.buf_pos = ent->buf_pos;
+        fe.buf_size = ent->buf_size;
+        fe.hashpos_count = LRM_GetHashPosCount(ent);
+        fe.hash_begin_scan_pos_shift = ent->hash_begin_scan_pos_shift;
+        hashpos_bytes = sizeof(HashPos) * fe.hashpos_count;
+        scan_pos_bytes = sizeof(int) * ((1 << (32 - fe.hash_begin_scan_pos_shift)) + 1);
+      }
+      if (dst) {
+        memcpy(dst + pos, &fe, sizeof(fe));
+        if (ent) {
+          memcpy(dst + pos + sizeof(fe), ent->hashpos_data, hashpos_bytes);
+          memcpy(dst + pos + sizeof(fe) + LRM_AlignSize(hashpos_bytes), ent->hash_begin_scan_pos_data, scan_pos_bytes);
+        }
+      }
+      pos += sizeof(fe) + LRM_AlignSize(hashpos_bytes) + LRM_AlignSize(scan_pos_bytes);
+    }
+  }
+  if (dst)
+    memcpy(dst, &hdr, sizeof(hdr));
+  return pos;
+}
+
+size_t LRM_GetSerializedSize(const LRMCascade *lrm) {
+  return LRM_WriteCascade(lrm, NULL);
+}
+
+size_t LRM_SerializeCascade(const LRMCascade *lrm, uint8 *dst, size_t dst_size) {
+  size_t n = LRM_WriteCascade(lrm, NULL);
+  if (n > dst_size)
+    return 0;
+  return LRM_WriteCascade(lrm, dst);
+}
+
+bool LRM_SaveCascade(const char *filename, const LRMCascade *lrm) {
+  std::vector<uint8> data(LRM_GetSerializedSize(lrm));
+  LRM_WriteCascade(lrm, data.data());
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  return (fclose(f) == 0) && ok;
+}
+
+// |data| must be 8-byte aligned and stay valid and unchanged for the lifetime
+// of the returned cascade, which points into it instead of copying. The
+// reference data itself is not checksummed: a cascade bound to other bytes
+// than it was built from just finds fewer matches, as every candidate is
+// compared against the actual bytes.
+LRMCascade *LRM_AttachCascade(const uint8 *data, size_t data_size) {
+  LRMFileHeader hdr;
+  if (((uintptr_t)data & 7) || data_size < sizeof(hdr))
+    return NULL;
+  memcpy(&hdr, data, sizeof(hdr));
+  if (hdr.magic != kLrmFileMagic || hdr.hash_length < 8 || hdr.base_bufsize <= 0 || hdr.src_size < 0)
+    return NULL;
+
+  LRMCascade *lrm = new LRMCascade;
+  lrm->src_ptr = NULL;
+  lrm->src_size = hdr.src_size;
+  lrm->base_bufsize = hdr.base_bufsize;
+
+  size_t pos = sizeof(hdr);
+  for (size_t i = 0; i < 8; i++) {
+    if (hdr.num_ents[i] < 0 || hdr.num_ents[i] > (hdr.src_size >> i) / hdr.base_bufsize)
+      goto fail;
+    lrm->lrms[i].resize(hdr.num_ents[i]);
+    for (LRMEnt *&ent : lrm->lrms[i]) {
+      LRMFileEnt fe;
+      if (data_size - pos < sizeof(fe))
+        goto fail;
+      memcpy(&fe, data + pos, sizeof(fe));
+      pos += sizeof(fe);
+      if (!fe.present)
+        continue;
+      if (fe.hash_begin_scan_pos_shift < 8 || fe.hash_begin_scan_pos_shift > 31 || fe.hashpos_count <= 0 ||
+          fe.buf_pos < 0 || fe.buf_size <= 0 || fe.buf_size > hdr.src_size - fe.buf_pos)
+        goto fail;
+      int entries = 1 << (32 - fe.hash_begin_scan_pos_shift);
+      size_t hashpos_bytes = LRM_AlignSize(sizeof(HashPos) * fe.hashpos_count);
+      size_t scan_pos_bytes = LRM_AlignSize(sizeof(int) * (entries + 1));
+      if (data_size - pos < hashpos_bytes + scan_pos_bytes)
+        goto fail;
+      const HashPos *hashpos = (const HashPos *)(data + pos);
+      const int *scan_pos = (const int *)(data + pos + hashpos_bytes);
+      pos += hashpos_bytes + scan_pos_bytes;
+      // Lookups rely on a sorted scan index, the terminating sentinel and on
+      // positions that stay inside the bound reference.
+      if (hashpos[fe.hashpos_count - 1].hash != 0xffffffff || scan_pos[entries] != fe.hashpos_count - 1)
+        goto fail;
+      for (int j = 0; j < entries; j++)
+        if (scan_pos[j] < 0 || scan_pos[j] > scan_pos[j + 1])
+          goto fail;
+      for (int j = 0; j < fe.hashpos_count; j++)
+        if (hashpos[j].position < 0 || hashpos[j].position > fe.buf_size - hdr.hash_length)
+          goto fail;
+
+      ent = new LRMEnt;
+      ent->hash_length = hdr.hash_length;
+      ent->cur_hashmult = hdr.cur_hashmult;
+      ent->buf_pos = fe.buf_pos;
+      ent->buf_size = fe.buf_size;
+      ent->hash_begin_scan_pos_shift = fe.hash_begin_scan_pos_shift;
+      ent->hashpos_data = hashpos;
+      ent->hash_begin_scan_pos_data = scan_pos;
+    }
+  }
+  return lrm;
+fail:
+  LRM_FreeCascade(lrm);
+  return NULL;
+}
+
+LRMCascade *LRM_LoadCascade(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    return NULL;
+  std::vector<uint8> data;
+  bool ok = fseek(f, 0, SEEK_END) == 0;
+  long size = ok ? ftell(f) : -1;
+  if (size > 0 && fseek(f, 0, SEEK_SET) == 0) {
+    data.resize(size);
+    ok = fread(data.data(), 1, size, f) == (size_t)size;
+  } else {
+    ok = false;
+  }
+  fclose(f);
+  LRMCascade *lrm = ok ? LRM_AttachCascade(data.data(), data.size()) : NULL;
+  if (lrm)
+    lrm->file_data = std::move(data);
+  return lrm;
+}
+
 void LRM_CascadeGetSet(LRMCascade *lrm, LRMTable *result, uint8 *src_ptr) {
   int nbytes = src_ptr - lrm->src_ptr;
   if (nbytes <= 0)
@@ -807,6 +1102,9 @@ void LRM_CascadeGetSet(LRMCascade *lrm, LRMTable *result, uint8 *src_ptr) {
 }
 
 void LRM_GetRanges(LRMCascade *lrm, LRMTable *result, uint8 *src_cur, uint8 *src_end) {
+  // A loaded cascade that was never bound has nothing to match against.
+  if (lrm->src_ptr == NULL)
+    return;
   int n = src_cur - lrm->src_ptr;
   if (n <= 0)
     return;
@@ -835,7 +1133,7 @@ void LRMScanner_Init(LRMScanner *lrm, LRMTable *lrm_table, uint8 *src_ptr_start,
   }
 }
 
-HashPos *HashPos_FindFirst(HashPos *begin, HashPos *end, uint32 scanfor) {
+const HashPos *HashPos_FindFirst(const HashPos *begin, const HashPos *end, uint32 scanfor) {
   size_t n = end - begin;
   while (n) {
     if (begin[n >> 1].hash >= scanfor)
@@ -870,9 +1168,9 @@ int LRMTable_Lookup(LRMTable *lrmtable, uint32 hash, uint8 *src_ptr_start, uint8
     int length = 0, offset = intmax;
     LRMEnt *lrm = lrmtable_data[i];
     if (src_ptr_end - src_ptr_start >= 8) {
-      int *hashindex = &lrm->hash_begin_scan_pos[hash >> lrm->hash_begin_scan_pos_shift];
-      HashPos *hp_start = lrm->arrhashpos.data();
-      HashPos *hp = hp_start + hashindex[0];
+      const int *hashindex = &lrm->hash_begin_scan_pos_data[hash >> lrm->hash_begin_scan_pos_shift];
+      const HashPos *hp_start = lrm->hashpos_data;
+      const HashPos *hp = hp_start + hashindex[0];
       if (hash >= hp->hash) {
         hp = HashPos_FindFirst(hp, hp_start + hashindex[1], hash);
         for (; hp->hash == hash; hp++) {
@@ -15,6 +15,13 @@ struct LRMEnt {
   int buf_size = 0;
   std::vector<int> hash_begin_scan_pos;
   int hash_begin_scan_pos_shift = 0;
+  // Offset of |buf| from the cascade's src_ptr, used to rebind a cascade to
+  // another copy of its source data.
+  int buf_pos = 0;
+  // What lookups read. Points into the vectors above, or into a serialized
+  // cascade when the entry was loaded from one.
+  const HashPos *hashpos_data = 0;
+  const int *hash_begin_scan_pos_data = 0;
 };
 
 struct LRMTable {
@@ -26,6 +33,8 @@ struct LRMCascade {
   int base_bufsize;
   uint8 *src_ptr;
   int src_size;
+  // Serialized data the entries point into, if owned by the cascade.
+  std::vector<uint8> file_data;
 };
 
 struct LRMScanner {
@@ -65,8 +74,26 @@ void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, i
 struct LRMCascade;
 void LRM_FreeCascade(LRMCascade *lrm);
 LRMCascade *LRM_AllocateCascade(uint8 *src_ptr, int src_size, int lrm_step_size, int hash_lookup_bits_base, int hash_lookup_bits_inc, int base_bufsize, int hash_length);
+// Threads used to build cascades, 0 (the default) uses one per core. The
+// cascade is the same for any thread count.
+void LRM_SetThreadCount(int threads);
 void LRM_GetRanges(LRMCascade *lrm, LRMTable *result, uint8 *src_cur, uint8 *src_end);
 
+// Reference cascades are built once from a reference corpus and reused across
+// many Compress calls. Before each call the cascade is bound to the copy of
+// the reference that sits at src_window_base, so found offsets reach back
+// into that prefix and the decoder must have the same bytes in front of its
+// output. Binding writes to the entries, so one cascade can't serve concurrent
+// calls with different buffers. The serialized form stores positions only and
+// can be mapped read-only.
+LRMCascade *LRM_AllocateReferenceCascade(uint8 *ref, int ref_size, int lrm_step_size, int hash_lookup_bits, int max_bufsize, int hash_length);
+void LRM_BindCascade(LRMCascade *lrm, uint8 *src_ptr);
+size_t LRM_GetSerializedSize(const LRMCascade *lrm);
+size_t LRM_SerializeCascade(const LRMCascade *lrm, uint8 *dst, size_t dst_size);
+bool LRM_SaveCascade(const char *filename, const LRMCascade *lrm);
+LRMCascade *LRM_AttachCascade(const uint8 *data, size_t data_size);
+LRMCascade *LRM_LoadCascade(const char *filename);
+
 void LRMScannerEx_Setup(LRMScannerEx *lrm, LRMTable *lrm_table, uint8 *src_ptr_start, uint8 *src_ptr_next, int intmax);
 int LRMScannerEx_FindMatch(LRMScannerEx *lrm, uint8 *src_ptr, uint8 *src_ptr_end, int *found_offset);
 
@@ -4,6 +4,7 @@
 #include "compress.h"
 #include "compr_util.h"
 #include "compr_entropy.h"
+#include "compr_calibrate.h"
 #include <algorithm>
 #include <memory>
 #include "match_hasher.h"
@@ -32,6 +33,7 @@ struct MermaidWriter {
   int tok_stream_2_offs;
   int off32_count_1;
   int off32_count_2;
+  std::unique_ptr<uint8[]> buffer;
 };
 
 void MermaidWriter_Init(MermaidWriter *mw, uint src_len, const uint8 *src, bool use_litsub) {
@@ -51,6 +53,7 @@ void MermaidWriter_Init(MermaidWriter *mw, uint src_len, const uint8 *src, bool
   if (use_litsub)
     total_size += lit_size;
   uint8 *temp = new uint8[total_size];
+  mw->buffer.reset(temp);
 
   mw->lit_start = mw->lit_cur = temp;
   temp += lit_size;
@@ -275,12 +278,12 @@ struct MermaidHistos {
   HistoU8 off16lo, off16hi;
 };
 
-static float GetTime_MermaidOff16(int platforms, int num) {
+float GetTime_MermaidOff16(int platforms, int num) {
   return CombineCostComponents1A(platforms, num, 0.270f, 0.428f, 0.550f, 0.213f,
                                                  24.0f, 53.0f, 62.0f, 33.0f);
 }
 
-static float GetTime_Mermaid(int platforms, int len, int toks, int ctoks) {
+float GetTime_Mermaid(int platforms, int len, int toks, int ctoks) {
   return CombineCostComponents(platforms,
                                200.0f + len * 0.363f + toks * 5.393f + ctoks * 29.655f,
                                200.0f + len * 0.429f + toks * 6.977f + ctoks * 49.739f,
@@ -288,7 +291,7 @@ static float GetTime_Mermaid(int platforms, int len, int toks, int ctoks) {
                                200.0f + len * 0.255f + toks * 5.364f + ctoks * 30.818f);
 }
 
-static float GetTime_Selkie(int platforms, int len, int toks, int ctoks, int lit) {
+float GetTime_Selkie(int platforms, int len, int toks, int ctoks, int lit) {
   return CombineCostComponents(platforms,
                                200.0f + len * 0.371f + toks * 5.259f + ctoks * 25.474f + lit * 0.131f,
                                200.0f + len * 0.414f + toks * 6.678f + ctoks * 62.007f + lit * 0.065f,
@@ -302,6 +305,7 @@ static float GetTime_MermaidSelkieOff32(int platforms, int num) {
 }
 
 int Mermaid_WriteLzTable(float *cost_ptr, int *chunk_type_ptr, MermaidHistos *mh, uint8 *dst, uint8 *dst_end, LzCoder *coder, LzTemp *lztemp, MermaidWriter *mw, int start_pos) {
+  ProfileScope profile(kProfilePhase_TokenEncoding, mw->src_len, mw->src_ptr);
   bool is_mermaid = coder->codec_id == kCompressorMermaid;
   const uint8 *src = mw->src_ptr;
   int src_len = mw->src_len;
@@ -341,7 +345,7 @@ int Mermaid_WriteLzTable(float *cost_ptr, int *chunk_type_ptr, MermaidHistos *mh
     if (mh)
       mh->lit = litsub_histo;
     dst += n_lits;
-  } else if (is_mermaid && lit_count >= 32) {
+  } else if (is_mermaid && lit_count >= 32 && level > -4) {
     CountBytesHistoU8(mw->lit_start, lit_count, &lit_histo);
     int n, n_lits = -1;
     if (mw->litsub_start) {
@@ -785,6 +789,57 @@ no_match:
   }
 };
 
+// Level -4, the same loop as KrakenCompressUltrafast: one 8-byte hash probe
+// per position, runs taken at offset 8 and a step that grows with the
+// literal run.
+template<typename _Hasher>
+struct MermaidCompressUltrafast {
+  typedef _Hasher Hasher;
+  enum { Level = -4 };
+  static __forceinline void Run(MermaidWriter &mw, Hasher *hasher, const uint8 *src_cur, const uint8 *src_end_safe, const uint8 *src_end, ptrdiff_t &last_offs, uint dict_size, const uint min_match_length_table[32], int min_match_length) {
+    const uint8 *src_base = hasher->src_base_;
+    uint64 hashmult = hasher->hashmult_;
+    typename Hasher::ElemType *hash_ptr = hasher->hash_ptr_;
+    int hashshift = 64 - hasher->hash_bits_;
+
+    const uint8 *lit_start = src_cur;
+    while (src_cur < src_end_safe - 5) {
+      uint64 u64_at_cur = *(uint64*)src_cur;
+      typename Hasher::ElemType *hash = &hash_ptr[(size_t)(u64_at_cur * hashmult >> hashshift)];
+      uint32 offs = (typename Hasher::ElemType)(src_cur - src_base - *hash);
+      *hash = src_cur - src_base;
+      if ((uint)(offs - 8) < (uint)(dict_size - 8)) {
+        if (u64_at_cur != *(uint64*)(src_cur - offs))
+          goto no_match;
+      } else if (offs - 1 < 8 && u64_at_cur == *(uint64*)(src_cur - 8)) {
+        offs = 8;
+      } else {
+no_match:
+        src_cur += 1 + ((src_cur - lit_start) >> 4);
+        continue;
+      }
+      const uint8 *match_end = src_cur + 8;
+      for (; match_end < src_end_safe; match_end += 8) {
+        uint64 v = *(uint64*)match_end ^ *(uint64*)(match_end - offs);
+        if (v != 0) {
+          match_end += BSF64(v) >> 3;
+          break;
+        }
+      }
+      match_end = std::min(match_end, src_end_safe);
+      int ml = match_end - src_cur;
+      if (ml < min_match_length_table[31 - BSR(offs)])
+        goto no_match;
+      Mermaid_WriteOffs(mw, ml, src_cur - lit_start, offs, last_offs, lit_start);
+      last_offs = -(ptrdiff_t)offs;
+      lit_start = src_cur = match_end;
+    }
+    ptrdiff_t remains = src_end - lit_start;
+    if (remains > 0)
+      memcpy(postadd(mw.lit_cur, remains), lit_start, remains);
+  }
+};
+
 static void MermaidBuildMatchLengths(uint *tab, int min_matchlen, int v) {
   tab[0] = tab[1] = tab[2] = tab[3] = tab[4] = tab[5] = tab[6] = tab[7] = tab[8] = tab[9] = 32;
   tab[10] = tab[11] = v * 2 - 6;
@@ -846,6 +901,9 @@ static int MermaidCompressLoop(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *
       mw.off32_count_2 = mw.off32_count;
 
   }
+  // Store the quantum right away if it's nearly all literals.
+  if (Function::Level <= -4 && mw.lit_cur - mw.lit_start > src_size - (src_size >> 5))
+    return src_size;
   return Mermaid_WriteLzTable(cost_ptr, chunk_type_ptr, 0, dst, dst_end, coder, lztemp, &mw, start_pos);
 }
 
@@ -1962,6 +2020,8 @@ int MermaidDoCompress(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls,
     return MermaidCompressLoop<MermaidCompressVeryfast<-2, FastMatchHasher<uint16>>>(coder, lztemp, mls, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
   } else if (level == -3) {
     return MermaidCompressLoop<MermaidCompressVeryfast<-3, FastMatchHasher<uint16>>>(coder, lztemp, mls, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
+  } else if (level == -4) {
+    return MermaidCompressLoop<MermaidCompressUltrafast<FastMatchHasher<uint32>>>(coder, lztemp, mls, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
   } else if (level >= 5) {
     return MermaidOptimal(coder, lztemp, mls, src, src_size, dst, dst_end, start_pos, chunk_type_ptr, cost_ptr);
   }
@@ -1982,10 +2042,10 @@ void SetupEncoder_Mermaid(LzCoder *coder, int codec_id, int src_len, int level,
   coder->codec_id = codec_id;
   coder->quantum_blocksize = 0x20000;
   coder->check_plain_huffman = is_mermaid && (level >= 4);
-  coder->platforms = 0;
+  coder->platforms = GetEncoderPlatforms();
   coder->compression_level = level;
   coder->opts = copts;
-  coder->speed_tradeoff = (copts->spaceSpeedTradeoffBytes * 0.00390625f) * (is_mermaid ? 0.050000001f : 0.14f);
+  coder->speed_tradeoff = GetSpeedTradeoff(codec_id, copts);
   coder->max_matches_to_consider = 4;
   coder->limit_local_dictsize = (level >= 6);
   coder->compressor_file_id = 10;
@@ -1996,7 +2056,7 @@ void SetupEncoder_Mermaid(LzCoder *coder, int codec_id, int src_len, int level,
       coder->entropy_opts = 0xff & ~kEntropyOpt_MultiArrayAdvanced;
     else
       coder->entropy_opts = 0xff & ~(kEntropyOpt_MultiArrayAdvanced | kEntropyOpt_tANS | kEntropyOpt_MultiArray);
-    level = std::max(level, -3);
+    level = std::max(level, -4);
   } else {
     coder->entropy_opts = kEntropyOpt_SupportsShortMemset;
   }
@@ -2036,5 +2096,11 @@ void SetupEncoder_Mermaid(LzCoder *coder, int codec_id, int src_len, int level,
       hash_bits = std::min(hash_bits, 13);
     CreateLzHasher<FastMatchHasher<uint16>, 0x1000000>(coder, src_base, src_start, hash_bits, min_match_len);
     coder->entropy_opts &= ~(kEntropyOpt_RLE | kEntropyOpt_RLEEntropy);
+  } else if (level == -4) {
+    // Hash all 8 bytes since that's the shortest match this level takes.
+    if (copts->hashBits <= 0)
+      hash_bits = std::min(hash_bits, 16);
+    CreateLzHasher<FastMatchHasher<uint32>, 0x1000000>(coder, src_base, src_start, hash_bits, 8);
+    coder->entropy_opts &= ~(kEntropyOpt_RLE | kEntropyOpt_RLEEntropy);
   }
 }
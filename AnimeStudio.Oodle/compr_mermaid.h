@@ -9,6 +9,10 @@ void SetupEncoder_Mermaid(LzCoder *coder, int codec_id, int src_len, int level,
                          const CompressOptions *copts,
                          const uint8 *src_base, const uint8 *src_start);
 
+float GetTime_Mermaid(int platforms, int len, int toks, int ctoks);
+float GetTime_Selkie(int platforms, int len, int toks, int ctoks, int lit);
+float GetTime_MermaidOff16(int platforms, int num);
+
 int MermaidDoCompress(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls_unused,
                      const uint8 *src, int src_size,
                      uint8 *dst, uint8 *dst_end,
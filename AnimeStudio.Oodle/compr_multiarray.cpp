@@ -2,6 +2,7 @@
 #include "stdafx.h"
 #include "compr_entropy.h"
 #include "compr_util.h"
+#include "compr_profile.h"
 #include "qsort.h"
 #include <algorithm>
 #include <vector>
@@ -47,10 +48,6 @@ static uint GetApproxHistoBitsFrac(const HistoU8 &h, int histo_sum) {
   return sum;
 }
 
-static uint GetApproxHistoBits(const HistoU8 &h, int histo_sum) {
-  return GetApproxHistoBitsFrac(h, histo_sum) >> 8;
-}
-
 static void AddHistogram(HistoU8 *d, const HistoU8 &a, const HistoU8 &b) {
   for (size_t i = 0; i != 256; i++)
     d->count[i] = a.count[i] + b.count[i];
@@ -62,15 +59,89 @@ static void AddHistogram(HistoAndCount &dst, const HistoAndCount &src) {
 }
 
 static uint GetHistoBitUsageWithBitProfile(const HistoU8 &h, int histo_sum, const BitProfile *bits) {
-  // optimize
-  uint rv = 0;
-  for (size_t i = 0; i != 256; i++)
-    rv += h.count[i] * bits->bits[i];
-  return rv;
+  if (histo_sum >= 0x8000) {
+    uint rv = 0;
+    for (size_t i = 0; i != 256; i++)
+      rv += h.count[i] * bits->bits[i];
+    return rv;
+  }
+  // All counts fit in 15 bits, so they can be multiplied and added in pairs.
+  simde__m128i acc = simde_mm_setzero_si128();
+  for (size_t i = 0; i != 256; i += 8) {
+    simde__m128i c = simde_mm_packs_epi32(simde_mm_loadu_si128((const simde__m128i*)&h.count[i]),
+                                          simde_mm_loadu_si128((const simde__m128i*)&h.count[i + 4]));
+    simde__m128i b = simde_mm_loadu_si128((const simde__m128i*)&bits->bits[i]);
+    acc = simde_mm_add_epi32(acc, simde_mm_madd_epi16(c, b));
+  }
+  acc = simde_mm_add_epi32(acc, simde_mm_shuffle_epi32(acc, 0x4e));
+  acc = simde_mm_add_epi32(acc, simde_mm_shuffle_epi32(acc, 0xb1));
+  return (uint)simde_mm_cvtsi128_si32(acc);
+}
+
+// Set of symbols that occur in a histogram. When clustering, the cost of two
+// merged histograms only needs to look at the union of their symbols.
+struct SymbolMask {
+  uint64 bits[4];
+};
+
+static void MakeSymbolMask(const HistoU8 &h, SymbolMask *m) {
+  for (size_t i = 0; i != 4; i++) {
+    uint64 v = 0;
+    for (size_t j = 0; j != 64; j++)
+      v |= (uint64)(h.count[i * 64 + j] != 0) << j;
+    m->bits[i] = v;
+  }
+}
+
+// Same as GetApproxHistoBitsFrac in whole bits, only symbols in the mask are
+// visited.
+static uint GetApproxHistoBitsMasked(const HistoU8 &h, const SymbolMask &m, int histo_sum) {
+  int factor = 0x40000000u / histo_sum;
+  uint sum = 0;
+  for (size_t w = 0; w != 4; w++) {
+    for (uint64 bits = m.bits[w]; bits; bits &= bits - 1) {
+      uint v = h.count[w * 64 + BSF64(bits)];
+      sum += v * std::min(kMaxBitLength * 256u, kLog2LookupTable[factor * v >> 17] >> 5);
+    }
+  }
+  return sum >> 8;
 }
 
+// Same as GetHistoCostApprox, only symbols in the mask are visited. The runs of
+// zeros in between are given by the distance between the set bits.
+static uint GetHistoCostApproxMasked(const HistoU8 &h, const SymbolMask &m, int histo_sum) {
+  if (histo_sum <= 1)
+    return 40;
+
+  int factor = 0x40000000u / histo_sum;
+  uint nonzero_entries = 0;
+  uint32 bit_usagez = 0, bit_usage = 0;
+  uint64 bit_usagef = 0;
+  int prev = -1;
+  for (size_t w = 0; w != 4; w++) {
+    for (uint64 bits = m.bits[w]; bits; bits &= bits - 1) {
+      int i = (int)(w * 64 + BSF64(bits));
+      uint32 v = h.count[i];
+      uint zeros_run = i - prev - 1;
+      nonzero_entries++;
+      bit_usagez += zeros_run ? 2 * BSR(zeros_run + 1) + 1 : 1;
+      bit_usage += BSR(v) * 2 + 1;
+      bit_usagef += v * (uint64)kLog2LookupTable[factor * v >> 17];
+      prev = i;
+    }
+  }
+  if (nonzero_entries == 1)
+    return 6 * 8;
+  bit_usagez += 2 * BSR(255 - prev + 1) + 1;
+
+  bit_usagez = std::min<uint>(bit_usagez, 8 * nonzero_entries);
+  return (int)(bit_usagef >> 13) + bit_usage + bit_usagez + 5 * 8;
+}
+
+// Agglomerative clustering of the histograms. All pairwise merge gains go
+// into a heap, stale entries are re-evaluated lazily when they reach the top.
 static void ReduceNumHistograms(std::vector<HistoAndCount> *array, float A, float B, int max_count,
-                                uint(*get_cost)(const HistoU8 &, int)) {
+                                uint(*get_cost)(const HistoU8 &, const SymbolMask &, int)) {
   struct Entry {
     float value;
     int cost_in_bits;
@@ -80,10 +151,14 @@ static void ReduceNumHistograms(std::vector<HistoAndCount> *array, float A, floa
     bool operator<(const Entry &o) { return value < o.value; }
   };
 
-  for (auto it = array->begin(); it != array->end(); ++it)
-    it->temp = get_cost(it->histo, it->sum);
-
   int n = array->size();
+  HistoAndCount *histos = array->data();
+
+  std::vector<SymbolMask> masks(n);
+  for (int i = 0; i < n; i++) {
+    MakeSymbolMask(histos[i].histo, &masks[i]);
+    histos[i].temp = get_cost(histos[i].histo, masks[i], histos[i].sum);
+  }
 
   std::vector<Entry> ents;
   ents.resize(n * (n - 1) >> 1);
@@ -91,15 +166,26 @@ static void ReduceNumHistograms(std::vector<HistoAndCount> *array, float A, floa
   Entry *bptr = ents.data(), *bfirst = bptr;
 
   HistoU8 temp_values;
-  HistoAndCount *histos = array->data();
+  SymbolMask temp_mask;
+
+  auto get_merged_cost = [&](int i, int j) {
+    for (size_t w = 0; w != 4; w++) {
+      uint64 bits = masks[i].bits[w] | masks[j].bits[w];
+      temp_mask.bits[w] = bits;
+      for (; bits; bits &= bits - 1) {
+        size_t k = w * 64 + BSF64(bits);
+        temp_values.count[k] = histos[i].histo.count[k] + histos[j].histo.count[k];
+      }
+    }
+    return get_cost(temp_values, temp_mask, histos[i].sum + histos[j].sum);
+  };
 
   for (int i = 0; i < n; i++) {
     for (int j = i + 1; j < n; j++) {
       const HistoAndCount &hi = histos[i];
       const HistoAndCount &hj = histos[j];
-      AddHistogram(&temp_values, hi.histo, hj.histo);
 
-      bptr->cost_in_bits = get_cost(temp_values, hi.sum + hj.sum);
+      bptr->cost_in_bits = get_merged_cost(i, j);
       bptr->j_value = j;
       bptr->i_value = i;
       bptr->j_count = hj.sum;
@@ -124,15 +210,15 @@ static void ReduceNumHistograms(std::vector<HistoAndCount> *array, float A, floa
         break;
 
       AddHistogram(hi, hj);
+      for (size_t w = 0; w != 4; w++)
+        masks[cur.i_value].bits[w] |= masks[cur.j_value].bits[w];
       hj.sum = 0;
       hj.temp = 0;
       hi.temp = cur.cost_in_bits;
       n--;
     } else {
       if (hi.sum && hj.sum) {
-        AddHistogram(&temp_values, hi.histo, hj.histo);
-
-        bptr->cost_in_bits = get_cost(temp_values, hi.sum + hj.sum);
+        bptr->cost_in_bits = get_merged_cost(cur.i_value, cur.j_value);
         bptr->j_value = cur.j_value;
         bptr->i_value = cur.i_value;
         bptr->j_count = hj.sum;
@@ -222,7 +308,7 @@ static void HistoArr_RemoveAllWithEmptyCount(std::vector<HistoAndCount> *arr) {
 
 static void ReduceHistogramsAccurate(std::vector<HistoAndCount> *arr, float speed_tradeoff, int platforms, int max_count) {
   float value = GetTime_SingleHuffman(platforms, 0, 128) * speed_tradeoff;
-  ReduceNumHistograms(arr, value, 0.0f, max_count, &GetHistoCostApprox);
+  ReduceNumHistograms(arr, value, 0.0f, max_count, &GetHistoCostApproxMasked);
 }
 
 static const uint8 *AdjustHistoWindow(HistoU8 &histo,
@@ -376,7 +462,7 @@ static int EncodeAdvMultiArray(uint8 *dst_in, uint8 *dst_end_in,
     return -1;
 
   if (arr_histo.size() > max_arrs)
-    ReduceNumHistograms(&arr_histo, 2.0f, 0.0f, max_arrs, &GetApproxHistoBits);
+    ReduceNumHistograms(&arr_histo, 2.0f, 0.0f, max_arrs, &GetApproxHistoBitsMasked);
 
   if (arr_histo.size() <= 1)
     return -1;
@@ -733,6 +819,10 @@ static int EncodeSimpleMultiArray(uint8 *dst, uint8 *dst_end,
 }
 
 int EncodeMultiArray(uint8 *dst, uint8 *dst_end, const uint8 **array_data, int *array_lens, int array_count, int opts, float speed_tradeoff, int platforms, float *cost_ptr, int level) {
+  int total_len = 0;
+  for (int i = 0; i < array_count; i++)
+    total_len += array_lens[i];
+  ProfileScope profile(kProfilePhase_MultiArray, total_len);
   if (level < 8)
     opts &= ~kEntropyOpt_MultiArrayAdvanced;
   int n1 = EncodeSimpleMultiArray(dst, dst_end, array_data, array_lens, array_count, opts, speed_tradeoff, platforms, cost_ptr, level);
@@ -1138,6 +1228,7 @@ getout:
 int EncodeArrayU8_MultiArray(uint8 *dst, uint8 *dst_end, const uint8 *src, int src_size, const HistoU8 &histo, int level, int opts, float speed_tradeoff, int platforms, float cost_thres, float *cost_ptr) {
   if (src_size < 96)
     return -1;
+  ProfileScope profile(kProfilePhase_MultiArray, src_size);
   int n;
   if (src_size < 1536)
     n = EncodeMultiArray_Short(dst, dst_end, src, src_size, histo, level, opts, speed_tradeoff, platforms, cost_thres, cost_ptr);
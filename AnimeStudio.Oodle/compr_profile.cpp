@@ -0,0 +1,134 @@
+#include "stdafx.h"
+#include "compr_profile.h"
+#include <chrono>
+
+typedef std::chrono::steady_clock ProfileClock;
+
+bool profile_enabled;
+
+static ProfilePhase profile_phases[kProfilePhase_Count];
+static ProfileClock::time_point profile_start, profile_phase_start;
+static int profile_stack[64];
+static int profile_depth;
+// Scratch memory held by the encoder on this thread, tracked only while
+// profiling so that library callers on other threads never touch it.
+static thread_local int64 profile_memory;
+// Input range most recently covered by each phase, to count retries once.
+static const uint8 *profile_covered_lo[kProfilePhase_Count], *profile_covered_hi[kProfilePhase_Count];
+
+static const char *const kProfilePhaseNames[kProfilePhase_Count] = {
+  "hasher_preload",
+  "match_finder",
+  "long_range_matcher",
+  "parse",
+  "token_encoding",
+  "entropy",
+  "multi_array",
+};
+
+void Profile_Enable(bool enable) {
+  profile_enabled = enable;
+}
+
+void Profile_Reset() {
+  memset(profile_phases, 0, sizeof(profile_phases));
+  memset(profile_covered_lo, 0, sizeof(profile_covered_lo));
+  memset(profile_covered_hi, 0, sizeof(profile_covered_hi));
+  profile_depth = 0;
+  profile_memory = 0;
+  profile_start = profile_phase_start = ProfileClock::now();
+}
+
+const ProfilePhase *Profile_GetPhase(int phase) {
+  return (phase >= 0 && phase < kProfilePhase_Count) ? &profile_phases[phase] : NULL;
+}
+
+const char *Profile_GetPhaseName(int phase) {
+  return (phase >= 0 && phase < kProfilePhase_Count) ? kProfilePhaseNames[phase] : NULL;
+}
+
+// Charges the time since the last switch to the phase on top of the stack.
+static void Profile_Switch() {
+  ProfileClock::time_point now = ProfileClock::now();
+  if (profile_depth > 0 && profile_depth <= 64)
+    profile_phases[profile_stack[profile_depth - 1]].seconds += std::chrono::duration<double>(now - profile_phase_start).count();
+  profile_phase_start = now;
+}
+
+// Bytes of [src, src + bytes) the phase hasn't seen yet. Chunks are encoded
+// front to back, so remembering the one range covered last is enough.
+static int64 Profile_NewBytes(int phase, const void *src, int64 bytes) {
+  if (!src)
+    return bytes;
+  const uint8 *lo = (const uint8 *)src, *hi = lo + bytes;
+  const uint8 *&covered_lo = profile_covered_lo[phase], *&covered_hi = profile_covered_hi[phase];
+  int64 new_bytes = bytes;
+  if (lo < covered_hi && hi > covered_lo) {
+    new_bytes = (lo < covered_lo ? covered_lo - lo : 0) + (hi > covered_hi ? hi - covered_hi : 0);
+    lo = std::min(lo, covered_lo);
+    hi = std::max(hi, covered_hi);
+  }
+  covered_lo = lo;
+  covered_hi = hi;
+  return new_bytes;
+}
+
+void Profile_Enter(int phase, const void *src, int64 bytes) {
+  Profile_Switch();
+  if (profile_depth < 64)
+    profile_stack[profile_depth] = phase;
+  profile_depth++;
+  ProfilePhase *p = &profile_phases[phase];
+  p->calls++;
+  p->bytes += Profile_NewBytes(phase, src, bytes);
+  p->bytes_processed += bytes;
+  if (profile_memory > p->peak_memory)
+    p->peak_memory = profile_memory;
+}
+
+void Profile_Leave() {
+  Profile_Switch();
+  if (profile_depth > 0)
+    profile_depth--;
+}
+
+void Profile_AddMemory(int64 delta) {
+  if (!profile_enabled)
+    return;
+  // Blocks allocated before profiling started may be freed after it.
+  profile_memory = std::max<int64>(profile_memory + delta, 0);
+  if (profile_depth > 0 && profile_depth <= 64) {
+    ProfilePhase *p = &profile_phases[profile_stack[profile_depth - 1]];
+    if (profile_memory > p->peak_memory)
+      p->peak_memory = profile_memory;
+  }
+}
+
+void Profile_Print(FILE *f, bool json) {
+  double total = std::chrono::duration<double>(ProfileClock::now() - profile_start).count();
+  double other = total;
+  for (int i = 0; i < kProfilePhase_Count; i++)
+    other -= profile_phases[i].seconds;
+
+  if (json) {
+    fprintf(f, "{\"total_seconds\": %.6f, \"other_seconds\": %.6f, \"phases\": [", total, other);
+    for (int i = 0; i < kProfilePhase_Count; i++) {
+      const ProfilePhase &p = profile_phases[i];
+      fprintf(f, "%s\n  {\"name\": \"%s\", \"seconds\": %.6f, \"calls\": %llu, \"bytes\": %llu, \"bytes_processed\": %llu, \"peak_memory\": %lld}",
+              i ? "," : "", kProfilePhaseNames[i], p.seconds, (unsigned long long)p.calls,
+              (unsigned long long)p.bytes, (unsigned long long)p.bytes_processed, (long long)p.peak_memory);
+    }
+    fprintf(f, "\n]}\n");
+    return;
+  }
+  fprintf(f, "%-20s %10s %7s %10s %14s %14s %12s\n", "phase", "seconds", "%", "calls", "bytes", "incl. retries",
+          "peak mem kB");
+  for (int i = 0; i < kProfilePhase_Count; i++) {
+    const ProfilePhase &p = profile_phases[i];
+    fprintf(f, "%-20s %10.4f %6.1f%% %10llu %14llu %14llu %12lld\n", kProfilePhaseNames[i], p.seconds,
+            total > 0 ? p.seconds * 100 / total : 0.0, (unsigned long long)p.calls,
+            (unsigned long long)p.bytes, (unsigned long long)p.bytes_processed, (long long)(p.peak_memory >> 10));
+  }
+  fprintf(f, "%-20s %10.4f %6.1f%%\n", "other", other, total > 0 ? other * 100 / total : 0.0);
+  fprintf(f, "%-20s %10.4f\n", "total", total);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdio.h>
+
+// Time, bytes and memory spent in each phase of the encoder. Profiling is
+// off by default, a ProfileScope then only tests a flag. Phases nest, and the
+// time of a phase doesn't include the phases nested in it. Not thread safe.
+
+enum {
+  kProfilePhase_HasherPreload,
+  kProfilePhase_MatchFinder,
+  kProfilePhase_LongRangeMatcher,
+  kProfilePhase_Parse,
+  kProfilePhase_TokenEncoding,
+  kProfilePhase_Entropy,
+  kProfilePhase_MultiArray,
+  kProfilePhase_Count,
+};
+
+struct ProfilePhase {
+  double seconds;
+  uint64 calls;
+  // Distinct input bytes handed to the phase. A phase that is retried on the
+  // same input, like token encoding trying several chunk types, counts those
+  // bytes once when its scope is given the input position.
+  uint64 bytes;
+  // Input bytes handed to the phase, counting every retry.
+  uint64 bytes_processed;
+  // Highest tracked scratch memory (LzScratchBlock and match storage) seen
+  // while the phase was running, including what outer phases hold.
+  int64 peak_memory;
+};
+
+extern bool profile_enabled;
+
+void Profile_Enable(bool enable);
+// Clears all phases and starts the clock for the total time.
+void Profile_Reset();
+const ProfilePhase *Profile_GetPhase(int phase);
+const char *Profile_GetPhaseName(int phase);
+
+// src is where the input of the phase starts, or NULL if every call has new
+// input.
+void Profile_Enter(int phase, const void *src, int64 bytes);
+void Profile_Leave();
+void Profile_AddMemory(int64 delta);
+
+// Prints a table, or JSON, of all phases and the time spent outside of them
+// since Profile_Reset.
+void Profile_Print(FILE *f, bool json);
+
+struct ProfileScope {
+  bool active;
+  ProfileScope(int phase, int64 bytes, const void *src = NULL) : active(profile_enabled) {
+    if (active)
+      Profile_Enter(phase, src, bytes);
+  }
+  ~ProfileScope() {
+    if (active)
+      Profile_Leave();
+  }
+};
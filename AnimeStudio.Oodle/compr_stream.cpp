@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "compr_stream.h"
+#include "compress.h"
+#include <algorithm>
+#include <vector>
+
+struct StreamCompressor {
+  int codec_id;
+  int level;
+  CompressOptions opts;
+  StreamWriteFunc *write;
+  void *write_ctx;
+  // The window holds up to history_size bytes that were already compressed,
+  // followed by the segment being gathered.
+  int history_size;
+  int segment_size;
+  std::vector<uint8> window;
+  std::vector<uint8> output;
+  int history_len;
+  int window_len;
+  uint64 bytes_in;
+  uint64 bytes_out;
+  bool failed;
+  bool finished;
+};
+
+StreamCompressor *StreamCompressor_Create(int codec_id, int level, const CompressOptions *compressopts,
+                                          StreamWriteFunc *write, void *write_ctx) {
+  if (codec_id != kCompressorKraken && codec_id != kCompressorMermaid &&
+      codec_id != kCompressorSelkie && codec_id != kCompressorLeviathan)
+    return NULL;
+  if (!write)
+    return NULL;
+  if (!compressopts)
+    compressopts = GetDefaultCompressOpts(level);
+
+  StreamCompressor *sc = new StreamCompressor;
+  sc->codec_id = codec_id;
+  sc->level = level;
+  sc->opts = *compressopts;
+  sc->write = write;
+  sc->write_ctx = write_ctx;
+
+  // Segments always end on a 256k boundary of the whole stream, where the
+  // decoder expects a block header.
+  if (sc->opts.seekChunkReset) {
+    // Seek chunks never look back, so there is no history to keep.
+    int chunk_len = GetSeekChunkLen(&sc->opts);
+    sc->history_size = 0;
+    sc->segment_size = std::max(0x400000 / chunk_len, 1) * chunk_len;
+  } else {
+    int history = sc->opts.maxLocalDictionarySize;
+    if (sc->opts.dictionarySize > 0)
+      history = std::min(history, sc->opts.dictionarySize);
+    sc->history_size = std::max(history, 0);
+    sc->segment_size = std::max((sc->history_size + 0x3FFFF) & ~0x3FFFF, 0x40000);
+  }
+  sc->window.resize((size_t)sc->history_size + sc->segment_size);
+  sc->output.resize(GetCompressedBufferSizeNeeded(sc->segment_size));
+  sc->history_len = 0;
+  sc->window_len = 0;
+  sc->bytes_in = 0;
+  sc->bytes_out = 0;
+  sc->failed = false;
+  sc->finished = false;
+  return sc;
+}
+
+void StreamCompressor_Destroy(StreamCompressor *sc) {
+  delete sc;
+}
+
+static bool StreamCompressor_Flush(StreamCompressor *sc) {
+  int n = sc->window_len - sc->history_len;
+  if (n == 0)
+    return true;
+  uint8 *src = sc->window.data() + sc->history_len;
+  int outbytes = CompressBlock(sc->codec_id, src, sc->output.data(), n, sc->level, &sc->opts,
+                               sc->window.data(), NULL);
+  if (outbytes < 0 || !sc->write(sc->write_ctx, sc->output.data(), outbytes)) {
+    sc->failed = true;
+    return false;
+  }
+  sc->bytes_out += outbytes;
+
+  int keep = std::min(sc->history_size, sc->window_len);
+  memmove(sc->window.data(), sc->window.data() + sc->window_len - keep, keep);
+  sc->history_len = sc->window_len = keep;
+  return true;
+}
+
+bool StreamCompressor_Write(StreamCompressor *sc, const uint8 *src, size_t src_size) {
+  if (sc->failed || sc->finished)
+    return false;
+  while (src_size > 0) {
+    int room = sc->history_len + sc->segment_size - sc->window_len;
+    int n = (int)std::min<size_t>(src_size, room);
+    memcpy(sc->window.data() + sc->window_len, src, n);
+    sc->window_len += n;
+    sc->bytes_in += n;
+    src += n;
+    src_size -= n;
+    if (n == room && !StreamCompressor_Flush(sc))
+      return false;
+  }
+  return true;
+}
+
+bool StreamCompressor_Finish(StreamCompressor *sc) {
+  if (sc->failed || sc->finished)
+    return false;
+  sc->finished = true;
+  return StreamCompressor_Flush(sc);
+}
+
+uint64 StreamCompressor_GetBytesIn(const StreamCompressor *sc) {
+  return sc->bytes_in;
+}
+
+uint64 StreamCompressor_GetBytesOut(const StreamCompressor *sc) {
+  return sc->bytes_out;
+}
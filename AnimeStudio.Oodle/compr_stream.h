@@ -0,0 +1,24 @@
+#pragma once
+
+// Streaming compression for inputs that don't fit in memory. Input is fed in
+// pieces of any size and compressed one segment at a time, keeping only the
+// last maxLocalDictionarySize bytes as history for the next segment, so peak
+// memory doesn't depend on the input size. The output is an ordinary stream
+// that decodes the same way as one from CompressBlock.
+
+struct CompressOptions;
+struct StreamCompressor;
+
+// Receives the compressed output in order. Returns false to abort.
+typedef bool StreamWriteFunc(void *ctx, const uint8 *data, size_t size);
+
+StreamCompressor *StreamCompressor_Create(int codec_id, int level, const CompressOptions *compressopts,
+                                          StreamWriteFunc *write, void *write_ctx);
+void StreamCompressor_Destroy(StreamCompressor *sc);
+
+bool StreamCompressor_Write(StreamCompressor *sc, const uint8 *src, size_t src_size);
+// Compresses whatever is still buffered. Nothing may be written after this.
+bool StreamCompressor_Finish(StreamCompressor *sc);
+
+uint64 StreamCompressor_GetBytesIn(const StreamCompressor *sc);
+uint64 StreamCompressor_GetBytesOut(const StreamCompressor *sc);
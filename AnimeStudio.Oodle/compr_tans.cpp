@@ -2,8 +2,10 @@
 #include "stdafx.h"
 #include "compr_entropy.h"
 #include "compr_util.h"
+#include "compr_calibrate.h"
 #include "qsort.h"
 #include <algorithm>
+#include <vector>
 #include <limits.h>
 
 float GetTime_tANS(int platforms, int src_size, int used_syms, int tans_table_size) {
@@ -12,7 +14,8 @@ float GetTime_tANS(int platforms, int src_size, int used_syms, int tans_table_si
     642.078f + src_size * 3.175f + used_syms * 52.016f + tans_table_size * 1.895f,
     1073.963f + src_size * 2.963f + used_syms * 77.065f + tans_table_size * 1.695f,
     1313.768f + src_size * 3.951f + used_syms * 78.930f + tans_table_size * 4.139f,
-    705.924f + src_size * 2.324f + used_syms * 49.328f + tans_table_size * 1.423f);
+    705.924f + src_size * 2.324f + used_syms * 49.328f + tans_table_size * 1.423f) *
+    GetHostCostScale(platforms, kCostFamily_tANS);
 }
 
 
@@ -182,16 +185,34 @@ static uint DoubleToUintRoundPow2(double v) {
 
 static int Tans_NormalizeCounts(uint *lookup, uint L, const HistoU8 &histo, int histo_sum, int num_syms) {
   int syms_used = 0;
-  double multiplier = (double)L / (double)histo_sum;
   uint weight_sum = 0;
-  for (int i = 0; i < num_syms; i++) {
-    uint h = histo.count[i], u = 0;
-    if (h) {
-      u = DoubleToUintRoundPow2(h * multiplier);
-      weight_sum += u;
-      syms_used += 1;
+  if (histo_sum < (1 << 20)) {
+    // Round h * L / histo_sum up when it's above the geometric mean of its
+    // two neighbors. The squares fit in 64 bits for sums of this size, so it
+    // can be done exactly.
+    uint64 sum_sq = (uint64)histo_sum * histo_sum;
+    for (int i = 0; i < num_syms; i++) {
+      uint h = histo.count[i], u = 0;
+      if (h) {
+        uint64 hl = (uint64)h * L;
+        u = (uint)(hl / histo_sum);
+        u += hl * hl > (uint64)u * (u + 1) * sum_sq;
+        weight_sum += u;
+        syms_used += 1;
+      }
+      lookup[i] = u;
+    }
+  } else {
+    double multiplier = (double)L / (double)histo_sum;
+    for (int i = 0; i < num_syms; i++) {
+      uint h = histo.count[i], u = 0;
+      if (h) {
+        u = DoubleToUintRoundPow2(h * multiplier);
+        weight_sum += u;
+        syms_used += 1;
+      }
+      lookup[i] = u;
     }
-    lookup[i] = u;
   }
   if (weight_sum == L)
     return syms_used;
@@ -302,62 +323,25 @@ static void Tans_InitTable(TansEntry *te, uint16 *te_data, uint *weights, int we
   }
 }
 
-static inline void Tans_GetEncodedBitCount(TansEntry *te, const uint8 *src, int src_size, int L_bits, uint *forward_bits_ptr, uint *backward_bits_ptr) {
-  uint L = 1 << L_bits;
-  const uint8 *src_end = src + src_size - 5;
-  uint state_0 = src_end[0] | L;
-  uint state_1 = src_end[1] | L;
-  uint state_2 = src_end[2] | L;
-  uint state_3 = src_end[3] | L;
-  uint state_4 = src_end[4] | L;
-  uint forward_bits = 0, backward_bits = 0;
-  uint nb;
-  int rounds = (src_size - 5) / 10;
-  TansEntry *t;
-  src_end--;
-#define TANS_COUNT_BITS(state, counter) do {   \
-  t = &te[*src_end--];                    \
-  nb = t->bits + (state >= t->thres);     \
-  counter += nb;                          \
-  state = t->next_state[state >> nb];     \
-} while(0)
-  switch ((src_size - 5) % 10) {
-  case 9: TANS_COUNT_BITS(state_3, forward_bits);
-  case 8: TANS_COUNT_BITS(state_2, forward_bits);
-  case 7: TANS_COUNT_BITS(state_1, forward_bits);
-  case 6: TANS_COUNT_BITS(state_0, forward_bits);
-  case 5: TANS_COUNT_BITS(state_4, backward_bits);
-  case 4: TANS_COUNT_BITS(state_3, backward_bits);
-  case 3: TANS_COUNT_BITS(state_2, backward_bits);
-  case 2: TANS_COUNT_BITS(state_1, backward_bits);
-  case 1: TANS_COUNT_BITS(state_0, backward_bits);
-  }
-  while (rounds--) {
-    TANS_COUNT_BITS(state_4, forward_bits);
-    TANS_COUNT_BITS(state_3, forward_bits);
-    TANS_COUNT_BITS(state_2, forward_bits);
-    TANS_COUNT_BITS(state_1, forward_bits);
-    TANS_COUNT_BITS(state_0, forward_bits);
-    TANS_COUNT_BITS(state_4, backward_bits);
-    TANS_COUNT_BITS(state_3, backward_bits);
-    TANS_COUNT_BITS(state_2, backward_bits);
-    TANS_COUNT_BITS(state_1, backward_bits);
-    TANS_COUNT_BITS(state_0, backward_bits);
-  }
-#undef TANS_COUNT_BITS
-  *forward_bits_ptr = forward_bits + 2 * L_bits;
-  *backward_bits_ptr = backward_bits + 3 * L_bits;
+// Shift a bit stream that was written MSB first right by |pad| bits, which is
+// the same as having written |pad| zero bits before it. |step| is 1 for
+// streams growing upwards from |p|, -1 for streams growing downwards.
+static void Tans_PadStreamStart(uint8 *p, ptrdiff_t n, ptrdiff_t step, int pad) {
+  if (!pad || !n)
+    return;
+  for (ptrdiff_t i = n - 1; i != 0; i--)
+    p[i * step] = (uint8)((p[i * step] >> pad) | (p[(i - 1) * step] << (8 - pad)));
+  p[0] >>= pad;
 }
 
-static uint8 *Tans_EncodeBytes(uint8 *dst, uint8 *dst_end, TansEntry *te, const uint8 *src, int src_size, int L_bits, int forward_bits_pad, int backward_bits_pad) {
-  BitWriter64<1> forward_bits(dst);
-  BitWriter64<-1> backward_bits(dst_end);
-
-  if (forward_bits_pad & 7)
-    forward_bits.WriteNoFlush(0, 8 - (forward_bits_pad & 7));
-
-  if (backward_bits_pad & 7)
-    backward_bits.WriteNoFlush(0, 8 - (backward_bits_pad & 7));
+// Encodes src into two bit streams, the forward one growing up from |buf| and
+// the backward one growing down from |buf_end|, while counting the bits. Gives
+// up as soon as the data won't fit in |max_bytes|. The streams must start
+// with zero padding to make them end on a byte boundary, which isn't known
+// until the end, so the padding is shifted in afterwards.
+static int Tans_EncodeBytes(uint8 *dst, uint8 *buf, uint8 *buf_end, TansEntry *te, const uint8 *src, int src_size, int L_bits, int max_bytes) {
+  BitWriter64<1> forward_bits(buf);
+  BitWriter64<-1> backward_bits(buf_end);
 
   uint L = 1 << L_bits;
   const uint8 *src_end = src + src_size - 5;
@@ -368,6 +352,7 @@ static uint8 *Tans_EncodeBytes(uint8 *dst, uint8 *dst_end, TansEntry *te, const
   uint state_4 = src_end[4] | L;
   uint nb;
   int rounds = (src_size - 5) / 10;
+  int max_bits = max_bytes * 8;
   TansEntry *t;
   src_end--;
 #define TANS_ENCODE(state, bitwr) do {                 \
@@ -402,6 +387,8 @@ static uint8 *Tans_EncodeBytes(uint8 *dst, uint8 *dst_end, TansEntry *te, const
     TANS_ENCODE(state_0, backward_bits);
     backward_bits.Flush();
     forward_bits.Flush();
+    if (forward_bits.totalb + backward_bits.totalb > max_bits)
+      return -1;
   }
 
   backward_bits.WriteNoFlush(state_4 & (L - 1), L_bits);
@@ -413,23 +400,20 @@ static uint8 *Tans_EncodeBytes(uint8 *dst, uint8 *dst_end, TansEntry *te, const
   forward_bits.Flush();
 
 #undef TANS_ENCODE
-  assert(backward_bits.pos_ == 63);
-  assert(forward_bits.pos_ == 63);
+  size_t forward_bytes = forward_bits.GetFinalPtr() - buf;
+  size_t backward_bytes = buf_end - backward_bits.GetFinalPtr();
+  if (forward_bytes + backward_bytes > (size_t)max_bytes)
+    return -1;
+  Tans_PadStreamStart(buf, forward_bytes, 1, -forward_bits.totalb & 7);
+  Tans_PadStreamStart(buf_end - 1, backward_bytes, -1, -backward_bits.totalb & 7);
+
   // It will be decoded in the backwards direction,
   // so swap the order of the two buffers.
   // We've written it as FORWARD....BACKWARD but it needs
   // to be saved as BACKWARD....FORWARD.
-
-  size_t forward_bytes = forward_bits.ptr_ - dst;
-  size_t backward_bytes = dst_end - backward_bits.ptr_;
-
-  uint8 *temp = new uint8[backward_bytes];
-  memcpy(temp, backward_bits.ptr_, backward_bytes);
-  memmove(dst + backward_bytes, dst, forward_bytes);
-  memcpy(dst, temp, backward_bytes);
-  delete[] temp;
-
-  return dst + forward_bytes + backward_bytes;
+  memcpy(dst, buf_end - backward_bytes, backward_bytes);
+  memcpy(dst + backward_bytes, buf, forward_bytes);
+  return (int)(forward_bytes + backward_bytes);
 }
 
 int EncodeArrayU8_tANS(uint8 *dst, uint8 *dst_end, const uint8 *src, int src_size, const HistoU8 &histo, float speed_tradeoff, int platforms, float *cost_ptr) {
@@ -494,17 +478,26 @@ int EncodeArrayU8_tANS(uint8 *dst, uint8 *dst_end, const uint8 *src, int src_siz
   uint16 te_data[1 << 11];
   Tans_InitTable(te, te_data, weights, weights_size, L_bits);
 
-  uint forward_bits, backward_bits;
-  Tans_GetEncodedBitCount(te, src, src_size, L_bits, &forward_bits, &backward_bits);
-
-  int total_size = table_size + BITSUP(forward_bits) + BITSUP(backward_bits);
-  if (total_size >= cost_left || total_size + cost >= *cost_ptr)
+  // Largest encoding that would still be accepted, anything that fits is
+  // written straight to dst.
+  int max_bytes = std::min<int>(cost_left - 1, dst_end - dst - 8) - table_size;
+  if (max_bytes <= 0)
     return -1;
-  if (total_size + 8 > dst_end - dst)
+
+  // Leave enough room between the two streams for the writes that may land
+  // before the size check kicks in.
+  // The scratch is kept per thread and only grows, so repeated trials
+  // don't allocate.
+  static thread_local std::vector<uint8> tans_scratch;
+  if (tans_scratch.size() < (size_t)max_bytes + 256)
+    tans_scratch.resize((size_t)max_bytes + 256);
+  uint8 *buf = tans_scratch.data();
+  int n = Tans_EncodeBytes(dst + table_size, buf, buf + max_bytes + 256, te, src, src_size, L_bits, max_bytes);
+  if (n < 0)
     return -1;
 
+  int total_size = table_size + n;
   *cost_ptr = cost + total_size;
-
   memcpy(dst, table, table_size);
-  return Tans_EncodeBytes(dst + table_size, dst_end, te, src, src_size, L_bits, forward_bits, backward_bits) - dst;
+  return total_size;
 }
@@ -21,6 +21,7 @@ void *LzScratchBlock::Allocate(int wanted_size) {
   if (!ptr) {
     size = wanted_size;
     ptr = new uint8[wanted_size];
+    Profile_AddMemory(wanted_size);
   } else {
     assert(wanted_size <= size);
   }
@@ -28,6 +29,8 @@ void *LzScratchBlock::Allocate(int wanted_size) {
 }
 
 LzScratchBlock::~LzScratchBlock() {
+  if (ptr)
+    Profile_AddMemory(-size);
   delete[](uint8*)ptr;
 }
 
@@ -56,6 +59,17 @@ int GetHashBits(int src_len, int level, const CompressOptions *copts, int A, int
   return bits;
 }
 
+// Weight of decode time against compressed bytes in the cost of a choice.
+float GetSpeedTradeoff(int codec_id, const CompressOptions *copts) {
+  float bytes = copts->spaceSpeedTradeoffBytes * 0.00390625f;
+  switch (codec_id) {
+  case kCompressorKraken: return bytes * 0.0099999998f;
+  case kCompressorLeviathan: return bytes * 0.0024999999f;
+  case kCompressorMermaid: return bytes * 0.050000001f;
+  default: return bytes * 0.14f;
+  }
+}
+
 int GetCompressedBufferSizeNeeded(int size) {
   return size + 274 * ((size + 0x3FFFF) / 0x40000);
 }
@@ -120,6 +134,12 @@ uint8 *WriteBlockHdr(uint8 *dst, int compr_id, bool crc, bool keyframe, bool unc
   return dst + 2;
 }
 
+// Flags the keyframe block header at |blk| as the start of a new window so
+// the decoder doesn't let it reference the data before it.
+static void MarkNewWindow(uint8 *blk) {
+  blk[0] |= 0x10;
+}
+
 bool AreAllBytesEqual(const uint8 *data, size_t size) {
   if (size <= 1)
     return true;
@@ -185,12 +205,12 @@ int CompressQuantum(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls,
       if (AreAllBytesEqual(src, round_bytes)) {
         float memset_cost = kInvalidCost;
         int n = EncodeArrayU8_Memset(dst, dst_end, src, round_bytes, coder->entropy_opts, coder->speed_tradeoff, coder->platforms, &memset_cost);
-        src += round_bytes;
         dst += n;
         total_cost += memset_cost;
       } else {
         float lzcost = kInvalidCost;
         int chunk_type = -1, n;
+        ProfileScope profile(kProfilePhase_Parse, round_bytes, src);
         if (coder->codec_id == kCompressorLeviathan) {
           n = LeviathanDoCompress(coder, lztemp, mls, src, round_bytes, dst + 3, dst_end, offset + src - src_org, &chunk_type, &lzcost);
         } else if (coder->codec_id == kCompressorKraken) {
@@ -310,6 +330,7 @@ int Compress(LzCoder *coder, uint8 *src_in, uint8 *dst, int src_size, uint8 *src
       bytes_per_round = local_dictsize >> 1;
       if (coder->opts->makeLongRangeMatcher && lrm_org == NULL && coder->compression_level >= 5) {
         int lrmsize = bytes_per_round * ((total_window + bytes_per_round - 1) / bytes_per_round) - local_dictsize;
+        ProfileScope profile(kProfilePhase_LongRangeMatcher, total_window);
         lrm = LRM_AllocateCascade(src_window_base, lrmsize, lrm_step_size, lrm_hash_lookup_bits_base, 0, bytes_per_round, lrm_hash_length);
       }
     } else {
@@ -334,16 +355,20 @@ int Compress(LzCoder *coder, uint8 *src_in, uint8 *dst, int src_size, uint8 *src
       LRMTable lrm_table_buf, *lrm_table = NULL;
 
       if (lrm && dict_base > src_window_base) {
+        ProfileScope profile(kProfilePhase_LongRangeMatcher, 0);
         lrm_table = &lrm_table_buf;
         LRM_GetRanges(lrm, &lrm_table_buf, dict_base, src_cur);
       }
       MatchLenStorage *mls = MatchLenStorage::Create(round_bytes + 1, 8.0f);
       mls->window_base = src_cur;
 
-      if (coder->compression_level >= 6) {
-        FindMatchesSuffixTrie(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
-      } else {
-        FindMatchesHashBased(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
+      {
+        ProfileScope profile(kProfilePhase_MatchFinder, src_cur - dict_base + round_bytes);
+        if (coder->compression_level >= 6) {
+          FindMatchesSuffixTrie(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
+        } else {
+          FindMatchesHashBased(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
+        }
       }
 
       int n = CompressBlocks(coder, &lztemp, src_cur, dst, round_bytes, dict_base, cur_window_base, lrm_table, mls);
@@ -364,6 +389,13 @@ int Compress(LzCoder *coder, uint8 *src_in, uint8 *dst, int src_size, uint8 *src
   return dst - dst_org;
 }
 
+// Builds a cascade over |ref| with the parameters Compress uses for its own
+// long range matcher. Bind it to the copy of |ref| at src_window_base with
+// LRM_BindCascade before passing it to CompressBlock.
+LRMCascade *CreateReferenceCascade(uint8 *ref, int ref_size) {
+  return LRM_AllocateReferenceCascade(ref, ref_size, lrm_step_size, lrm_hash_lookup_bits_base, 0x200000, lrm_hash_length);
+}
+
 const CompressOptions *GetDefaultCompressOpts(int level) {
   static const CompressOptions compress_options_level5 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 4, 0, 0x400000, 1, 0 };
   static const CompressOptions compress_options_level4 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 2, 0, 0x400000, 1, 0 };
@@ -373,7 +405,7 @@ const CompressOptions *GetDefaultCompressOpts(int level) {
 
 int CompressBlock_Leviathan(uint8 *src_in, uint8 *dst_in, int src_size, int level,
                             const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
-  LzCoder coder = { 0 };
+  LzCoder coder = {};
   if (!compressopts)
     compressopts = GetDefaultCompressOpts(level);
 
@@ -383,12 +415,14 @@ int CompressBlock_Leviathan(uint8 *src_in, uint8 *dst_in, int src_size, int leve
   coder.last_chunk_type = -1;
   SetupEncoder_Leviathan(&coder, src_size, level, compressopts, src_window_base, src_in);
   int n = Compress(&coder, src_in, dst_in, src_size, src_window_base, lrm);
+  if (coder.hasher)
+    coder.free_hasher(coder.hasher);
   return n;
 }
 
 int CompressBlock_Kraken(uint8 *src_in, uint8 *dst_in, int src_size, int level,
                          const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
-  LzCoder coder = { 0 };
+  LzCoder coder = {};
   if (!compressopts)
     compressopts = GetDefaultCompressOpts(level);
 
@@ -398,12 +432,14 @@ int CompressBlock_Kraken(uint8 *src_in, uint8 *dst_in, int src_size, int level,
   coder.last_chunk_type = -1;
   SetupEncoder_Kraken(&coder, src_size, level, compressopts, src_window_base, src_in);
   int n = Compress(&coder, src_in, dst_in, src_size, src_window_base, lrm);
+  if (coder.hasher)
+    coder.free_hasher(coder.hasher);
   return n;
 }
 
 int CompressBlock_Mermaid(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
                           const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
-  LzCoder coder = { 0 };
+  LzCoder coder = {};
   if (!compressopts)
     compressopts = GetDefaultCompressOpts(level);
 
@@ -413,12 +449,14 @@ int CompressBlock_Mermaid(int codec_id, uint8 *src_in, uint8 *dst_in, int src_si
   coder.last_chunk_type = -1;
   SetupEncoder_Mermaid(&coder, codec_id, src_size, level, compressopts, src_window_base, src_in);
   int n = Compress(&coder, src_in, dst_in, src_size, src_window_base, lrm);
+  if (coder.hasher)
+    coder.free_hasher(coder.hasher);
   return n;
 }
 
 
-int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
-                  const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+static int CompressBlockNoReset(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                                const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
   switch (codec_id) {
   case kCompressorKraken: return CompressBlock_Kraken(src_in, dst_in, src_size, level, compressopts, src_window_base, lrm);
   case kCompressorLeviathan: return CompressBlock_Leviathan(src_in, dst_in, src_size, level, compressopts, src_window_base, lrm);
@@ -427,6 +465,184 @@ int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int
   default:
     return -1;
   }
+}
+
+// Seek chunks are whole 256k blocks since the decoder only reads block
+// headers on those boundaries.
+int GetSeekChunkLen(const CompressOptions *copts) {
+  return std::max((copts->seekChunkLen + 0x3FFFF) & ~0x3FFFF, 0x40000);
+}
 
+int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                  const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+  if (!compressopts || !compressopts->seekChunkReset)
+    return CompressBlockNoReset(codec_id, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm);
+
+  // Every seek chunk is compressed without history so it starts with a
+  // keyframe and can be decoded, or reused by RecompressBlock, on its own.
+  int chunk_len = GetSeekChunkLen(compressopts);
+  uint8 *dst = dst_in;
+  for (int pos = 0; pos < src_size; pos += chunk_len) {
+    int n = CompressBlockNoReset(codec_id, src_in + pos, dst, std::min(chunk_len, src_size - pos), level, compressopts, NULL, NULL);
+    if (n < 0)
+      return -1;
+    if (pos != 0)
+      MarkNewWindow(dst);
+    dst += n;
+  }
+  return dst - dst_in;
 }
 
+struct OldQuantum {
+  int comp_pos;
+  int comp_size;
+  bool keyframe;
+};
+
+// Finds the compressed extent of every 256k block of a stream written by
+// CompressBlock. Fails on anything else, including the LZNA and Bitknit
+// formats whose blocks carry decoder state.
+static bool ParseQuanta(const uint8 *comp, int comp_size, int src_size, std::vector<OldQuantum> *quanta) {
+  int pos = 0;
+  for (int off = 0; off < src_size; off += 0x40000) {
+    int n = std::min(src_size - off, 0x40000), p = pos + 2;
+    if (comp_size - pos < 2 || (comp[pos] & 0x2F) != 0xC)
+      return false;
+    int decoder_type = comp[pos + 1] & 0x7F;
+    if (decoder_type != 6 && decoder_type != 10 && decoder_type != 12)
+      return false;
+    if (comp[pos] & 0x40) {
+      p += n;
+    } else {
+      if (comp_size - p < 3)
+        return false;
+      uint32 v = comp[p] << 16 | comp[p + 1] << 8 | comp[p + 2];
+      if ((v & 0x3FFFF) != 0x3FFFF)
+        p += 3 + (comp[pos + 1] >> 7) * 3 + (v & 0x3FFFF) + 1;
+      else if ((v >> 18) == 1)
+        p += 4;
+      else
+        return false;
+    }
+    if (p > comp_size)
+      return false;
+    OldQuantum q = { pos, p - pos, (comp[pos] & 0x80) != 0 };
+    quanta->push_back(q);
+    pos = p;
+  }
+  return pos == comp_size;
+}
+
+static uint64 HashQuantum(const uint8 *p, int size) {
+  uint64 h = size;
+  int i = 0;
+  for (; i + 8 <= size; i += 8)
+    h = (h ^ *(uint64*)(p + i)) * 0x9E3779B97F4A7C15ull;
+  for (; i < size; i++)
+    h = (h ^ p[i]) * 0x9E3779B97F4A7C15ull;
+  return h ^ (h >> 29);
+}
+
+struct QuantumHash {
+  uint64 hash;
+  int index;
+  bool operator<(const QuantumHash &o) const { return hash < o.hash; }
+};
+
+// Compresses |src_in| reusing the compressed bytes of |old_src|/|old_comp|
+// where possible. A 256k block is copied through when it is identical to the
+// old block at the same position and nothing before it changed, when it
+// equals an old keyframe block anywhere in the stream, which decodes
+// independently of its position, or when it continues a chain of copied
+// blocks that started at such a keyframe. The other blocks are compressed in
+// runs that see up to maxLocalDictionarySize of history, so the work scales
+// with the size of the change. Keyframes only occur at seek chunk starts, so
+// inputs meant to be patched should be compressed with seekChunkReset.
+int RecompressBlock(int codec_id, const uint8 *old_src, int old_src_size, const uint8 *old_comp, int old_comp_size,
+                    uint8 *src_in, uint8 *dst_in, int src_size, int level, const CompressOptions *compressopts) {
+  std::vector<OldQuantum> quanta;
+  if (!ParseQuanta(old_comp, old_comp_size, old_src_size, &quanta))
+    return CompressBlock(codec_id, src_in, dst_in, src_size, level, compressopts, NULL, NULL);
+
+  if (!compressopts)
+    compressopts = GetDefaultCompressOpts(level);
+  CompressOptions run_opts = *compressopts;
+  run_opts.seekChunkReset = 0;
+  int chunk_len = compressopts->seekChunkReset ? GetSeekChunkLen(compressopts) : INT_MAX;
+  int history = compressopts->maxLocalDictionarySize > 0 ? compressopts->maxLocalDictionarySize : 0x400000;
+
+  std::vector<QuantumHash> keyframes;
+  for (size_t i = 0; i < quanta.size(); i++) {
+    if (quanta[i].keyframe) {
+      int off = (int)i * 0x40000;
+      QuantumHash qh = { HashQuantum(old_src + off, std::min(old_src_size - off, 0x40000)), (int)i };
+      keyframes.push_back(qh);
+    }
+  }
+  std::sort(keyframes.begin(), keyframes.end());
+
+  int same_prefix = 0, same_max = std::min(old_src_size, src_size);
+  while (same_prefix < same_max && old_src[same_prefix] == src_in[same_prefix])
+    same_prefix++;
+
+  uint8 *dst = dst_in;
+  // |chain| is the old block that the previous output block was copied from,
+  // |last_keyframe| the start of the last keyframe in the output.
+  int run_start = -1, chain = -1, last_keyframe = 0;
+  for (int off = 0; ; off += 0x40000) {
+    int n = std::min(src_size - off, 0x40000);
+    int reuse = -1;
+    if (n > 0) {
+      int idx = off >> 18;
+      if (off + n <= same_prefix && idx < (int)quanta.size() && std::min(old_src_size - off, 0x40000) == n) {
+        reuse = idx;
+      } else if (chain >= 0 && chain + 1 < (int)quanta.size() &&
+                 std::min(old_src_size - (chain + 1) * 0x40000, 0x40000) == n &&
+                 !memcmp(old_src + (chain + 1) * 0x40000, src_in + off, n)) {
+        // Blocks only reference data back to the last keyframe, which
+        // the chain of copied blocks reproduced.
+        reuse = chain + 1;
+      } else {
+        QuantumHash qh = { HashQuantum(src_in + off, n), 0 };
+        for (auto it = std::lower_bound(keyframes.begin(), keyframes.end(), qh); it != keyframes.end() && it->hash == qh.hash; ++it) {
+          int old_off = it->index * 0x40000;
+          if (std::min(old_src_size - old_off, 0x40000) == n && !memcmp(old_src + old_off, src_in + off, n)) {
+            reuse = it->index;
+            break;
+          }
+        }
+      }
+    }
+    // Flush the pending run before a reused block, at a seek chunk boundary
+    // and at the end. The run doesn't look back past the last keyframe so
+    // the above holds for the output as well.
+    if (run_start >= 0 && (reuse >= 0 || n <= 0 || off % chunk_len == 0)) {
+      int window = std::max(std::max(run_start - history, last_keyframe), run_start - run_start % chunk_len);
+      int r = CompressBlockNoReset(codec_id, src_in + run_start, dst, std::min(off, src_size) - run_start, level, &run_opts, src_in + window, NULL);
+      if (r < 0)
+        return -1;
+      if (window == run_start) {
+        last_keyframe = run_start;
+        if (run_start != 0)
+          MarkNewWindow(dst);
+      }
+      dst += r;
+      run_start = -1;
+    }
+    if (n <= 0)
+      break;
+    chain = reuse;
+    if (reuse >= 0) {
+      memcpy(dst, old_comp + quanta[reuse].comp_pos, quanta[reuse].comp_size);
+      if (quanta[reuse].keyframe) {
+        last_keyframe = off;
+        if (off != 0)
+          MarkNewWindow(dst);
+      }
+      dst += quanta[reuse].comp_size;
+    } else if (run_start < 0) {
+      run_start = off;
+    }
+  }
+  return dst - dst_in;
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <vector>
 #include "compr_util.h"
+#include "compr_profile.h"
 
 struct MatchLenStorage;
 
@@ -77,6 +78,7 @@ struct LzCoder {
   const CompressOptions *opts;
   int quantum_blocksize;
   void *hasher;
+  void (*free_hasher)(void *hasher);
   int max_matches_to_consider;
   float speed_tradeoff;
   int entropy_opts;
@@ -101,17 +103,32 @@ int WriteLzOffsetBits(uint8 *dst, uint8 *dst_end, uint8 *u8_offs, uint32 *u32_of
 
 int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
                   const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm);
+int RecompressBlock(int codec_id, const uint8 *old_src, int old_src_size, const uint8 *old_comp, int old_comp_size,
+                    uint8 *src_in, uint8 *dst_in, int src_size, int level, const CompressOptions *compressopts);
+LRMCascade *CreateReferenceCascade(uint8 *ref, int ref_size);
+const CompressOptions *GetDefaultCompressOpts(int level);
+int GetCompressedBufferSizeNeeded(int size);
+bool AreAllBytesEqual(const uint8 *data, size_t size);
+int GetSeekChunkLen(const CompressOptions *copts);
 
 int GetHashBits(int src_len, int level, const CompressOptions *copts, int A, int B, int C, int D);
+float GetSpeedTradeoff(int codec_id, const CompressOptions *copts);
 void ConvertHistoToCost(const HistoU8 &src, uint *dst, int extra, int q=255);
 
 void SubtractBytes(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs);
 void SubtractBytesUnsafe(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs);
 
+template<typename T>
+void DestroyLzHasher(void *hasher) {
+  delete (T*)hasher;
+}
+
 template<typename T, int MaxPreload = 0x4000000>
 void CreateLzHasher(LzCoder *coder, const uint8 *src_base, const uint8 *src_start, int hash_bits, int min_match_len = 0) {
+  ProfileScope profile(kProfilePhase_HasherPreload, src_start - src_base);
   T *hasher = new T;
   coder->hasher = hasher;
+  coder->free_hasher = &DestroyLzHasher<T>;
   hasher->AllocateHash(hash_bits, min_match_len);
   if (src_start == src_base) {
     hasher->SetBaseWithoutPreload(src_start);
@@ -0,0 +1,70 @@
+#include "extract_manifest.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+
+// One line per file after the header, fields separated by tabs with the path last:
+// path_hash offset size bundle_signature content_hash bundle path
+static char const MANIFEST_HEADER[] = "bun-manifest 1";
+
+bool extract_manifest::load(std::filesystem::path const &path) {
+  entries.clear();
+  std::ifstream is(path, std::ios::binary);
+  if (!is) {
+    return true;
+  }
+
+  std::string line;
+  if (!std::getline(is, line) || line != MANIFEST_HEADER) {
+    return false;
+  }
+  while (std::getline(is, line)) {
+    uint64_t path_hash;
+    manifest_entry e;
+    int fields_end = 0;
+    if (sscanf(line.c_str(), "%" SCNx64 "\t%" SCNu32 "\t%" SCNu32 "\t%" SCNx64 "\t%" SCNx64 "\t%n", &path_hash,
+               &e.offset, &e.size, &e.bundle_signature, &e.content_hash, &fields_end) != 5 ||
+        !fields_end) {
+      entries.clear();
+      return false;
+    }
+    size_t tab = line.find('\t', fields_end);
+    if (tab == line.npos) {
+      entries.clear();
+      return false;
+    }
+    e.bundle = line.substr(fields_end, tab - fields_end);
+    e.path = line.substr(tab + 1);
+    entries[path_hash] = std::move(e);
+  }
+  return true;
+}
+
+bool extract_manifest::save(std::filesystem::path const &path) const {
+  std::filesystem::path tmp_path = path;
+  tmp_path += ".tmp";
+  {
+    FILE *f = fopen(tmp_path.string().c_str(), "wb");
+    if (!f) {
+      return false;
+    }
+    fprintf(f, "%s\n", MANIFEST_HEADER);
+    for (auto &[path_hash, e] : entries) {
+      fprintf(f, "%016" PRIx64 "\t%" PRIu32 "\t%" PRIu32 "\t%016" PRIx64 "\t%016" PRIx64 "\t%s\t%s\n", path_hash,
+              e.offset, e.size, e.bundle_signature, e.content_hash, e.bundle.c_str(), e.path.c_str());
+    }
+    bool written = !ferror(f);
+    if (fclose(f) != 0 || !written) {
+      return false;
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    std::filesystem::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+
+// What an earlier bun_extract_file run wrote into an output directory, keyed by path hash. A file is unchanged
+// if it still comes from the same range of a bundle whose signature matches, so it can be skipped without
+// reading the bundle at all. The content hash lets a changed bundle skip rewriting files that came out the same.
+struct manifest_entry {
+  std::string path;
+  std::string bundle;
+  uint32_t offset{};
+  uint32_t size{};
+  // Identifies the bundle's contents, the stored digest of a GGPK entry or the size and time of a bundle file.
+  uint64_t bundle_signature{};
+  // FNV-1a of the extracted file.
+  uint64_t content_hash{};
+};
+
+struct extract_manifest {
+  // Reads the manifest at path, leaving it empty if there is none. Returns false if the file is malformed.
+  bool load(std::filesystem::path const &path);
+  // Writes to a temporary file first so that an interrupted run keeps the previous manifest.
+  bool save(std::filesystem::path const &path) const;
+
+  std::unordered_map<uint64_t, manifest_entry> entries;
+};
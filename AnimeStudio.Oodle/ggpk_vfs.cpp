@@ -1,8 +1,10 @@
 #include "ggpk_vfs.h"
 
 #include <poe/util/utf.hpp>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
 
 struct GgpkVfs {
 	Vfs vfs;
@@ -10,6 +12,51 @@ struct GgpkVfs {
 	std::unique_ptr<poe::format::ggpk::parsed_ggpk> pack;
 };
 
+static ggpk::parsed_file const* find_file(GgpkVfs const* gvfs, char const* c_path) {
+	// Paths are nearly always ASCII and get lowercased into a stack buffer, anything else goes through the Unicode
+	// case mapping that the pack's lowercase names were made with.
+	char16_t ascii_buf[512];
+	std::u16string unicode_path;
+	std::u16string_view path;
+	size_t const n = strlen(c_path);
+	bool ascii = n <= std::size(ascii_buf);
+	for (size_t i = 0; ascii && i < n; ++i) {
+		char16_t ch = (unsigned char)c_path[i];
+		ascii = ch < 0x80;
+		ascii_buf[i] = (ch >= u'A' && ch <= u'Z') ? ch + (u'a' - u'A') : ch;
+	}
+	if (ascii) {
+		path = std::u16string_view(ascii_buf, n);
+	}
+	else {
+		unicode_path = poe::util::lowercase(poe::util::to_u16string(c_path));
+		path = unicode_path;
+	}
+
+	ggpk::parsed_directory const* dir = gvfs->pack->root_;
+	while (dir) {
+		size_t delim = path.find(u'/');
+		std::u16string_view head = path.substr(0, delim);
+		if (head.empty()) {
+			if (delim == std::u16string_view::npos) {
+				return nullptr;
+			}
+			path = path.substr(delim + 1);
+			continue;
+		}
+		auto* child = dir->find_child(head);
+		if (!child) {
+			return nullptr;
+		}
+		if (delim == std::u16string_view::npos) {
+			return child->is_directory_ ? nullptr : static_cast<ggpk::parsed_file const*>(child);
+		}
+		dir = child->is_directory_ ? static_cast<ggpk::parsed_directory const*>(child) : nullptr;
+		path = path.substr(delim + 1);
+	}
+	return nullptr;
+}
+
 std::shared_ptr<GgpkVfs> open_ggpk(std::filesystem::path ggpk_path, bool mmap_data) {
 	auto ret = std::make_shared<GgpkVfs>();
 	ret->path = ggpk_path;
@@ -19,40 +66,21 @@ std::shared_ptr<GgpkVfs> open_ggpk(std::filesystem::path ggpk_path, bool mmap_da
 	}
 
 	ret->vfs.open = [](Vfs* vfs, char const* c_path) -> VfsFile* {
-		auto* gvfs = reinterpret_cast<GgpkVfs*>(vfs);
-		ggpk::parsed_directory const* dir = gvfs->pack->root_;
-		std::u16string path = poe::util::lowercase(poe::util::to_u16string(c_path));
-		std::u16string_view tail(path);
-		while (!tail.empty() && dir) {
-			size_t delim = tail.find(u'/');
-			if (delim == 0) {
-				continue;
-			}
-			std::u16string_view head = tail.substr(0, delim);
-			bool next_found = false;
-			for (auto& child : dir->entries_) {
-				if (poe::util::lowercase(child->name_) == head) {
-					if (delim == std::string_view::npos) {
-						return (VfsFile*)dynamic_cast<ggpk::parsed_file const*>(child.get());
-					}
-					else {
-						dir = dynamic_cast<ggpk::parsed_directory const*>(child.get());
-						tail = tail.substr(delim + 1);
-						next_found = true;
-					}
-				}
-			}
-			if (!next_found) {
-				return nullptr;
-			}
-		}
-		return nullptr;
+		return (VfsFile*)find_file(reinterpret_cast<GgpkVfs*>(vfs), c_path);
 	};
 	ret->vfs.close = [](Vfs* vfs, VfsFile* file) {};
 	ret->vfs.size = [](Vfs*, VfsFile* file) -> int64_t {
 		auto* f = reinterpret_cast<ggpk::parsed_file const*>(file);
 		return f ? f->data_size_ : -1;
 	};
+	ret->vfs.stamp = [](Vfs*, VfsFile* file) -> uint64_t {
+		auto* f = reinterpret_cast<ggpk::parsed_file const*>(file);
+		uint64_t stamp = 0;
+		if (f) {
+			memcpy(&stamp, f->stored_digest_.data(), sizeof(stamp));
+		}
+		return stamp;
+	};
 
 	if (mmap_data) {
 		auto const read_via_mmap = [](Vfs* vfs, VfsFile* file, uint8_t* out, int64_t offset, int64_t size) -> int64_t {
@@ -86,4 +114,8 @@ std::shared_ptr<GgpkVfs> open_ggpk(std::filesystem::path ggpk_path, bool mmap_da
 
 Vfs* borrow_vfs(std::shared_ptr<GgpkVfs>& vfs) {
 	return vfs ? &vfs->vfs : nullptr;
+}
+
+ggpk::parsed_file const* ggpk_lookup(std::shared_ptr<GgpkVfs> const& vfs, char const* path) {
+	return vfs ? find_file(vfs.get(), path) : nullptr;
 }
\ No newline at end of file
@@ -10,4 +10,7 @@ namespace ggpk = poe::format::ggpk;
 struct GgpkVfs;
 
 std::shared_ptr<GgpkVfs> open_ggpk(std::filesystem::path path, bool mmap_data = false);
-Vfs* borrow_vfs(std::shared_ptr<GgpkVfs>& vfs);
\ No newline at end of file
+Vfs* borrow_vfs(std::shared_ptr<GgpkVfs>& vfs);
+
+// The pack entry of a file, for its data offset and stored digest, or nullptr if there is no such file.
+ggpk::parsed_file const* ggpk_lookup(std::shared_ptr<GgpkVfs> const& vfs, char const* path);
\ No newline at end of file
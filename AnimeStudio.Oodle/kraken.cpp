@@ -18,6 +18,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "stdafx.h"
 #include <sys/stat.h>
+#include <vector>
+#include "compr_calibrate.h"
+#include "compr_dictionary.h"
+#include "compr_estimate.h"
+#include "compr_profile.h"
+#include "compr_stream.h"
 
 #if defined _WIN32 || defined __CYGWIN__
 #ifdef OOZ_DYNAMIC
@@ -57,6 +63,11 @@ typedef struct KrakenHeader {
   // Whether to restart the decoder
   bool restart_decoder;
 
+  // Whether this block starts a new window, so it doesn't reference data
+  // before it. Only set on keyframes written past the start of a stream by
+  // CompressBlock with seekChunkReset and by RecompressBlock.
+  bool new_window;
+
   // Whether this block is uncompressed
   bool uncompressed;
 
@@ -501,8 +512,9 @@ void Kraken_Destroy(KrakenDecoder *kraken) {
 const byte *Kraken_ParseHeader(KrakenHeader *hdr, const byte *p) {
   int b = p[0];
   if ((b & 0xF) == 0xC) {
-    if (((b >> 4) & 3) != 0) return NULL;
+    if ((b >> 5) & 1) return NULL;
     hdr->restart_decoder = (b >> 7) & 1;
+    hdr->new_window = (b >> 4) & 1;
     hdr->uncompressed = (b >> 6) & 1;
     b = p[1];
     hdr->decoder_type = b & 0x7F;
@@ -4096,13 +4108,20 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
     dec->src_used = dec->dst_used = 0;
     return true;
   }
+
+  // A block flagged as a new window was encoded as if it was at the start of
+  // the stream. Other keyframes, including all reference encoder output, keep
+  // the whole buffer as their window.
+  byte *window_start = dst_start;
+  if (is_kraken_decoder && dec->hdr.new_window)
+    window_start = dst_start + offset;
   
   if (qhdr.compressed_size > (uint32)dst_bytes_left)
     return false;
 
   if (qhdr.compressed_size == 0) {
     if (qhdr.whole_match_distance != 0) {
-      if (qhdr.whole_match_distance > (uint32)offset)
+      if (qhdr.whole_match_distance > (uint32)(dst_start + offset - window_start))
         return false;
       Kraken_CopyWholeMatch(dst_start + offset, qhdr.whole_match_distance, dst_bytes_left);
     } else {
@@ -4125,7 +4144,7 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
   }
 
   if (dec->hdr.decoder_type == 6) {
-    n = Kraken_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, dst_start,
+    n = Kraken_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, window_start,
                          src, src + qhdr.compressed_size,
                          dec->scratch, dec->scratch + dec->scratch_size);
   } else if (dec->hdr.decoder_type == 5) {
@@ -4144,11 +4163,11 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
     n = (int)Bitknit_Decode(src, src + qhdr.compressed_size, dst_start + offset, dst_start + offset + dst_bytes_left, dst_start, (struct BitknitState*)dec->scratch);
 
   } else if (dec->hdr.decoder_type == 10) {
-    n = Mermaid_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, dst_start,
+    n = Mermaid_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, window_start,
                               src, src + qhdr.compressed_size,
                               dec->scratch, dec->scratch + dec->scratch_size);
   } else if (dec->hdr.decoder_type == 12) {
-    n = Leviathan_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, dst_start,
+    n = Leviathan_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, window_start,
                                 src, src + qhdr.compressed_size,
                                 dec->scratch, dec->scratch + dec->scratch_size);
   } else {
@@ -4195,6 +4214,73 @@ extern "C" {
 // The decompressor will write outside of the target buffer.
 #define SAFE_SPACE 64
 
+// Decoder for streams compressed against a preset dictionary. Block headers
+// are only parsed at 256k boundaries of the output offset, so the dictionary
+// is copied once to end on such a boundary, and each decode writes the output
+// after it and copies it out. Keeps the decoder and buffer between calls.
+struct KrakenDictionary {
+  KrakenDecoder *dec;
+  byte *buf;
+  size_t buf_size;
+  size_t dict_end;
+};
+
+KrakenDictionary *Kraken_CreateDictionary(const byte *dict, size_t dict_size) {
+  KrakenDictionary *kd = new KrakenDictionary;
+  kd->dec = Kraken_Create();
+  kd->dict_end = (dict_size + 0x3FFFF) & ~(size_t)0x3FFFF;
+  kd->buf_size = kd->dict_end + 0x4000 + SAFE_SPACE;
+  kd->buf = (byte*)MallocAligned(kd->buf_size, 16);
+  memcpy(kd->buf + kd->dict_end - dict_size, dict, dict_size);
+  return kd;
+}
+
+void Kraken_DestroyDictionary(KrakenDictionary *kd) {
+  Kraken_Destroy(kd->dec);
+  FreeAligned(kd->buf);
+  delete kd;
+}
+
+int Kraken_DecompressWithDictionary(KrakenDictionary *kd, const byte *src, size_t src_len, byte *dst, size_t dst_len) {
+  if (kd->dict_end + dst_len + SAFE_SPACE > 0x7fffffff)
+    return -1;
+  if (kd->buf_size < kd->dict_end + dst_len + SAFE_SPACE) {
+    size_t new_size = kd->dict_end + dst_len + dst_len / 2 + SAFE_SPACE;
+    byte *buf = (byte*)MallocAligned(new_size, 16);
+    memcpy(buf, kd->buf, kd->dict_end);
+    FreeAligned(kd->buf);
+    kd->buf = buf;
+    kd->buf_size = new_size;
+  }
+  KrakenDecoder *dec = kd->dec;
+  int offset = (int)kd->dict_end, end = (int)(kd->dict_end + dst_len);
+  while (offset != end) {
+    if (!Kraken_DecodeStep(dec, kd->buf, offset, end - offset, src, src_len))
+      return -1;
+    if (dec->src_used == 0)
+      return -1;
+    src += dec->src_used;
+    src_len -= dec->src_used;
+    offset += dec->dst_used;
+  }
+  if (src_len != 0)
+    return -1;
+  memcpy(dst, kd->buf + kd->dict_end, dst_len);
+  return (int)dst_len;
+}
+
+extern "C" {
+    OOZ_DLL_PUBLIC KrakenDictionary *Ooz_CreateDictionary(uint8_t const *dict, size_t dict_size) {
+        return Kraken_CreateDictionary(dict, dict_size);
+    }
+    OOZ_DLL_PUBLIC void Ooz_DestroyDictionary(KrakenDictionary *dict) {
+        Kraken_DestroyDictionary(dict);
+    }
+    OOZ_DLL_PUBLIC int Ooz_DecompressWithDictionary(KrakenDictionary *dict, uint8_t const *src_buf, int src_len, uint8_t *dst, size_t dst_size) {
+        return Kraken_DecompressWithDictionary(dict, src_buf, src_len, dst, dst_size);
+    }
+}
+
 #if !OOZ_BUILD_DLL
 
 void error(const char *s, const char *curfile = NULL) {
@@ -4227,10 +4313,15 @@ enum {
   kCompressor_Leviathan = 13,
 };
 
-bool arg_stdout, arg_force, arg_quiet, arg_dll;
+bool arg_stdout, arg_force, arg_quiet, arg_dll, arg_stream, arg_estimate;
 int arg_compressor = kCompressor_Kraken, arg_level = 4;
 char arg_direction;
 const char *verifyfolder;
+const char *arg_calibrate, *arg_cost_profile;
+const char *arg_dict, *arg_train;
+int arg_dict_size = 0x10000;
+// 1 prints the encoder profile as a table, 2 as JSON.
+int arg_profile;
 
 int ParseCmdLine(int argc, char *argv[]) {
   int i;
@@ -4255,9 +4346,38 @@ int ParseCmdLine(int argc, char *argv[]) {
       } else if (!strcmp(s, "verify")) {
         arg_direction = 't';
         continue;
+      } else if (!strncmp(s, "calibrate=", 10)) {
+        arg_calibrate = s + 10;
+        continue;
+      } else if (!strncmp(s, "cost-profile=", 13)) {
+        arg_cost_profile = s + 13;
+        continue;
+      } else if (!strncmp(s, "dict=", 5)) {
+        arg_dict = s + 5;
+        continue;
+      } else if (!strncmp(s, "train=", 6)) {
+        arg_train = s + 6;
+        continue;
+      } else if (!strncmp(s, "dict-size=", 10)) {
+        arg_dict_size = atoi(s + 10);
+        if (arg_dict_size <= 0)
+          return -1;
+        continue;
       } else if (!strcmp(s, "dll")) {
         arg_dll = true;
         continue;
+      } else if (!strcmp(s, "stream")) {
+        arg_stream = true;
+        continue;
+      } else if (!strcmp(s, "estimate")) {
+        arg_estimate = true;
+        continue;
+      } else if (!strcmp(s, "profile")) {
+        arg_profile = 1;
+        continue;
+      } else if (!strcmp(s, "profile=json")) {
+        arg_profile = 2;
+        continue;
       } else if (!strcmp(s, "kraken")) s = "mk";
       else if (!strcmp(s, "mermaid")) s = "mm";
       else if (!strcmp(s, "selkie")) s = "ms";
@@ -4384,14 +4504,71 @@ struct LRMCascade;
 int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
                   const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm);
 
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+bool WriteStreamOutput(void *ctx, const uint8 *data, size_t size) {
+  return !ctx || fwrite(data, 1, size, (FILE*)ctx) == size;
+}
+
+// Compresses the file a piece at a time so it never needs to fit in memory.
+// |out| may be NULL to only measure.
+void CompressFileStreaming(const char *filename, FILE *out) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) error("file open error", filename);
+  fseek64(f, 0, SEEK_END);
+  uint64 input_size = ftell64(f);
+  fseek64(f, 0, SEEK_SET);
+  if (out && fwrite(&input_size, 1, 8, out) != 8)
+    error("file write error");
+
+  StreamCompressor *sc = StreamCompressor_Create(arg_compressor, arg_level, NULL, WriteStreamOutput, out);
+  if (!sc) error("compress failed", filename);
+  std::vector<byte> buf(1 << 20);
+  int64_t start, end, freq;
+  QueryPerformanceCounter((LARGE_INTEGER*)&start);
+  size_t n;
+  while ((n = fread(buf.data(), 1, buf.size(), f)) != 0) {
+    if (!StreamCompressor_Write(sc, buf.data(), n))
+      error("compress failed", filename);
+  }
+  if (ferror(f) || StreamCompressor_GetBytesIn(sc) != input_size)
+    error("error reading", filename);
+  if (!StreamCompressor_Finish(sc))
+    error("compress failed", filename);
+  QueryPerformanceCounter((LARGE_INTEGER*)&end);
+  QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+  double seconds = (double)(end - start) / freq;
+  if (!arg_quiet)
+    fprintf(stderr, "%-20s: %8lld => %8lld (%.2f seconds, %.2f MB/s)\n", filename, (long long)input_size,
+            (long long)StreamCompressor_GetBytesOut(sc) + 8, seconds, input_size * 1e-6 / seconds);
+  StreamCompressor_Destroy(sc);
+  fclose(f);
+}
+
 int main(int argc, char *argv[]) {
   int64_t start, end, freq;
   int argi;
 
-  if (argc < 2 || 
-      (argi = ParseCmdLine(argc, argv)) < 0 || 
+  argi = (argc < 2) ? -1 : ParseCmdLine(argc, argv);
+
+  if (argi >= 0 && arg_calibrate) {
+    CostProfile profile;
+    if (!CalibrateCostProfile(&profile, !arg_quiet))
+      error("calibration failed");
+    if (!SaveCostProfile(arg_calibrate, &profile))
+      error("file write error", arg_calibrate);
+    return 0;
+  }
+
+  if (argi < 0 ||
       argi >= argc ||  // no files
-      (arg_direction != 'b' && (argc - argi) > 2) ||  // too many files
+      (arg_direction != 'b' && !arg_train && !arg_estimate && (argc - argi) > 2) ||  // too many files
       (arg_direction == 't' && (argc - argi) != 2)     // missing argument for verify
       ) {
     fprintf(stderr, "ooz v7.1 - compressor by Rarten\n\n"
@@ -4406,11 +4583,62 @@ int main(int argc, char *argv[]) {
       " --verify=<folder>        verify with files in this folder\n"
       " -<1-9> --level=<-4..10>  compression level\n"
       " -m<k>                    [k|m|s|l|h] compressor selection\n"
-      " --kraken --mermaid --selkie --leviathan --hydra    compressor selection\n\n"
+      " --kraken --mermaid --selkie --leviathan --hydra    compressor selection\n"
+      " --calibrate=<file>       measure decode speed on this machine and write a cost profile\n"
+      " --cost-profile=<file>    tune speed/ratio decisions with a profile from --calibrate\n"
+      " --dict=<file>            compress or decompress with a preset dictionary\n"
+      " --train=<file>           build a dictionary from the input files\n"
+      " --dict-size=<bytes>      dictionary size for --train (default 65536)\n"
+      " --stream                 compress in bounded memory, for inputs of any size\n"
+      " --estimate               predict compressed size and decode time of each compressor\n"
+      " --profile[=json]         print the time and memory of each encoder phase\n\n"
       "(Warning! not fuzz safe, so please trust the input)\n"
       );
     return 1;
   }
+
+  if (arg_train) {
+    std::vector<byte> samples;
+    std::vector<int> sample_sizes;
+    for (; argi < argc; argi++) {
+      int size;
+      byte *input = load_file(argv[argi], &size);
+      samples.insert(samples.end(), input, input + size);
+      sample_sizes.push_back(size);
+      delete[] input;
+    }
+    std::vector<byte> dict(arg_dict_size);
+    int dict_size = TrainDictionary(samples.data(), sample_sizes.data(), (int)sample_sizes.size(), dict.data(), arg_dict_size, 1024);
+    if (dict_size < 0)
+      error("training failed");
+    FILE *f = fopen(arg_train, "wb");
+    if (!f || fwrite(dict.data(), 1, dict_size, f) != dict_size || fclose(f) != 0)
+      error("file write error", arg_train);
+    if (!arg_quiet)
+      fprintf(stderr, "%d samples, %d bytes => %d byte dictionary\n", (int)sample_sizes.size(), (int)samples.size(), dict_size);
+    return 0;
+  }
+
+  if (arg_estimate) {
+    fprintf(stderr, "estimated sizes are typically within %d%%..+%d%% of the actual size\n",
+            kEstimateErrorLowPercent, kEstimateErrorHighPercent);
+    for (; argi < argc; argi++) {
+      int input_size;
+      byte *input = load_file(argv[argi], &input_size);
+      CompressEstimate est[kMaxCompressEstimates];
+      int n = EstimateCompression(input, input_size, arg_level, NULL, est);
+      fprintf(stderr, "%-20s: %8d", argv[argi], input_size);
+      for (int i = 0; i < n; i++) {
+        const char *name = est[i].codec_id == kCompressor_Kraken ? "kraken" : est[i].codec_id == kCompressor_Mermaid ? "mermaid" :
+                           est[i].codec_id == kCompressor_Selkie ? "selkie" : "leviathan";
+        fprintf(stderr, "  %s %lld (%.0f)", name, (long long)est[i].compressed_size, est[i].decode_time);
+      }
+      fprintf(stderr, "\n");
+      delete[] input;
+    }
+    return 0;
+  }
+
   bool write_mode = (argi + 1 < argc) && (arg_direction != 't' && arg_direction != 'b');
 
   if (!arg_force && write_mode) {
@@ -4421,6 +4649,48 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  int dict_size = 0;
+  byte *dict = NULL;
+  KrakenDictionary *kdict = NULL;
+  if (arg_dict) {
+    if (arg_dll)
+      error("--dict can't be used with --dll");
+    dict = load_file(arg_dict, &dict_size);
+    kdict = Kraken_CreateDictionary(dict, dict_size);
+  }
+
+  if (arg_cost_profile) {
+    CostProfile profile;
+    if (!LoadCostProfile(arg_cost_profile, &profile))
+      error("invalid cost profile", arg_cost_profile);
+    SetCostProfile(&profile);
+  }
+
+  if (arg_profile) {
+    if (arg_direction != 'z' || arg_dll)
+      error("--profile only works for compression without --dll");
+    Profile_Enable(true);
+  }
+
+  if (arg_stream) {
+    if (arg_direction != 'z' || arg_dll || arg_dict || verifyfolder)
+      error("--stream only works for compression without --dll, --dict or --verify");
+    FILE *out = arg_stdout ? stdout : NULL;
+    if (write_mode) {
+      out = fopen(argv[argi + 1], "wb");
+      if (!out) error("file open for write error", argv[argi + 1]);
+    }
+    Profile_Reset();
+    CompressFileStreaming(argv[argi], out);
+    if (arg_profile)
+      Profile_Print(stderr, arg_profile == 2);
+    if (out && fflush(out) != 0)
+      error("file write error");
+    if (out && out != stdout)
+      fclose(out);
+    return 0;
+  }
+
   int nverify = 0;
 
   for (; argi < argc; argi++) {
@@ -4440,10 +4710,11 @@ int main(int argc, char *argv[]) {
       if (!output) error("memory error", curfile);
       *(uint64*)output = input_size;
       QueryPerformanceCounter((LARGE_INTEGER*)&start);
+      Profile_Reset();
       if (arg_dll) {
         outbytes = OodLZ_Compress(arg_compressor, input, input_size, output + 8, arg_level, 0, 0, 0, 0, 0);
       } else {
-        outbytes = CompressBlock(arg_compressor, input, output + 8, input_size, arg_level, 0, 0, 0);
+        outbytes = CompressBlockWithDictionary(arg_compressor, dict, dict_size, input, output + 8, input_size, arg_level, 0);
       }
       if (outbytes < 0) error("compress failed", curfile);
       outbytes += 8;
@@ -4452,6 +4723,8 @@ int main(int argc, char *argv[]) {
       double seconds = (double)(end - start) / freq;
       if (!arg_quiet)
         fprintf(stderr, "%-20s: %8d => %8d (%.2f seconds, %.2f MB/s)\n", argv[argi], input_size, outbytes, seconds, input_size * 1e-6 / seconds);
+      if (arg_profile)
+        Profile_Print(stderr, arg_profile == 2);
     } else {
       if (arg_dll)
         LoadLib();
@@ -4470,6 +4743,8 @@ int main(int argc, char *argv[]) {
 
       if (arg_dll) {
         outbytes = OodLZ_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+      } else if (kdict) {
+        outbytes = Kraken_DecompressWithDictionary(kdict, input + hdrsize, input_size - hdrsize, output, unpacked_size);
       } else {
         outbytes = Kraken_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size);
       }
@@ -4517,6 +4792,10 @@ int main(int argc, char *argv[]) {
     delete[] output;
   }
 
+  if (kdict)
+    Kraken_DestroyDictionary(kdict);
+  delete[] dict;
+
   if (nverify)
     fprintf(stderr, "%d files verified OK!\n", nverify);
   return 0;
@@ -13,6 +13,7 @@ struct raw_entry {
     chunk_tag tag_;
     uint64_t offset_;
     std::u16string name_;
+    std::u16string name_lower_;
     poe::util::murmur2_32_digest name_hash_;
     poe::util::sha256_digest stored_digest_;
 
@@ -54,6 +55,7 @@ std::unique_ptr<parsed_file> index_builder::index_file(raw_entry const &e) {
     auto ret = std::make_unique<parsed_file>();
     ret->offset_ = e.offset_;
     ret->name_ = e.name_;
+    ret->name_lower_ = e.name_lower_;
     ret->stored_digest_ = e.stored_digest_;
     ret->data_offset_ = info->data_offset_;
     ret->data_size_ = info->data_size_;
@@ -69,7 +71,9 @@ std::unique_ptr<parsed_directory> index_builder::index_directory(raw_entry const
     auto dir_obj = std::make_unique<parsed_directory>();
     dir_obj->offset_ = e.offset_;
     dir_obj->name_ = e.name_;
+    dir_obj->name_lower_ = e.name_lower_;
     dir_obj->stored_digest_ = e.stored_digest_;
+    dir_obj->is_directory_ = true;
 
     {
         size_t child_count = info->hashes_.size();
@@ -83,10 +87,54 @@ std::unique_ptr<parsed_directory> index_builder::index_directory(raw_entry const
             dir_obj->entries_.push_back(std::move(child_obj));
         }
     }
+    dir_obj->build_child_table();
 
     return dir_obj;
 }
 
+static poe::util::murmur2_32_digest hash_lower_name(std::u16string_view name_lower) {
+    return poe::util::oneshot_murmur2_32(reinterpret_cast<std::byte const *>(name_lower.data()), name_lower.size() * 2);
+}
+
+void parsed_directory::build_child_table() {
+    size_t table_size = 1;
+    while (table_size < entries_.size() * 2) {
+        table_size *= 2;
+    }
+    child_table_.assign(table_size, child_slot{0, UINT32_MAX});
+    for (uint32_t i = 0; i < entries_.size(); ++i) {
+        auto name_hash = hash_lower_name(entries_[i]->name_lower_);
+        for (size_t slot = name_hash & (table_size - 1);; slot = (slot + 1) & (table_size - 1)) {
+            auto &s = child_table_[slot];
+            if (s.index_ == UINT32_MAX) {
+                s = child_slot{name_hash, i};
+                break;
+            }
+            // Of children whose names only differ in case the first one is found.
+            if (s.name_hash_ == name_hash && entries_[s.index_]->name_lower_ == entries_[i]->name_lower_) {
+                break;
+            }
+        }
+    }
+}
+
+parsed_entry const *parsed_directory::find_child(std::u16string_view name_lower) const {
+    if (child_table_.empty()) {
+        return nullptr;
+    }
+    size_t const mask = child_table_.size() - 1;
+    auto name_hash = hash_lower_name(name_lower);
+    for (size_t slot = name_hash & mask;; slot = (slot + 1) & mask) {
+        auto &s = child_table_[slot];
+        if (s.index_ == UINT32_MAX) {
+            return nullptr;
+        }
+        if (s.name_hash_ == name_hash && entries_[s.index_]->name_lower_ == name_lower) {
+            return entries_[s.index_].get();
+        }
+    }
+}
+
 std::unique_ptr<parsed_entry> index_builder::index_entry(uint64_t offset) {
     auto raw = entries_.find(offset);
     if (raw == entries_.end()) {
@@ -185,6 +233,7 @@ std::unique_ptr<parsed_ggpk> index_ggpk(std::filesystem::path pack_path) {
                 entry.tag_ = tag;
                 entry.offset_ = offset;
                 entry.name_ = std::move(name);
+                entry.name_lower_ = std::move(name_lower);
                 entry.name_hash_ = name_hash;
                 entry.stored_digest_ = digest;
                 entry.info_ = std::move(info);
@@ -9,6 +9,7 @@
 #include <array>
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace poe::format::ggpk {
@@ -35,8 +36,10 @@ struct parsed_entry {
 
     uint64_t offset_{};
     std::u16string name_;
+    std::u16string name_lower_;
     poe::util::murmur2_32_digest name_hash_;
     poe::util::sha256_digest stored_digest_;
+    bool is_directory_{};
 
     struct parsed_directory *parent_{};
 };
@@ -48,6 +51,17 @@ struct parsed_file : parsed_entry {
 
 struct parsed_directory : parsed_entry {
     std::vector<std::unique_ptr<parsed_entry>> entries_;
+
+    // Finds the child with the given lowercase name, nullptr if there is none.
+    parsed_entry const *find_child(std::u16string_view name_lower) const;
+
+    // Open-addressed table of children keyed by the murmur2 hash of their lowercase names, built by index_ggpk.
+    struct child_slot {
+        poe::util::murmur2_32_digest name_hash_;
+        uint32_t index_;
+    };
+    std::vector<child_slot> child_table_;
+    void build_child_table();
 };
 
 struct parsed_ggpk {
@@ -0,0 +1,600 @@
+#include "path_match.h"
+
+#include <algorithm>
+#include <map>
+
+namespace {
+using char_set = std::bitset<256>;
+
+size_t const UNBOUNDED = SIZE_MAX;
+// Largest count accepted in a {n,m} quantifier, each repetition is a copy of the atom in the NFA.
+size_t const MAX_REPEAT = 64;
+
+/* Partially built NFA with a start state and the outputs that still need to be connected to whatever follows.
+*/
+struct frag {
+	uint32_t start;
+	std::vector<std::pair<uint32_t, bool>> outs;
+};
+
+struct nfa_builder {
+	path_matcher& m_;
+
+	uint32_t add(path_matcher::nfa_kind kind, char_set const& chars = {}) {
+		m_.nfa_.push_back({kind, chars, 0, 0});
+		return (uint32_t)m_.nfa_.size() - 1;
+	}
+
+	void patch(frag const& f, uint32_t target) {
+		for (auto& [state, second] : f.outs) {
+			(second ? m_.nfa_[state].out1_ : m_.nfa_[state].out_) = target;
+		}
+	}
+
+	frag empty() {
+		uint32_t s = add(path_matcher::nfa_kind::Split);
+		return {s, {{s, false}, {s, true}}};
+	}
+
+	frag chars(char_set const& set) {
+		uint32_t s = add(path_matcher::nfa_kind::Chars, set);
+		return {s, {{s, false}}};
+	}
+
+	frag cat(frag a, frag b) {
+		patch(a, b.start);
+		return {a.start, std::move(b.outs)};
+	}
+
+	frag alt(frag a, frag b) {
+		uint32_t s = add(path_matcher::nfa_kind::Split);
+		m_.nfa_[s].out_ = a.start;
+		m_.nfa_[s].out1_ = b.start;
+		a.outs.insert(a.outs.end(), b.outs.begin(), b.outs.end());
+		return {s, std::move(a.outs)};
+	}
+
+	frag star(frag a) {
+		uint32_t s = add(path_matcher::nfa_kind::Split);
+		m_.nfa_[s].out_ = a.start;
+		patch(a, s);
+		return {s, {{s, true}}};
+	}
+
+	frag plus(frag a) {
+		uint32_t s = add(path_matcher::nfa_kind::Split);
+		m_.nfa_[s].out_ = a.start;
+		patch(a, s);
+		return {a.start, {{s, true}}};
+	}
+
+	frag opt(frag a) {
+		uint32_t s = add(path_matcher::nfa_kind::Split);
+		m_.nfa_[s].out_ = a.start;
+		a.outs.push_back({s, true});
+		return {s, std::move(a.outs)};
+	}
+
+	void finish(frag const& f) {
+		patch(f, add(path_matcher::nfa_kind::Match));
+		m_.pattern_starts_.push_back(f.start);
+	}
+};
+
+char_set single(uint8_t c) {
+	char_set set;
+	set.set(c);
+	return set;
+}
+
+char_set range(uint8_t lo, uint8_t hi) {
+	char_set set;
+	for (int c = lo; c <= hi; ++c) {
+		set.set(c);
+	}
+	return set;
+}
+
+char_set digits() { return range('0', '9'); }
+char_set word() { return range('a', 'z') | range('A', 'Z') | digits() | single('_'); }
+char_set space() { return range('\t', '\r') | single(' '); }
+
+struct regex_parser {
+	nfa_builder b_;
+	std::string_view p_;
+	size_t pos_ = 0;
+	bool ok_ = true;
+
+	bool more() const { return pos_ < p_.size(); }
+	char peek() const { return p_[pos_]; }
+
+	frag fail() {
+		ok_ = false;
+		return b_.empty();
+	}
+
+	frag parse_alt() {
+		frag f = parse_concat();
+		while (ok_ && more() && peek() == '|') {
+			++pos_;
+			f = b_.alt(std::move(f), parse_concat());
+		}
+		return f;
+	}
+
+	frag parse_concat() {
+		frag f = b_.empty();
+		while (ok_ && more() && peek() != '|' && peek() != ')') {
+			f = b_.cat(std::move(f), parse_repeat());
+		}
+		return f;
+	}
+
+	bool parse_count(size_t& n) {
+		size_t start = pos_;
+		n = 0;
+		while (more() && peek() >= '0' && peek() <= '9') {
+			n = (std::min)(n * 10 + (peek() - '0'), MAX_REPEAT + 1);
+			++pos_;
+		}
+		return pos_ != start;
+	}
+
+	// Parses "{n}", "{n,}" or "{n,m}".
+	bool parse_bounds(size_t& n, size_t& m) {
+		++pos_;
+		if (!parse_count(n)) {
+			return false;
+		}
+		m = n;
+		if (more() && peek() == ',') {
+			++pos_;
+			if (!parse_count(m)) {
+				m = UNBOUNDED;
+			}
+		}
+		if (!more() || peek() != '}') {
+			return false;
+		}
+		++pos_;
+		return n <= MAX_REPEAT && (m == UNBOUNDED || (m >= n && m <= MAX_REPEAT));
+	}
+
+	// Parses the atom at atom_pos again to get another copy of its NFA.
+	frag reparse_atom(size_t atom_pos) {
+		size_t pos = pos_;
+		pos_ = atom_pos;
+		frag f = parse_atom();
+		pos_ = pos;
+		return f;
+	}
+
+	frag repeat(frag first, size_t atom_pos, size_t n, size_t m) {
+		size_t copies = m == UNBOUNDED ? n + 1 : m;
+		if (copies == 0) {
+			return b_.empty();
+		}
+		std::vector<frag> atoms;
+		atoms.push_back(std::move(first));
+		while (atoms.size() < copies) {
+			atoms.push_back(reparse_atom(atom_pos));
+		}
+		frag f = b_.empty();
+		for (size_t i = 0; i < n; ++i) {
+			f = b_.cat(std::move(f), std::move(atoms[i]));
+		}
+		if (m == UNBOUNDED) {
+			return b_.cat(std::move(f), b_.star(std::move(atoms[n])));
+		}
+		for (size_t i = n; i < m; ++i) {
+			f = b_.cat(std::move(f), b_.opt(std::move(atoms[i])));
+		}
+		return f;
+	}
+
+	frag parse_repeat() {
+		size_t atom_pos = pos_;
+		frag f = parse_atom();
+		if (!ok_ || !more()) {
+			return f;
+		}
+		char c = peek();
+		if (c == '*' || c == '+' || c == '?') {
+			++pos_;
+			f = c == '*' ? b_.star(std::move(f)) : c == '+' ? b_.plus(std::move(f)) : b_.opt(std::move(f));
+		}
+		else if (c == '{') {
+			size_t n, m;
+			if (!parse_bounds(n, m)) {
+				return fail();
+			}
+			f = repeat(std::move(f), atom_pos, n, m);
+		}
+		else {
+			return f;
+		}
+		// Laziness changes which match is found, not whether there is one.
+		if (more() && peek() == '?') {
+			++pos_;
+		}
+		if (more() && (peek() == '*' || peek() == '+' || peek() == '?' || peek() == '{')) {
+			return fail();
+		}
+		return f;
+	}
+
+	// Parses the escape after a backslash into the set of characters it matches.
+	bool parse_escape(char_set& set, bool in_class) {
+		if (!more()) {
+			return false;
+		}
+		char e = p_[pos_++];
+		switch (e) {
+		case 'd': set = digits(); return true;
+		case 'D': set = ~digits(); return true;
+		case 'w': set = word(); return true;
+		case 'W': set = ~word(); return true;
+		case 's': set = space(); return true;
+		case 'S': set = ~space(); return true;
+		case 'n': set = single('\n'); return true;
+		case 'r': set = single('\r'); return true;
+		case 't': set = single('\t'); return true;
+		case 'f': set = single('\f'); return true;
+		case 'v': set = single('\v'); return true;
+		case '0': set = single('\0'); return true;
+		case 'b':
+			if (in_class) {
+				set = single('\b');
+				return true;
+			}
+			return false;
+		default:
+			// Back references, word boundaries and the numeric escapes are not supported.
+			if ((e >= '0' && e <= '9') || (e >= 'a' && e <= 'z') || (e >= 'A' && e <= 'Z')) {
+				return false;
+			}
+			set = single((uint8_t)e);
+			return true;
+		}
+	}
+
+	// Parses one class member, single is set if it is a single character that can start or end a range.
+	bool parse_class_atom(char_set& set, int& single_char) {
+		if (!more()) {
+			return false;
+		}
+		char c = p_[pos_++];
+		if (c == '\\') {
+			if (!parse_escape(set, true)) {
+				return false;
+			}
+			single_char = -1;
+			if (set.count() == 1) {
+				for (int i = 0; i < 256; ++i) {
+					if (set[i]) {
+						single_char = i;
+					}
+				}
+			}
+			return true;
+		}
+		if (c == '[' && more() && (peek() == ':' || peek() == '=' || peek() == '.')) {
+			return false;
+		}
+		set = single((uint8_t)c);
+		single_char = (uint8_t)c;
+		return true;
+	}
+
+	frag parse_class() {
+		bool negate = more() && peek() == '^';
+		if (negate) {
+			++pos_;
+		}
+		char_set set;
+		while (true) {
+			if (!more()) {
+				return fail();
+			}
+			if (peek() == ']') {
+				++pos_;
+				break;
+			}
+			char_set atom;
+			int lo;
+			if (!parse_class_atom(atom, lo)) {
+				return fail();
+			}
+			if (pos_ + 1 < p_.size() && peek() == '-' && p_[pos_ + 1] != ']') {
+				++pos_;
+				int hi;
+				if (lo < 0 || !parse_class_atom(atom, hi) || hi < lo) {
+					return fail();
+				}
+				atom = range((uint8_t)lo, (uint8_t)hi);
+			}
+			set |= atom;
+		}
+		return b_.chars(negate ? ~set : set);
+	}
+
+	frag parse_atom() {
+		if (!more()) {
+			return fail();
+		}
+		char c = p_[pos_++];
+		switch (c) {
+		case '(': {
+			if (more() && peek() == '?') {
+				if (p_.substr(pos_, 2) != "?:") {
+					return fail();
+				}
+				pos_ += 2;
+			}
+			frag f = parse_alt();
+			if (!ok_ || !more() || peek() != ')') {
+				return fail();
+			}
+			++pos_;
+			return f;
+		}
+		case '[':
+			return parse_class();
+		case '.':
+			return b_.chars(~(single('\n') | single('\r')));
+		case '\\': {
+			char_set set;
+			if (!parse_escape(set, false)) {
+				return fail();
+			}
+			return b_.chars(set);
+		}
+		case ')':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		case '^':
+		case '$':
+			return fail();
+		default:
+			return b_.chars(single((uint8_t)c));
+		}
+	}
+};
+
+// Parses a glob bracket class after the opening bracket. Negated classes never match '/'.
+bool parse_glob_class(std::string_view p, size_t& pos, char_set& set) {
+	bool negate = pos < p.size() && (p[pos] == '!' || p[pos] == '^');
+	if (negate) {
+		++pos;
+	}
+	set.reset();
+	bool first = true;
+	while (true) {
+		if (pos >= p.size()) {
+			return false;
+		}
+		uint8_t c = p[pos++];
+		if (c == ']' && !first) {
+			break;
+		}
+		first = false;
+		if (c == '\\') {
+			if (pos >= p.size()) {
+				return false;
+			}
+			c = p[pos++];
+		}
+		if (pos + 1 < p.size() && p[pos] == '-' && p[pos + 1] != ']') {
+			uint8_t hi = p[pos + 1];
+			pos += 2;
+			if (hi < c) {
+				return false;
+			}
+			set |= range(c, hi);
+		}
+		else {
+			set.set(c);
+		}
+	}
+	if (negate) {
+		set.flip();
+		set.reset('/');
+	}
+	return true;
+}
+} // namespace
+
+bool path_matcher::add_glob(std::string_view pattern) {
+	size_t const nfa_size = nfa_.size();
+	nfa_builder b{*this};
+	char_set const any = ~char_set();
+	char_set const segment = ~single('/');
+	frag f = b.empty();
+	for (size_t pos = 0; pos < pattern.size();) {
+		char c = pattern[pos++];
+		switch (c) {
+		case '*':
+			if (pos < pattern.size() && pattern[pos] == '*') {
+				++pos;
+				if (pos < pattern.size() && pattern[pos] == '/') {
+					++pos;
+					f = b.cat(std::move(f), b.opt(b.cat(b.star(b.chars(any)), b.chars(single('/')))));
+				}
+				else {
+					f = b.cat(std::move(f), b.star(b.chars(any)));
+				}
+			}
+			else {
+				f = b.cat(std::move(f), b.star(b.chars(segment)));
+			}
+			break;
+		case '?':
+			f = b.cat(std::move(f), b.chars(segment));
+			break;
+		case '[': {
+			char_set set;
+			if (!parse_glob_class(pattern, pos, set)) {
+				nfa_.resize(nfa_size);
+				return false;
+			}
+			f = b.cat(std::move(f), b.chars(set));
+			break;
+		}
+		case '\\':
+			if (pos >= pattern.size()) {
+				nfa_.resize(nfa_size);
+				return false;
+			}
+			f = b.cat(std::move(f), b.chars(single((uint8_t)pattern[pos++])));
+			break;
+		default:
+			f = b.cat(std::move(f), b.chars(single((uint8_t)c)));
+			break;
+		}
+	}
+	b.finish(f);
+	return true;
+}
+
+bool path_matcher::add_regex(std::string_view pattern) {
+	// The whole path has to match, which makes anchors at the ends redundant.
+	if (!pattern.empty() && pattern.front() == '^') {
+		pattern.remove_prefix(1);
+	}
+	if (!pattern.empty() && pattern.back() == '$') {
+		size_t backslashes = 0;
+		while (backslashes + 1 < pattern.size() && pattern[pattern.size() - 2 - backslashes] == '\\') {
+			++backslashes;
+		}
+		if (backslashes % 2 == 0) {
+			pattern.remove_suffix(1);
+		}
+	}
+
+	size_t const nfa_size = nfa_.size();
+	regex_parser parser{{*this}, pattern};
+	frag f = parser.parse_alt();
+	if (!parser.ok_ || parser.more()) {
+		nfa_.resize(nfa_size);
+		return false;
+	}
+	parser.b_.finish(f);
+	return true;
+}
+
+bool path_matcher::compile(bool case_fold, size_t max_states) {
+	std::vector<uint32_t> marks(nfa_.size(), 0);
+	uint32_t generation = 0;
+	std::vector<uint32_t> stack;
+
+	// Follows Split states from the seeds and returns the sorted Chars and Match states reached.
+	auto closure = [&](std::vector<uint32_t> const& seeds) {
+		++generation;
+		std::vector<uint32_t> set;
+		stack.assign(seeds.begin(), seeds.end());
+		while (!stack.empty()) {
+			uint32_t s = stack.back();
+			stack.pop_back();
+			if (marks[s] == generation) {
+				continue;
+			}
+			marks[s] = generation;
+			if (nfa_[s].kind_ == nfa_kind::Split) {
+				stack.push_back(nfa_[s].out1_);
+				stack.push_back(nfa_[s].out_);
+			}
+			else {
+				set.push_back(s);
+			}
+		}
+		std::sort(set.begin(), set.end());
+		return set;
+	};
+
+	std::map<std::vector<uint32_t>, uint32_t> ids;
+	std::vector<std::vector<uint32_t>> sets;
+	auto intern = [&](std::vector<uint32_t> set) {
+		auto I = ids.find(set);
+		if (I != ids.end()) {
+			return I->second;
+		}
+		uint32_t id = (uint32_t)sets.size();
+		ids.emplace(set, id);
+		sets.push_back(std::move(set));
+		return id;
+	};
+
+	intern({});
+	start_ = intern(closure(pattern_starts_));
+	transitions_.clear();
+	accepting_.clear();
+	std::vector<uint32_t> next;
+	for (size_t d = 0; d < sets.size(); ++d) {
+		if (sets.size() > max_states) {
+			return false;
+		}
+		transitions_.resize((d + 1) * 256);
+		accepting_.push_back(0);
+		for (uint32_t s : sets[d]) {
+			accepting_[d] |= nfa_[s].kind_ == nfa_kind::Match;
+		}
+		for (int c = 0; c < 256; ++c) {
+			if (case_fold && c >= 'A' && c <= 'Z') {
+				continue;
+			}
+			next.clear();
+			for (uint32_t s : sets[d]) {
+				if (nfa_[s].kind_ == nfa_kind::Chars && nfa_[s].chars_[c]) {
+					next.push_back(nfa_[s].out_);
+				}
+			}
+			uint32_t t = intern(closure(next));
+			transitions_[d * 256 + c] = t;
+			if (case_fold && c >= 'a' && c <= 'z') {
+				transitions_[d * 256 + c - 32] = t;
+			}
+		}
+	}
+
+	// States from which no pattern can still match go to DEAD, so that walks can stop there.
+	size_t const state_count = sets.size();
+	std::vector<std::vector<uint32_t>> predecessors(state_count);
+	std::vector<uint32_t> successors;
+	for (size_t d = 0; d < state_count; ++d) {
+		successors.assign(&transitions_[d * 256], &transitions_[d * 256] + 256);
+		std::sort(successors.begin(), successors.end());
+		successors.erase(std::unique(successors.begin(), successors.end()), successors.end());
+		for (uint32_t t : successors) {
+			predecessors[t].push_back((uint32_t)d);
+		}
+	}
+	std::vector<uint8_t> live(state_count, 0);
+	stack.clear();
+	for (size_t d = 0; d < state_count; ++d) {
+		if (accepting_[d]) {
+			live[d] = 1;
+			stack.push_back((uint32_t)d);
+		}
+	}
+	while (!stack.empty()) {
+		uint32_t d = stack.back();
+		stack.pop_back();
+		for (uint32_t p : predecessors[d]) {
+			if (!live[p]) {
+				live[p] = 1;
+				stack.push_back(p);
+			}
+		}
+	}
+	for (auto& t : transitions_) {
+		if (!live[t]) {
+			t = DEAD;
+		}
+	}
+	if (!live[start_]) {
+		start_ = DEAD;
+	}
+	return true;
+}
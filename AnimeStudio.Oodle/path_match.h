@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <bitset>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/* Matches paths against any number of glob patterns and regular expressions in one pass.
+* All patterns are compiled into a single DFA over bytes that accepts a path if any pattern matches all of it.
+* States from which no pattern can match any more are merged into DEAD, so a caller walking a path byte by
+* byte, or prefix by prefix, can stop as soon as it reaches DEAD.
+*
+* Globs: '*' and '?' match within a path segment, '**' matches across segments and '**' followed by '/' also
+* matches no directory at all. Bracket classes take '!' or '^' for negation.
+*
+* Regular expressions are the ECMAScript subset of std::regex that maps onto a DFA: literals, '.', bracket classes,
+* \d \w \s and their negations, groups, '|' and the '*' '+' '?' and {n,m} quantifiers. A leading '^' and a trailing
+* '$' are accepted, since the whole path has to match anyway. Patterns using anything else are rejected by
+* add_regex and have to be matched some other way.
+*/
+struct path_matcher {
+	bool add_glob(std::string_view pattern);
+	bool add_regex(std::string_view pattern);
+
+	/* Builds the DFA. With case_fold, upper case ASCII letters in paths match as their lower case forms.
+	* Returns false if the DFA would need more than max_states states.
+	*/
+	bool compile(bool case_fold, size_t max_states = 1 << 14);
+
+	static uint32_t const DEAD = 0;
+
+	uint32_t start() const { return start_; }
+	uint32_t step(uint32_t state, uint8_t c) const { return transitions_[(size_t)state * 256 + c]; }
+	uint32_t step(uint32_t state, std::string_view s) const {
+		for (size_t i = 0; i < s.size() && state != DEAD; ++i) {
+			state = step(state, (uint8_t)s[i]);
+		}
+		return state;
+	}
+	bool accepts(uint32_t state) const { return accepting_[state] != 0; }
+	bool match(std::string_view path) const { return accepts(step(start_, path)); }
+
+	enum class nfa_kind : uint8_t {
+		Chars,
+		Split,
+		Match,
+	};
+
+	/* Thompson NFA state. Chars states consume one byte in chars_ and continue at out_, Split states continue at
+	* both out_ and out1_ without consuming anything.
+	*/
+	struct nfa_state {
+		nfa_kind kind_;
+		std::bitset<256> chars_;
+		uint32_t out_;
+		uint32_t out1_;
+	};
+
+	std::vector<nfa_state> nfa_;
+	std::vector<uint32_t> pattern_starts_;
+	uint32_t start_ = DEAD;
+	std::vector<uint32_t> transitions_;
+	std::vector<uint8_t> accepting_;
+};
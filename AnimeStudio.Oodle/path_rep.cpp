@@ -25,52 +25,11 @@
 * done to emit a single string as-is.
 */
 std::vector<std::string> generate_paths(void const* spec_data, size_t spec_size) {
-	reader r(spec_data, spec_size);
-
-	bool base_phase = false;
-	std::vector<std::string> bases;
+	path_rep_generator gen;
 	std::vector<std::string> results;
-	while (r.n_) {
-		uint32_t cmd;
-		if (!r.read(cmd)) {
-			abort();
-		}
-		if (cmd == 0) {
-			base_phase = !base_phase;
-			if (base_phase) {
-				bases.clear();
-			}
-		}
-		if (cmd != 0) {
-			std::string fragment;
-			if (!r.read(fragment)) {
-				abort();
-			}
-
-			// the input is one-indexed
-			size_t index = cmd - 1;
-			if (index < bases.size()) {
-				// Back-ref to existing string, concatenate and insert/emit.
-				std::string full = bases[index] + fragment;
-				if (base_phase) {
-					bases.push_back(full);
-				}
-				else {
-					results.push_back(full);
-				}
-			}
-			else {
-				// New string, insert or emit as-is.
-				if (base_phase) {
-					bases.push_back(fragment);
-				}
-				else {
-					results.push_back(fragment);
-				}
-			}
-		}
+	if (!gen.generate(spec_data, spec_size, [&](std::string_view path) { results.emplace_back(path); })) {
+		abort();
 	}
-
 	return results;
 }
 
@@ -1,7 +1,150 @@
 #pragma once
 
+#include <stdint.h>
+#include <string.h>
+
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+/* Generates the paths of a path rep spec, see path_rep.cpp for the format.
+* Base strings live back to back in one arena and each path is assembled in a scratch string, both reused
+* across calls, so that generating paths does not allocate once the buffers have grown.
+*/
+struct path_rep_generator {
+	/* Calls emit(std::string_view) for every generated path, in order. The view is null-terminated and only
+	* valid during the call. Returns false if the spec is malformed.
+	*/
+	template <typename Emit>
+	bool generate(void const* spec_data, size_t spec_size, Emit&& emit);
+
+	/* Like generate, but only emits the paths a path_matcher accepts. The matcher state is carried along the
+	* bases, so every byte is matched once per base rather than once per path, and bases from which nothing
+	* can match are neither assembled nor extended.
+	*/
+	template <typename Matcher, typename Emit>
+	bool generate_matching(void const* spec_data, size_t spec_size, Matcher const& matcher, Emit&& emit);
+
+	/* Parses a spec, calling on_reset() whenever the base set is cleared, and on_base(index, fragment) or
+	* on_path(index, fragment) for every string, where index is the zero-based base referenced.
+	*/
+	template <typename OnReset, typename OnBase, typename OnPath>
+	static bool walk(void const* spec_data, size_t spec_size, OnReset&& on_reset, OnBase&& on_base, OnPath&& on_path);
+
+	void push_base(size_t index, std::string_view fragment);
+	std::string_view assemble(size_t index, std::string_view fragment);
+
+	std::string arena_;
+	std::vector<std::pair<size_t, size_t>> bases_;
+	std::vector<uint32_t> base_states_;
+	std::string path_;
+};
+
 std::vector<std::string> generate_paths(void const* spec_data, size_t spec_size);
-void explain_paths(void const* spec_data, size_t spec_size);
\ No newline at end of file
+void explain_paths(void const* spec_data, size_t spec_size);
+
+template <typename OnReset, typename OnBase, typename OnPath>
+bool path_rep_generator::walk(void const* spec_data, size_t spec_size, OnReset&& on_reset, OnBase&& on_base,
+	OnPath&& on_path) {
+	auto const* p = reinterpret_cast<char const*>(spec_data);
+	auto const* end = p + spec_size;
+
+	bool base_phase = false;
+	on_reset();
+	while (p != end) {
+		uint32_t cmd;
+		if (size_t(end - p) < sizeof(cmd)) {
+			return false;
+		}
+		memcpy(&cmd, p, sizeof(cmd));
+		p += sizeof(cmd);
+		if (cmd == 0) {
+			base_phase = !base_phase;
+			if (base_phase) {
+				on_reset();
+			}
+			continue;
+		}
+
+		auto const* fragment_end = reinterpret_cast<char const*>(memchr(p, 0, end - p));
+		if (!fragment_end) {
+			return false;
+		}
+		std::string_view fragment(p, fragment_end - p);
+		p = fragment_end + 1;
+
+		// the input is one-indexed
+		if (base_phase) {
+			on_base(size_t(cmd - 1), fragment);
+		}
+		else {
+			on_path(size_t(cmd - 1), fragment);
+		}
+	}
+	return true;
+}
+
+inline void path_rep_generator::push_base(size_t index, std::string_view fragment) {
+	size_t base_offset = 0, base_size = 0;
+	if (index < bases_.size()) {
+		std::tie(base_offset, base_size) = bases_[index];
+	}
+	size_t offset = arena_.size();
+	arena_.resize(offset + base_size + fragment.size());
+	memcpy(&arena_[offset], arena_.data() + base_offset, base_size);
+	memcpy(&arena_[offset + base_size], fragment.data(), fragment.size());
+	bases_.emplace_back(offset, base_size + fragment.size());
+}
+
+inline std::string_view path_rep_generator::assemble(size_t index, std::string_view fragment) {
+	if (index < bases_.size()) {
+		path_.assign(arena_, bases_[index].first, bases_[index].second);
+	}
+	else {
+		path_.clear();
+	}
+	path_.append(fragment);
+	return path_;
+}
+
+template <typename Emit>
+bool path_rep_generator::generate(void const* spec_data, size_t spec_size, Emit&& emit) {
+	return walk(
+		spec_data, spec_size,
+		[&] {
+			arena_.clear();
+			bases_.clear();
+		},
+		[&](size_t index, std::string_view fragment) { push_base(index, fragment); },
+		[&](size_t index, std::string_view fragment) { emit(assemble(index, fragment)); });
+}
+
+template <typename Matcher, typename Emit>
+bool path_rep_generator::generate_matching(void const* spec_data, size_t spec_size, Matcher const& matcher,
+	Emit&& emit) {
+	auto base_state = [&](size_t index) { return index < base_states_.size() ? base_states_[index] : matcher.start(); };
+	return walk(
+		spec_data, spec_size,
+		[&] {
+			arena_.clear();
+			bases_.clear();
+			base_states_.clear();
+		},
+		[&](size_t index, std::string_view fragment) {
+			uint32_t state = matcher.step(base_state(index), fragment);
+			base_states_.push_back(state);
+			if (state == Matcher::DEAD) {
+				bases_.emplace_back(0, 0);
+			}
+			else {
+				push_base(index, fragment);
+			}
+		},
+		[&](size_t index, std::string_view fragment) {
+			if (matcher.accepts(matcher.step(base_state(index), fragment))) {
+				emit(assemble(index, fragment));
+			}
+		});
+}